@@ -0,0 +1,64 @@
+#define _GNU_SOURCE // for sched_getcpu
+
+#include <sched.h>
+
+#include "BRLock.h"
+#include "err.h"
+
+void brlock_init(struct BRLock *brlock) {
+  int err;
+  for (int i = 0; i < BRLOCK_SHARDS; i++) {
+    if ((err = pthread_rwlock_init(&(brlock->shards[i].lock), 0)) != 0) {
+      syserr(err, "rwlock_init failed");
+    }
+  }
+}
+
+void brlock_destroy(struct BRLock *brlock) {
+  int err;
+  for (int i = 0; i < BRLOCK_SHARDS; i++) {
+    if ((err = pthread_rwlock_destroy(&(brlock->shards[i].lock))) != 0) {
+      syserr(err, "rwlock_destroy failed");
+    }
+  }
+}
+
+int brlock_read_lock(struct BRLock *brlock) {
+  // the thread may migrate before it unlocks, so the shard is remembered
+  int shard = brlock_current_cpu() % BRLOCK_SHARDS;
+  int err;
+  if ((err = pthread_rwlock_rdlock(&(brlock->shards[shard].lock))) != 0) {
+    syserr(err, "rwlock_rdlock failed");
+  }
+  return shard;
+}
+
+void brlock_read_unlock(struct BRLock *brlock, int shard) {
+  int err;
+  if ((err = pthread_rwlock_unlock(&(brlock->shards[shard].lock))) != 0) {
+    syserr(err, "rwlock_unlock failed");
+  }
+}
+
+void brlock_write_lock(struct BRLock *brlock) {
+  int err;
+  for (int i = 0; i < BRLOCK_SHARDS; i++) {
+    if ((err = pthread_rwlock_wrlock(&(brlock->shards[i].lock))) != 0) {
+      syserr(err, "rwlock_wrlock failed");
+    }
+  }
+}
+
+void brlock_write_unlock(struct BRLock *brlock) {
+  int err;
+  for (int i = 0; i < BRLOCK_SHARDS; i++) {
+    if ((err = pthread_rwlock_unlock(&(brlock->shards[i].lock))) != 0) {
+      syserr(err, "rwlock_unlock failed");
+    }
+  }
+}
+
+int brlock_current_cpu(void) {
+  int cpu = sched_getcpu();
+  return cpu < 0 ? 0 : cpu;
+}
@@ -0,0 +1,42 @@
+#ifndef MIMUW_FORK__BRLOCK_H_
+#define MIMUW_FORK__BRLOCK_H_
+
+#include <pthread.h>
+
+// Number of shards of a big-reader lock.
+#define BRLOCK_SHARDS 16
+
+/**
+ * Big-reader lock: a reader/writer lock split into shards, one per group of
+ * CPUs. A reader takes only the shard of the CPU it runs on, so readers on
+ * different CPUs don't contend for one cache line, and a writer takes all of
+ * them. Meant for locks taken very often for reading and rarely for writing.
+ */
+struct BRLock {
+  struct {
+    _Alignas(64) pthread_rwlock_t lock;
+  } shards[BRLOCK_SHARDS];
+};
+
+void brlock_init(struct BRLock *brlock);
+
+void brlock_destroy(struct BRLock *brlock);
+
+/**
+ * Takes a big-reader lock for reading.
+ * @return the shard taken, to be passed to brlock_read_unlock
+ */
+int brlock_read_lock(struct BRLock *brlock);
+
+void brlock_read_unlock(struct BRLock *brlock, int shard);
+
+void brlock_write_lock(struct BRLock *brlock);
+
+void brlock_write_unlock(struct BRLock *brlock);
+
+/**
+ * Returns the number of the CPU the calling thread runs on (0 if unknown).
+ */
+int brlock_current_cpu(void);
+
+#endif // MIMUW_FORK__BRLOCK_H_
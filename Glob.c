@@ -0,0 +1,300 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "Glob.h"
+#include "path_utils.h"
+
+#define ALL_LETTERS ((1u << 26) - 1)
+
+/**
+ * One character of a component: a star, or the set of letters it matches
+ * (one for a literal, all for '?').
+ */
+struct GlobToken {
+  bool is_star;
+  uint32_t letters;
+};
+
+struct GlobComponent {
+  bool is_any_depth; // "**"
+  struct GlobToken *tokens;
+  int tokens_count;
+  char *prefix; // the letters of the literal tokens it starts with
+  size_t prefix_length;
+};
+
+struct Glob {
+  struct GlobComponent components[GLOB_MAX_COMPONENTS];
+  int components_count;
+  struct GlobToken *tokens; // of all the components
+  char *prefixes;           // of all the components
+  char *literal_path;
+  GlobStates start;
+};
+
+uint32_t letter_bit(char c) { return 1u << (c - 'a'); }
+
+GlobStates state_bit(int index) { return (GlobStates)1 << index; }
+
+/**
+ * Compiles a class, like "[a-c]" or "[!x]", starting at pattern.
+ * @return the character after it, or NULL if it isn't a valid class
+ */
+const char *compile_class(const char *pattern, const char *end,
+                          uint32_t *letters) {
+  const char *c = pattern + 1;
+  bool is_negated = c < end && (*c == '!' || *c == '^');
+  if (is_negated) {
+    c++;
+  }
+  *letters = 0;
+  while (c < end && *c != ']') {
+    if (*c < 'a' || *c > 'z') {
+      return NULL;
+    }
+    char last = *c;
+    if (c + 2 < end && c[1] == '-' && c[2] != ']') {
+      last = c[2];
+      if (last < *c || last > 'z') {
+        return NULL;
+      }
+    }
+    for (char letter = *c; letter <= last; letter++) {
+      *letters |= letter_bit(letter);
+    }
+    c += last == *c ? 1 : 3;
+  }
+  if (c == end || *letters == 0) {
+    return NULL;
+  }
+  if (is_negated) {
+    *letters = ~*letters & ALL_LETTERS;
+  }
+  return c + 1;
+}
+
+/**
+ * Compiles a component [start, end) of a pattern into tokens.
+ * @return false if it isn't valid
+ */
+bool compile_component(struct GlobComponent *component, const char *start,
+                       const char *end, struct GlobToken *tokens,
+                       char *prefix) {
+  component->is_any_depth =
+      end - start == 2 && start[0] == '*' && start[1] == '*';
+  component->tokens = tokens;
+  component->tokens_count = 0;
+  component->prefix = prefix;
+  component->prefix_length = 0;
+  if (component->is_any_depth) {
+    return true;
+  }
+
+  bool is_literal = true;
+  const char *c = start;
+  while (c < end) {
+    struct GlobToken token = {false, ALL_LETTERS};
+    if (*c == '*') {
+      token.is_star = true;
+      c++;
+    } else if (*c == '?') {
+      c++;
+    } else if (*c == '[') {
+      c = compile_class(c, end, &token.letters);
+      if (c == NULL) {
+        return false;
+      }
+    } else if (*c >= 'a' && *c <= 'z') {
+      token.letters = letter_bit(*c);
+      c++;
+    } else {
+      return false;
+    }
+
+    bool is_literal_token = !token.is_star && token.letters != ALL_LETTERS &&
+                            (token.letters & (token.letters - 1)) == 0;
+    is_literal = is_literal && is_literal_token;
+    if (is_literal) {
+      prefix[component->prefix_length] = 'a' + __builtin_ctz(token.letters);
+      component->prefix_length++;
+    }
+    if (token.is_star && component->tokens_count > 0 &&
+        tokens[component->tokens_count - 1].is_star) {
+      continue; // many stars match what one does
+    }
+    tokens[component->tokens_count] = token;
+    component->tokens_count++;
+  }
+  return true;
+}
+
+/**
+ * Adds to states those reached from them without reading a name: a "**"
+ * may match no folders.
+ */
+GlobStates close_states(const Glob *glob, GlobStates states) {
+  for (int i = 0; i < glob->components_count; i++) {
+    if ((states & state_bit(i)) && glob->components[i].is_any_depth) {
+      states |= state_bit(i + 1);
+    }
+  }
+  return states;
+}
+
+Glob *glob_compile(const char *pattern) {
+  size_t length = strlen(pattern);
+  if (length == 0 || length > MAX_PATH_LENGTH || pattern[0] != '/' ||
+      pattern[length - 1] != '/') {
+    return NULL;
+  }
+
+  Glob *glob = malloc(sizeof(Glob));
+  CHECK_PTR(glob);
+  glob->tokens = malloc(length * sizeof(struct GlobToken));
+  CHECK_PTR(glob->tokens);
+  glob->prefixes = malloc(length);
+  CHECK_PTR(glob->prefixes);
+  glob->literal_path = NULL;
+  glob->components_count = 0;
+
+  size_t tokens_count = 0;
+  size_t prefixes_length = 0;
+  const char *start = pattern + 1;
+  while (start < pattern + length) {
+    const char *end = strchr(start, '/');
+    if (end == start || end - start > MAX_FOLDER_NAME_LENGTH ||
+        glob->components_count == GLOB_MAX_COMPONENTS) {
+      glob_free(glob);
+      return NULL;
+    }
+    struct GlobComponent *component =
+        &(glob->components[glob->components_count]);
+    if (!compile_component(component, start, end, glob->tokens + tokens_count,
+                           glob->prefixes + prefixes_length)) {
+      glob_free(glob);
+      return NULL;
+    }
+    tokens_count += component->tokens_count;
+    prefixes_length += component->prefix_length;
+    glob->components_count++;
+    start = end + 1;
+  }
+
+  // the literal components are looked up directly, not read by the automaton
+  glob->literal_path = malloc(length + 1);
+  CHECK_PTR(glob->literal_path);
+  size_t literal_length = 1;
+  glob->literal_path[0] = '/';
+  int literal_count = 0;
+  while (literal_count < glob->components_count) {
+    struct GlobComponent *component = &(glob->components[literal_count]);
+    if (component->is_any_depth ||
+        component->prefix_length != (size_t)component->tokens_count) {
+      break;
+    }
+    memcpy(glob->literal_path + literal_length, component->prefix,
+           component->prefix_length);
+    literal_length += component->prefix_length;
+    glob->literal_path[literal_length] = '/';
+    literal_length++;
+    literal_count++;
+  }
+  glob->literal_path[literal_length] = '\0';
+  glob->start = close_states(glob, state_bit(literal_count));
+  return glob;
+}
+
+void glob_free(Glob *glob) {
+  free(glob->tokens);
+  free(glob->prefixes);
+  free(glob->literal_path);
+  free(glob);
+}
+
+const char *glob_literal_path(const Glob *glob) { return glob->literal_path; }
+
+GlobStates glob_start(const Glob *glob) { return glob->start; }
+
+/**
+ * Returns whether a name matches a component that isn't "**". A star first
+ * matches nothing, and on a mismatch the last star matches one letter more.
+ */
+bool component_matches(const struct GlobComponent *component,
+                       const char *name) {
+  int token = 0;
+  int star = -1;
+  const char *star_name = NULL;
+  const char *c = name;
+  while (*c != '\0') {
+    if (token < component->tokens_count && component->tokens[token].is_star) {
+      star = token;
+      star_name = c;
+      token++;
+    } else if (token < component->tokens_count &&
+               (component->tokens[token].letters & letter_bit(*c))) {
+      token++;
+      c++;
+    } else if (star != -1) {
+      token = star + 1;
+      star_name++;
+      c = star_name;
+    } else {
+      return false;
+    }
+  }
+  while (token < component->tokens_count && component->tokens[token].is_star) {
+    token++;
+  }
+  return token == component->tokens_count;
+}
+
+GlobStates glob_step(const Glob *glob, GlobStates states, const char *name) {
+  GlobStates next = 0;
+  for (int i = 0; i < glob->components_count; i++) {
+    if (!(states & state_bit(i))) {
+      continue;
+    }
+    if (glob->components[i].is_any_depth) {
+      next |= state_bit(i);
+    } else if (component_matches(&(glob->components[i]), name)) {
+      next |= state_bit(i + 1);
+    }
+  }
+  return close_states(glob, next);
+}
+
+bool glob_is_match(const Glob *glob, GlobStates states) {
+  return states & state_bit(glob->components_count);
+}
+
+bool glob_can_continue(const Glob *glob, GlobStates states) {
+  return states & (state_bit(glob->components_count) - 1);
+}
+
+size_t glob_prefix(const Glob *glob, GlobStates states, char *prefix) {
+  size_t length = 0;
+  bool is_first = true;
+  for (int i = 0; i < glob->components_count; i++) {
+    if (!(states & state_bit(i))) {
+      continue;
+    }
+    const struct GlobComponent *component = &(glob->components[i]);
+    if (component->is_any_depth) {
+      length = 0;
+      break;
+    }
+    if (is_first) {
+      length = component->prefix_length;
+      memcpy(prefix, component->prefix, length);
+      is_first = false;
+    }
+    size_t common = 0;
+    while (common < length && common < component->prefix_length &&
+           prefix[common] == component->prefix[common]) {
+      common++;
+    }
+    length = common;
+  }
+  prefix[length] = '\0';
+  return length;
+}
@@ -0,0 +1,68 @@
+#ifndef MIMUW_FORK__GLOB_H_
+#define MIMUW_FORK__GLOB_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A glob pattern over paths, compiled into an automaton that reads a path one
+ * folder name at a time (see tree_glob).
+ * A pattern looks like a path, but its components may have '*' (any string),
+ * '?' (any letter) and classes like "[a-fx]" or "[!ab]" in them, and a "**"
+ * component matches any number of folders, none included.
+ * The automaton is nondeterministic, with a state per component (it's
+ * in the state of the component the next name is to be matched against),
+ * and a set of states as a bit mask, so a pattern has at most
+ * GLOB_MAX_COMPONENTS components.
+ */
+typedef struct Glob Glob;
+
+#define GLOB_MAX_COMPONENTS 63
+
+typedef uint64_t GlobStates;
+
+/**
+ * Compiles a pattern.
+ * @return the automaton, or NULL if the pattern isn't valid
+ */
+Glob *glob_compile(const char *pattern);
+
+void glob_free(Glob *glob);
+
+/**
+ * Returns the path made of the literal components the pattern starts with
+ * (components without wildcards), the only one that can match them.
+ */
+const char *glob_literal_path(const Glob *glob);
+
+/**
+ * Returns the states after reading the literal components.
+ */
+GlobStates glob_start(const Glob *glob);
+
+/**
+ * Returns the states after reading a folder name in given states, 0 if
+ * no path through it can match.
+ */
+GlobStates glob_step(const Glob *glob, GlobStates states, const char *name);
+
+/**
+ * Returns whether the path read up to given states matches.
+ */
+bool glob_is_match(const Glob *glob, GlobStates states);
+
+/**
+ * Returns whether a longer path than the one read up to given states can
+ * match.
+ */
+bool glob_can_continue(const Glob *glob, GlobStates states);
+
+/**
+ * Writes to prefix the longest string every name that can be read in given
+ * states starts with, and returns its length.
+ * @param prefix a buffer of size at least MAX_FOLDER_NAME_LENGTH + 1
+ */
+size_t glob_prefix(const Glob *glob, GlobStates states, char *prefix);
+
+#endif // MIMUW_FORK__GLOB_H_
@@ -8,23 +8,41 @@
 // I did not write it.
 
 
-// We fix the number of hash buckets for simplicity.
+// Number of hash buckets of a new map. Only hmap_compact changes it.
 #define N_BUCKETS 8
 
+// Max number of levels of the skip list keeping the keys sorted,
+// enough for 4^16 keys.
+#define MAX_LEVEL 16
+
 typedef struct Pair Pair;
 
 struct Pair {
-    char* key;
+    char* key; // Right after forward, unless it was renamed or is borrowed.
     void* value;
     Pair* next; // Next item in a single-linked list.
+    unsigned int hash; // Of the key.
+    int level;
+    Pair* forward[]; // Next items on each level of the skip list.
 };
 
 struct HashMap {
-    Pair* buckets[N_BUCKETS]; // Linked lists of key-value pairs.
+    Pair** buckets; // Linked lists of key-value pairs.
+    size_t n_buckets; // A power of two.
+    Pair* small_buckets[N_BUCKETS]; // The buckets, until there are more.
     size_t size; // total number of entries in map.
+    Pair* head[MAX_LEVEL]; // First items on each level of the skip list.
+    int level; // Number of levels in use.
+    unsigned int seed; // State of the generator of levels.
+    bool borrows_keys; // See hmap_new_borrowing.
 };
 
-static unsigned int get_hash(const char* key);
+static Pair* pair_new(HashMap* map, const char* key, int level);
+static void pair_free(HashMap* map, Pair* p);
+static int random_level(HashMap* map);
+static void skiplist_find(HashMap* map, const char* key, Pair*** update);
+static void skiplist_link(HashMap* map, Pair* p);
+static void skiplist_unlink(HashMap* map, Pair* p);
 
 HashMap* hmap_new()
 {
@@ -32,35 +50,51 @@ HashMap* hmap_new()
     if (!map)
         return NULL;
     memset(map, 0, sizeof(HashMap));
+    map->buckets = map->small_buckets;
+    map->n_buckets = N_BUCKETS;
+    map->level = 1;
+    map->seed = 2463534242u;
+    return map;
+}
+
+HashMap* hmap_new_borrowing()
+{
+    HashMap* map = hmap_new();
+    if (map)
+        map->borrows_keys = true;
     return map;
 }
 
 void hmap_free(HashMap* map)
 {
-    for (int h = 0; h < N_BUCKETS; ++h) {
+    for (size_t h = 0; h < map->n_buckets; ++h) {
         for (Pair* p = map->buckets[h]; p;) {
             Pair* q = p;
             p = p->next;
-            free(q->key);
-            free(q);
+            pair_free(map, q);
         }
     }
+    if (map->buckets != map->small_buckets)
+        free(map->buckets);
     free(map);
 }
 
-static Pair* hmap_find(HashMap* map, int h, const char* key)
+static Pair** hmap_find(HashMap* map, unsigned int hash, const char* key)
 {
-    for (Pair* p = map->buckets[h]; p; p = p->next) {
-        if (strcmp(key, p->key) == 0)
-            return p;
+    // The hashes are compared first, so most other keys aren't compared.
+    Pair** pp = &(map->buckets[hash & (map->n_buckets - 1)]);
+    while (*pp) {
+        Pair* p = *pp;
+        if (p->hash == hash && (key == p->key || strcmp(key, p->key) == 0))
+            return pp;
+        pp = &(p->next);
     }
-    return NULL;
+    return pp;
 }
 
 void* hmap_get(HashMap* map, const char* key)
 {
-    int h = get_hash(key);
-    Pair* p = hmap_find(map, h, key);
+    Pair* p = *hmap_find(map, hmap_hash(key), key);
     if (p)
         return p->value;
     else
@@ -68,38 +102,70 @@ void* hmap_get(HashMap* map, const char* key)
 }
 
 bool hmap_insert(HashMap* map, const char* key, void* value)
+{
+    return hmap_insert_hashed(map, key, hmap_hash(key), value);
+}
+
+bool hmap_insert_hashed(HashMap* map, const char* key, unsigned int hash, void* value)
 {
     if (!value)
         return false;
-    int h = get_hash(key);
-    Pair* p = hmap_find(map, h, key);
-    if (p)
+    if (*hmap_find(map, hash, key))
         return false; // Already exists.
-    Pair* new_p = malloc(sizeof(Pair));
-    new_p->key = strdup(key);
+    Pair* new_p = pair_new(map, key, random_level(map));
+    if (!new_p)
+        return false;
     new_p->value = value;
-    new_p->next = map->buckets[h];
-    map->buckets[h] = new_p;
+    new_p->hash = hash;
+    Pair** bucket = &(map->buckets[hash & (map->n_buckets - 1)]);
+    new_p->next = *bucket;
+    *bucket = new_p;
+    skiplist_link(map, new_p);
     map->size++;
     return true;
 }
 
 bool hmap_remove(HashMap* map, const char* key)
 {
-    int h = get_hash(key);
-    Pair** pp = &(map->buckets[h]);
-    while (*pp) {
-        Pair* p = *pp;
-        if (strcmp(key, p->key) == 0) {
-            *pp = p->next;
-            free(p->key);
-            free(p);
-            map->size--;
-            return true;
-        }
-        pp = &(p->next);
-    }
-    return false;
+    return hmap_remove_hashed(map, key, hmap_hash(key));
+}
+
+bool hmap_remove_hashed(HashMap* map, const char* key, unsigned int hash)
+{
+    Pair** pp = hmap_find(map, hash, key);
+    Pair* p = *pp;
+    if (!p)
+        return false;
+    *pp = p->next;
+    skiplist_unlink(map, p);
+    pair_free(map, p);
+    map->size--;
+    return true;
+}
+
+bool hmap_rename(HashMap* map, const char* key, const char* new_key)
+{
+    unsigned int new_hash = hmap_hash(new_key);
+    if (*hmap_find(map, new_hash, new_key))
+        return false; // Already exists.
+    Pair** pp = hmap_find(map, hmap_hash(key), key);
+    Pair* p = *pp;
+    if (!p)
+        return false;
+    char* new_p_key = map->borrows_keys ? (char*)new_key : strdup(new_key);
+    if (!new_p_key)
+        return false;
+    *pp = p->next;
+    skiplist_unlink(map, p);
+    if (!map->borrows_keys && p->key != (char*)&p->forward[p->level])
+        free(p->key);
+    p->key = new_p_key;
+    p->hash = new_hash;
+    Pair** bucket = &(map->buckets[new_hash & (map->n_buckets - 1)]);
+    p->next = *bucket;
+    *bucket = p;
+    skiplist_link(map, p);
+    return true;
 }
 
 size_t hmap_size(HashMap* map)
@@ -116,7 +182,7 @@ HashMapIterator hmap_iterator(HashMap* map)
 bool hmap_next(HashMap* map, HashMapIterator* it, const char** key, void** value)
 {
     Pair* p = it->pair;
-    while (!p && it->bucket < N_BUCKETS - 1) {
+    while (!p && it->bucket < (int)map->n_buckets - 1) {
         p = map->buckets[++it->bucket];
     }
     if (!p)
@@ -127,12 +193,188 @@ bool hmap_next(HashMap* map, HashMapIterator* it, const char** key, void** value
     return true;
 }
 
-static unsigned int get_hash(const char* key)
+HashMapIterator hmap_sorted_iterator(HashMap* map)
+{
+    HashMapIterator it = { 0, map->head[0] };
+    return it;
+}
+
+HashMapIterator hmap_seek(HashMap* map, const char* key)
+{
+    Pair** update[MAX_LEVEL];
+    skiplist_find(map, key, update);
+    HashMapIterator it = { 0, *update[0] };
+    return it;
+}
+
+bool hmap_sorted_next(HashMap* map, HashMapIterator* it, const char** key, void** value)
+{
+    (void)map;
+    Pair* p = it->pair;
+    if (!p)
+        return false;
+    *key = p->key;
+    *value = p->value;
+    it->pair = p->forward[0];
+    return true;
+}
+
+size_t hmap_memory(HashMap* map, size_t* keys)
+{
+    size_t table = sizeof(HashMap);
+    if (map->buckets != map->small_buckets)
+        table += map->n_buckets * sizeof(Pair*);
+    for (Pair* p = map->head[0]; p; p = p->forward[0]) {
+        table += sizeof(Pair) + p->level * sizeof(Pair*);
+        if (!map->borrows_keys)
+            *keys += strlen(p->key) + 1;
+    }
+    return table;
+}
+
+void hmap_compact(HashMap* map)
 {
-    unsigned int hash = 17;
+    size_t n_buckets = N_BUCKETS;
+    while (n_buckets < map->size)
+        n_buckets *= 2;
+    Pair** buckets = map->small_buckets;
+    if (n_buckets > N_BUCKETS) {
+        buckets = calloc(n_buckets, sizeof(Pair*));
+        if (!buckets)
+            return;
+    }
+
+    // The pairs are moved in order, so each level of the skip list is built
+    // by appending to it.
+    Pair* old = map->head[0];
+    Pair** tails[MAX_LEVEL];
+    for (int i = 0; i < MAX_LEVEL; ++i) {
+        map->head[i] = NULL;
+        tails[i] = &map->head[i];
+    }
+    map->level = 1;
+    memset(map->small_buckets, 0, sizeof(map->small_buckets));
+
+    for (size_t index = 1; old; ++index) {
+        Pair* next_old = old->forward[0];
+        // Every fourth pair is a level higher than the ones between.
+        int level = 1;
+        for (size_t i = index; level < MAX_LEVEL && i % 4 == 0; i /= 4)
+            level++;
+        Pair* p = pair_new(map, old->key, level);
+        if (p) {
+            p->value = old->value;
+            p->hash = old->hash;
+            pair_free(map, old);
+        } else {
+            p = old; // Keeps its level, any level works.
+        }
+
+        int h = p->hash & (n_buckets - 1);
+        p->next = buckets[h];
+        buckets[h] = p;
+        for (int i = 0; i < p->level; ++i) {
+            p->forward[i] = NULL;
+            *tails[i] = p;
+            tails[i] = &p->forward[i];
+        }
+        if (p->level > map->level)
+            map->level = p->level;
+        old = next_old;
+    }
+
+    if (map->buckets != map->small_buckets)
+        free(map->buckets);
+    map->buckets = buckets;
+    map->n_buckets = n_buckets;
+}
+
+unsigned int hmap_hash(const char* key)
+{
+    // FNV-1a, whose high bits are as good as its low ones.
+    unsigned int hash = 2166136261u;
     while (*key) {
-        hash = (hash << 3) + hash + *key;
+        hash = (hash ^ (unsigned char)*key) * 16777619u;
         ++key;
     }
-    return hash % N_BUCKETS;
+    return hash;
+}
+
+// Allocate a pair with a given level, holding its copy of the key
+// (or the key itself, for a map that borrows them).
+static Pair* pair_new(HashMap* map, const char* key, int level)
+{
+    size_t key_size = map->borrows_keys ? 0 : strlen(key) + 1;
+    Pair* p = malloc(sizeof(Pair) + level * sizeof(Pair*) + key_size);
+    if (!p)
+        return NULL;
+    if (map->borrows_keys) {
+        p->key = (char*)key;
+    } else {
+        p->key = (char*)&p->forward[level];
+        memcpy(p->key, key, key_size);
+    }
+    p->level = level;
+    return p;
+}
+
+static void pair_free(HashMap* map, Pair* p)
+{
+    if (!map->borrows_keys && p->key != (char*)&p->forward[p->level])
+        free(p->key); // Copied by hmap_rename.
+    free(p);
+}
+
+// Each level holds about a quarter of the keys of the level below it.
+static int random_level(HashMap* map)
+{
+    // xorshift32
+    unsigned int x = map->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    map->seed = x;
+
+    int level = 1;
+    while (level < MAX_LEVEL && (x & 3) == 0) {
+        level++;
+        x >>= 2;
+    }
+    return level;
+}
+
+// Set `update[i]` to the link on level i after which `key` belongs,
+// so `*update[0]` is the first item with a key not less than `key`.
+static void skiplist_find(HashMap* map, const char* key, Pair*** update)
+{
+    Pair** links = map->head;
+    for (int i = map->level - 1; i >= 0; --i) {
+        while (links[i] && strcmp(links[i]->key, key) < 0)
+            links = links[i]->forward;
+        update[i] = &links[i];
+    }
+    for (int i = map->level; i < MAX_LEVEL; ++i)
+        update[i] = &map->head[i];
+}
+
+static void skiplist_link(HashMap* map, Pair* p)
+{
+    Pair** update[MAX_LEVEL];
+    skiplist_find(map, p->key, update);
+    if (p->level > map->level)
+        map->level = p->level;
+    for (int i = 0; i < p->level; ++i) {
+        p->forward[i] = *update[i];
+        *update[i] = p;
+    }
+}
+
+static void skiplist_unlink(HashMap* map, Pair* p)
+{
+    Pair** update[MAX_LEVEL];
+    skiplist_find(map, p->key, update);
+    for (int i = 0; i < p->level; ++i)
+        *update[i] = p->forward[i];
+    while (map->level > 1 && !map->head[map->level - 1])
+        map->level--;
 }
@@ -13,6 +13,11 @@ typedef struct HashMap HashMap;
 // Create a new, empty map.
 HashMap* hmap_new();
 
+// Create a new, empty map that doesn't copy its keys: the caller keeps them
+// valid for as long as they're in the map (like interned strings, which are
+// then compared by address before they're compared as strings).
+HashMap* hmap_new_borrowing();
+
 // Clear the map and free its memory. This frees the map and the keys
 // copied by hmap_insert, but does not free any values.
 void hmap_free(HashMap* map);
@@ -30,9 +35,31 @@ bool hmap_insert(HashMap* map, const char* key, void* value);
 // or do nothing and return false if `key` was not present.
 bool hmap_remove(HashMap* map, const char* key);
 
+// Return the hash of a key the map uses.
+unsigned int hmap_hash(const char* key);
+
+// Like `hmap_insert` and `hmap_remove`, for a caller that knows the hash of
+// `key` already (`hmap_hash(key)`, kept by an interned string for instance).
+bool hmap_insert_hashed(HashMap* map, const char* key, unsigned int hash, void* value);
+bool hmap_remove_hashed(HashMap* map, const char* key, unsigned int hash);
+
+// Move the value under `key` to `new_key` and return true, or do nothing and
+// return false if `key` was not present or `new_key` already exists.
+// The entry is re-keyed in place, only its copy of the key is replaced.
+bool hmap_rename(HashMap* map, const char* key, const char* new_key);
+
 // Return the number of elements in the map.
 size_t hmap_size(HashMap* map);
 
+// Return the bytes taken by the map and its entries, and add the bytes taken
+// by its copies of the keys to `*keys` (none if it borrows them).
+size_t hmap_memory(HashMap* map, size_t* keys);
+
+// Rebuild the map with as many buckets as it has keys (but at least as many
+// as a new map), reallocating its entries in sorted order, with the levels of
+// a balanced skip list. Invalidates iterators.
+void hmap_compact(HashMap* map);
+
 typedef struct HashMapIterator HashMapIterator;
 
 // Return an iterator to the map. See `hmap_next`.
@@ -54,6 +81,20 @@ HashMapIterator hmap_iterator(HashMap* map);
 // ```
 bool hmap_next(HashMap* map, HashMapIterator* it, const char** key, void** value);
 
+// Return an iterator to the map going through the keys in lexicographic
+// order. See `hmap_sorted_next`.
+// The keys are kept sorted as the map changes, so this takes O(1).
+HashMapIterator hmap_sorted_iterator(HashMap* map);
+
+// Return an iterator to the map going through the keys in lexicographic
+// order, starting at the first key not less than `key`.
+// See `hmap_sorted_next`. Takes O(log n) on average.
+HashMapIterator hmap_seek(HashMap* map, const char* key);
+
+// Like `hmap_next`, for iterators returned by `hmap_sorted_iterator`
+// and `hmap_seek`.
+bool hmap_sorted_next(HashMap* map, HashMapIterator* it, const char** key, void** value);
+
 struct HashMapIterator {
     int bucket;
     void* pair;
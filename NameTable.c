@@ -0,0 +1,187 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "HashMap.h"
+#include "NameTable.h"
+#include "err.h"
+#include "path_utils.h"
+
+#define NAME_SHARDS 64
+#define NAME_SHARD_BUCKETS 64 // at first, each shard doubles them as it grows
+
+struct Name {
+  struct Name *next; // in its bucket
+  unsigned int hash;
+  // taken only under the lock of the shard, and dropped without it unless
+  // it's the last one, so a name is never found while it's being freed
+  atomic_int references;
+  char text[];
+};
+
+/**
+ * A part of the table, of the names whose hash it's chosen by, with its own
+ * lock for all that's done with them.
+ */
+struct NameShard {
+  _Alignas(64) pthread_mutex_t lock;
+  struct Name **buckets;
+  size_t mask; // number of buckets - 1, a power of two - 1
+  size_t count;
+};
+
+struct NameTable {
+  struct NameShard shards[NAME_SHARDS];
+  atomic_size_t bytes; // of the names
+};
+
+static struct NameTable names;
+static pthread_once_t names_once = PTHREAD_ONCE_INIT;
+
+void names_init(void) {
+  int err;
+  for (int i = 0; i < NAME_SHARDS; i++) {
+    struct NameShard *shard = &(names.shards[i]);
+    if ((err = pthread_mutex_init(&(shard->lock), 0)) != 0) {
+      syserr(err, "mutex_init failed");
+    }
+    shard->buckets = calloc(NAME_SHARD_BUCKETS, sizeof(struct Name *));
+    CHECK_PTR(shard->buckets);
+    shard->mask = NAME_SHARD_BUCKETS - 1;
+    shard->count = 0;
+  }
+  atomic_init(&(names.bytes), 0);
+}
+
+struct Name *name_of(const char *interned) {
+  return (struct Name *)(interned - offsetof(struct Name, text));
+}
+
+struct NameShard *shard_of(unsigned int hash) {
+  // the low bits choose the bucket in it
+  return &(names.shards[(hash >> 24) % NAME_SHARDS]);
+}
+
+void shard_lock(struct NameShard *shard) {
+  int err;
+  if ((err = pthread_mutex_lock(&(shard->lock))) != 0) {
+    syserr(err, "mutex_lock failed");
+  }
+}
+
+void shard_unlock(struct NameShard *shard) {
+  int err;
+  if ((err = pthread_mutex_unlock(&(shard->lock))) != 0) {
+    syserr(err, "mutex_unlock failed");
+  }
+}
+
+/**
+ * Returns the link to a name in a shard, pointing to NULL if it isn't
+ * there, for a thread holding the shard's lock.
+ */
+struct Name **shard_find(struct NameShard *shard, unsigned int hash,
+                         const char *text) {
+  struct Name **link = &(shard->buckets[hash & shard->mask]);
+  while (*link != NULL) {
+    if ((*link)->hash == hash && strcmp((*link)->text, text) == 0) {
+      return link;
+    }
+    link = &((*link)->next);
+  }
+  return link;
+}
+
+/**
+ * Doubles the buckets of a shard, for a thread holding its lock.
+ */
+void shard_grow(struct NameShard *shard) {
+  size_t mask = 2 * shard->mask + 1;
+  struct Name **buckets = calloc(mask + 1, sizeof(struct Name *));
+  CHECK_PTR(buckets);
+  for (size_t i = 0; i <= shard->mask; i++) {
+    struct Name *name = shard->buckets[i];
+    while (name != NULL) {
+      struct Name *next = name->next;
+      name->next = buckets[name->hash & mask];
+      buckets[name->hash & mask] = name;
+      name = next;
+    }
+  }
+  free(shard->buckets);
+  shard->buckets = buckets;
+  shard->mask = mask;
+}
+
+const char *name_intern(const char *text) {
+  pthread_once(&names_once, names_init);
+  unsigned int hash = hmap_hash(text);
+  struct NameShard *shard = shard_of(hash);
+
+  shard_lock(shard);
+  struct Name **link = shard_find(shard, hash, text);
+  struct Name *name = *link;
+  if (name == NULL) {
+    size_t size = sizeof(struct Name) + strlen(text) + 1;
+    name = malloc(size);
+    CHECK_PTR(name);
+    strcpy(name->text, text);
+    name->hash = hash;
+    name->next = NULL;
+    atomic_init(&(name->references), 0);
+    *link = name;
+    atomic_fetch_add(&(names.bytes), size);
+    shard->count++;
+    if (shard->count > 2 * (shard->mask + 1)) {
+      shard_grow(shard);
+    }
+  }
+  atomic_fetch_add(&(name->references), 1);
+  shard_unlock(shard);
+  return name->text;
+}
+
+void name_release(const char *interned) {
+  if (interned == NULL) {
+    return;
+  }
+  struct Name *name = name_of(interned);
+  int references = atomic_load(&(name->references));
+  while (references > 1) {
+    if (atomic_compare_exchange_weak(&(name->references), &references,
+                                     references - 1)) {
+      return;
+    }
+  }
+
+  // it may be the last one, which is dropped under the lock
+  struct NameShard *shard = shard_of(name->hash);
+  shard_lock(shard);
+  if (atomic_fetch_sub(&(name->references), 1) == 1) {
+    struct Name **link = shard_find(shard, name->hash, name->text);
+    *link = name->next;
+    shard->count--;
+    atomic_fetch_sub(&(names.bytes),
+                     sizeof(struct Name) + strlen(name->text) + 1);
+    free(name);
+  }
+  shard_unlock(shard);
+}
+
+unsigned int name_interned_hash(const char *interned) {
+  return name_of(interned)->hash;
+}
+
+size_t name_memory(void) {
+  pthread_once(&names_once, names_init);
+  size_t bytes = sizeof(struct NameTable);
+  for (int i = 0; i < NAME_SHARDS; i++) {
+    struct NameShard *shard = &(names.shards[i]);
+    shard_lock(shard);
+    bytes += (shard->mask + 1) * sizeof(struct Name *);
+    shard_unlock(shard);
+  }
+  return bytes + atomic_load(&(names.bytes));
+}
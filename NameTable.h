@@ -0,0 +1,40 @@
+#ifndef MIMUW_FORK__NAME_TABLE_H_
+#define MIMUW_FORK__NAME_TABLE_H_
+
+#include <stddef.h>
+
+/**
+ * Interned folder names, shared by all the trees of a process: every
+ * directory keeps its name as a pointer to the one immutable copy of it,
+ * which its parent's map of children uses as the key as well, so a name
+ * that repeats across the tree is stored once, and two interned names are
+ * equal exactly when their addresses are. Each copy keeps its hash, the one
+ * the maps use (see hmap_hash).
+ * Names are counted references, taken by name_intern and dropped by
+ * name_release, and a name is freed along with its last reference.
+ * The table is split into shards by hash, each with its own lock.
+ */
+
+/**
+ * Returns the interned copy of a name, adding it to the table if it isn't
+ * there, and takes a reference to it.
+ */
+const char *name_intern(const char *name);
+
+/**
+ * Drops a reference to an interned name taken by name_intern, freeing the
+ * name if it was the last one. Does nothing for NULL.
+ */
+void name_release(const char *interned);
+
+/**
+ * Returns the hash of an interned name, hmap_hash of it.
+ */
+unsigned int name_interned_hash(const char *interned);
+
+/**
+ * Returns the number of bytes taken by the table and its names.
+ */
+size_t name_memory(void);
+
+#endif // MIMUW_FORK__NAME_TABLE_H_
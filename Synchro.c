@@ -1,27 +1,68 @@
+#include <errno.h>
+#include <unistd.h>
+
 #include "Synchro.h"
+#include "Trace.h"
 #include "err.h"
 
+// Bounds of how long a thread spins before blocking (see synchro_spin),
+// in pause instructions.
+#define SYNCHRO_MIN_SPINS 16
+#define SYNCHRO_MAX_SPINS 4096
+#define SYNCHRO_MAX_BACKOFF 64
+
+const struct timespec synchro_no_wait = {0, 0};
+
 void synchro_init(struct Synchro *synchronizer) {
+  synchro_init_with_policy(synchronizer, SYNCHRO_PHASE_FAIR);
+}
+
+void synchro_init_with_policy(struct Synchro *synchronizer,
+                              enum SynchroPolicy policy) {
   int err;
   if ((err = pthread_mutex_init(&(synchronizer->lock), 0)) != 0) {
     syserr(err, "mutex_init failed");
   }
-  if ((err = pthread_cond_init(&(synchronizer->can_modify), 0) != 0)) {
+
+  // deadlines are measured with a clock that doesn't jump
+  pthread_condattr_t attr;
+  if ((err = pthread_condattr_init(&attr)) != 0) {
+    syserr(err, "condattr_init failed");
+  }
+  if ((err = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)) != 0) {
+    syserr(err, "condattr_setclock failed");
+  }
+  if ((err = pthread_cond_init(&(synchronizer->can_modify), &attr) != 0)) {
     syserr(err, "cond_init failed");
   }
-  if ((err = pthread_cond_init(&(synchronizer->can_access), 0) != 0)) {
+  if ((err = pthread_cond_init(&(synchronizer->can_access), &attr) != 0)) {
     syserr(err, "cond_init failed");
   }
-  if ((err = pthread_cond_init(&(synchronizer->can_be_removed), 0) != 0)) {
+  if ((err = pthread_cond_init(&(synchronizer->can_be_removed), &attr) != 0)) {
     syserr(err, "cond_init failed");
   }
+  if ((err = pthread_condattr_destroy(&attr)) != 0) {
+    syserr(err, "condattr_destroy failed");
+  }
   synchronizer->is_modifying = false;
   synchronizer->modify_now = false;
   synchronizer->accessing_count = 0;
   synchronizer->accessing_waiting = 0;
   synchronizer->modifying_waiting = 0;
   synchronizer->how_many_to_wake = 0;
+  synchronizer->intending_count = 0;
+  synchronizer->intending_waiting = 0;
+  synchronizer->scanning_count = 0;
+  synchronizer->scanning_waiting = 0;
   synchronizer->want_to_be_removed = false;
+  synchronizer->is_dead = false;
+  synchronizer->release = NULL;
+  synchronizer->release_data = NULL;
+  atomic_init(&(synchronizer->releases), 0);
+  synchronizer->spin_estimate = 0;
+  synchronizer->policy = policy;
+  synchronizer->queue_head = NULL;
+  synchronizer->queue_tail = NULL;
 }
 
 void synchro_destroy(struct Synchro *synchronizer) {
@@ -40,34 +81,480 @@ void synchro_destroy(struct Synchro *synchronizer) {
   }
 }
 
-void synchro_visit(struct Synchro *synchronizer) {
+void synchro_cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#else
+  atomic_signal_fence(memory_order_seq_cst);
+#endif
+}
+
+/**
+ * Whether there's more than one CPU to run on. With one, the thread holding
+ * a node can't run while another one spins.
+ */
+bool synchro_can_spin(void) {
+  static atomic_int cpus = 0;
+  int count = atomic_load_explicit(&cpus, memory_order_relaxed);
+  if (count == 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    count = online > 1 ? (int)online : 1;
+    atomic_store_explicit(&cpus, count, memory_order_relaxed);
+  }
+  return count > 1;
+}
+
+/**
+ * Called (while holding the mutex) when a thread gives up rights to a node,
+ * so the threads spinning in synchro_spin look at it again.
+ */
+void synchro_note_release(struct Synchro *synchronizer) {
+  atomic_fetch_add_explicit(&(synchronizer->releases), 1,
+                            memory_order_relaxed);
+}
+
+/**
+ * Spins without the mutex, with exponential backoff, until some thread gives
+ * up rights to the node, but no longer than that usually takes for it.
+ * Critical sections are often a single lookup, so this saves a sleep and
+ * a wake-up. How long it takes is learned from the spins that saw a release,
+ * and the spins that didn't make the next ones shorter, so nodes held for
+ * long don't waste CPU. Called while holding the mutex.
+ * @return whether a release was seen
+ */
+bool synchro_spin(struct Synchro *synchronizer) {
+  if (!synchro_can_spin()) {
+    return false;
+  }
+  int limit = 2 * synchronizer->spin_estimate + SYNCHRO_MIN_SPINS;
+  if (limit > SYNCHRO_MAX_SPINS) {
+    limit = SYNCHRO_MAX_SPINS;
+  }
+  unsigned int seen =
+      atomic_load_explicit(&(synchronizer->releases), memory_order_relaxed);
+
   int err;
+  if ((err = pthread_mutex_unlock(&(synchronizer->lock))) != 0) {
+    syserr(err, "mutex_unlock failed");
+  }
+  int spins = 0;
+  int backoff = 1;
+  bool is_released = false;
+  while (spins < limit) {
+    for (int i = 0; i < backoff; i++) {
+      synchro_cpu_relax();
+    }
+    spins += backoff;
+    if (atomic_load_explicit(&(synchronizer->releases),
+                             memory_order_relaxed) != seen) {
+      is_released = true;
+      break;
+    }
+    if (backoff < SYNCHRO_MAX_BACKOFF) {
+      backoff *= 2;
+    }
+  }
   if ((err = pthread_mutex_lock(&(synchronizer->lock))) != 0) {
     syserr(err, "mutex_lock failed");
   }
+  // a release between the last look and taking the mutex back has already
+  // broadcast its signal, so waiting for one would never end
+  if (atomic_load_explicit(&(synchronizer->releases), memory_order_relaxed) !=
+      seen) {
+    is_released = true;
+  }
 
-  while (synchronizer->is_modifying || synchronizer->modify_now ||
-         synchronizer->modifying_waiting) {
+  if (is_released) {
+    synchronizer->spin_estimate += (spins - synchronizer->spin_estimate) / 8;
+  } else {
+    synchronizer->spin_estimate /= 2;
+  }
+  return is_released;
+}
 
-    synchronizer->accessing_waiting++;
+/**
+ * Tells which of a node's conditional variables a given one is, for probes.
+ */
+int synchro_wait_kind(struct Synchro *synchronizer, pthread_cond_t *cond) {
+  if (cond == &(synchronizer->can_access)) {
+    return TRACE_WAIT_ACCESS;
+  }
+  return cond == &(synchronizer->can_modify) ? TRACE_WAIT_MODIFY
+                                             : TRACE_WAIT_REMOVE;
+}
+
+/**
+ * Wakes up the threads waiting on a conditional variable of a node.
+ */
+void synchro_broadcast(struct Synchro *synchronizer, pthread_cond_t *cond) {
+  TRACE_PROBE(wake, synchronizer, synchro_wait_kind(synchronizer, cond));
+  int err;
+  if ((err = pthread_cond_broadcast(cond)) != 0) {
+    syserr(err, "cond_broadcast failed");
+  }
+}
 
-    if ((err = pthread_cond_wait(&(synchronizer->can_access),
-                                 &(synchronizer->lock))) != 0) {
+/**
+ * Waits on a conditional variable, but not past the deadline. Spins first
+ * (see synchro_spin), and returns after seeing a release like after a
+ * spurious wake-up, so the caller checks its condition again.
+ * @return 0 after being woken up, ETIMEDOUT or EWOULDBLOCK if the deadline
+ * has passed
+ */
+int synchro_wait(struct Synchro *synchronizer, pthread_cond_t *cond,
+                 const struct timespec *deadline) {
+  int err;
+  if (deadline == SYNCHRO_NO_WAIT) {
+    return EWOULDBLOCK;
+  }
+  // past the deadline, it has to be timed out by pthread_cond_timedwait
+  // rather than spin again and again
+  bool is_spinning = true;
+  if (deadline != NULL) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    is_spinning = now.tv_sec < deadline->tv_sec ||
+                  (now.tv_sec == deadline->tv_sec &&
+                   now.tv_nsec < deadline->tv_nsec);
+  }
+
+  struct timespec start;
+  bool is_timed = TRACE_ENABLED(wait_done);
+  if (is_timed) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+  }
+  int kind = synchro_wait_kind(synchronizer, cond);
+  TRACE_PROBE(wait_start, synchronizer, kind);
+
+  err = 0;
+  if (!is_spinning || !synchro_spin(synchronizer)) {
+    if (deadline == NULL) {
+      err = pthread_cond_wait(cond, &(synchronizer->lock));
+    } else {
+      err = pthread_cond_timedwait(cond, &(synchronizer->lock), deadline);
+    }
+    if (err != 0 && err != ETIMEDOUT) {
       syserr(err, "cond_wait failed");
     }
+  }
+  TRACE_PROBE(wait_done, synchronizer, kind,
+              is_timed ? trace_ns_since(&start) : -1L, err);
+  return err;
+}
+
+/**
+ * Releases the mutex. If the node is dead and the calling thread was the last
+ * one inside, releases the node too (see synchro_leave_after_remove).
+ */
+void synchro_unlock(struct Synchro *synchronizer) {
+  void (*release)(void *) = NULL;
+  void *release_data = synchronizer->release_data;
+  if (synchronizer->is_dead && synchronizer->release != NULL &&
+      synchronizer->accessing_count == 0 && !synchronizer->is_modifying &&
+      synchronizer->accessing_waiting == 0 &&
+      synchronizer->modifying_waiting == 0) {
+    release = synchronizer->release;
+    synchronizer->release = NULL;
+  }
+
+  int err;
+  if ((err = pthread_mutex_unlock(&(synchronizer->lock))) != 0) {
+    syserr(err, "mutex_unlock failed");
+  }
+  // the synchronizer may be gone from here on
+  if (release != NULL) {
+    release(release_data);
+  }
+}
+
+/**
+ * Wakes the thread removing the node once no writer is in or let in, and no
+ * thread intending to change it is in. Called while holding the mutex.
+ */
+void synchro_wake_remover(struct Synchro *synchronizer) {
+  if (synchronizer->want_to_be_removed && !synchronizer->is_modifying &&
+      !synchronizer->modify_now && synchronizer->intending_count == 0) {
+    synchro_broadcast(synchronizer, &(synchronizer->can_be_removed));
+  }
+}
+
+/**
+ * Wakes the threads waiting to intend to change the node, if nothing keeps
+ * them out anymore. Called while holding the mutex.
+ */
+void synchro_wake_intenders(struct Synchro *synchronizer) {
+  if (synchronizer->intending_waiting > 0 &&
+      !synchronizer->want_to_be_removed && synchronizer->scanning_count == 0 &&
+      synchronizer->scanning_waiting == 0) {
+    synchro_broadcast(synchronizer, &(synchronizer->can_access));
+  }
+}
+
+/**
+ * Wakes the threads waiting to read the whole node, once no thread intending
+ * to change it is in. Called while holding the mutex.
+ */
+void synchro_wake_scanners(struct Synchro *synchronizer) {
+  if (synchronizer->scanning_waiting > 0 &&
+      synchronizer->intending_count == 0) {
+    synchro_broadcast(synchronizer, &(synchronizer->can_access));
+  }
+}
+
+/**
+ * Wakes the threads kept out while the node was to be removed: the ones
+ * waiting to intend to change it, and the ones waiting for their turn to
+ * remove it. Called while holding the mutex.
+ */
+void synchro_wake_after_lifting_flag(struct Synchro *synchronizer) {
+  synchro_broadcast(synchronizer, &(synchronizer->can_be_removed));
+  synchro_wake_intenders(synchronizer);
+}
+
+/**
+ * Lets in the threads at the front of the queue of a SYNCHRO_FIFO node, as
+ * many as can get in together, and wakes the remover if no one's left.
+ * Called while holding the mutex.
+ */
+void synchro_fifo_wake(struct Synchro *synchronizer) {
+  synchro_note_release(synchronizer);
+  bool is_anyone_granted = false;
+  struct SynchroWaiter *waiter;
+  while ((waiter = synchronizer->queue_head) != NULL &&
+         !synchronizer->is_modifying) {
+    if (waiter->modify) {
+      if (synchronizer->accessing_count > 0 ||
+          synchronizer->want_to_be_removed) {
+        break;
+      }
+      synchronizer->is_modifying = true;
+      synchronizer->modifying_waiting--;
+    } else {
+      synchronizer->accessing_count++;
+      synchronizer->accessing_waiting--;
+    }
+    // the waiter can't leave before the mutex is released
+    synchronizer->queue_head = waiter->next;
+    waiter->granted = true;
+    is_anyone_granted = true;
+  }
+  if (synchronizer->queue_head == NULL) {
+    synchronizer->queue_tail = NULL;
+  }
+
+  if (is_anyone_granted) {
+    synchro_broadcast(synchronizer, &(synchronizer->can_access));
+  }
+  synchro_wake_remover(synchronizer);
+}
+
+/**
+ * Lets a thread into a SYNCHRO_FIFO node, after the ones that came before it.
+ * Called while holding the mutex.
+ * @return 0 on success, ETIMEDOUT or EWOULDBLOCK if the thread gave up
+ * (see synchro_wake_after_giving_up), ENOENT if the node is dead
+ */
+int synchro_fifo_enter(struct Synchro *synchronizer, bool modify,
+                       const struct timespec *deadline) {
+  if (synchronizer->is_dead) {
+    return ENOENT;
+  }
+  if (synchronizer->queue_head == NULL && !synchronizer->is_modifying &&
+      (!modify || (synchronizer->accessing_count == 0 &&
+                   !synchronizer->want_to_be_removed))) {
+    if (modify) {
+      synchronizer->is_modifying = true;
+    } else {
+      synchronizer->accessing_count++;
+    }
+    return 0;
+  }
+  if (deadline == SYNCHRO_NO_WAIT) {
+    return EWOULDBLOCK;
+  }
+
+  struct SynchroWaiter waiter = {.modify = modify, .granted = false};
+  waiter.next = NULL;
+  if (synchronizer->queue_tail == NULL) {
+    synchronizer->queue_head = &waiter;
+  } else {
+    synchronizer->queue_tail->next = &waiter;
+  }
+  synchronizer->queue_tail = &waiter;
+  if (modify) {
+    synchronizer->modifying_waiting++;
+  } else {
+    synchronizer->accessing_waiting++;
+  }
+
+  while (!waiter.granted) {
+    int wait_result =
+        synchro_wait(synchronizer, &(synchronizer->can_access),
+                     deadline);
+    // the queue is dropped as the node dies
+    if (synchronizer->is_dead && !waiter.granted) {
+      if (modify) {
+        synchronizer->modifying_waiting--;
+      } else {
+        synchronizer->accessing_waiting--;
+      }
+      return ENOENT;
+    }
+    // (even if the deadline has passed, what's granted is taken)
+    if (wait_result == ETIMEDOUT && !waiter.granted) {
+      struct SynchroWaiter **link = &(synchronizer->queue_head);
+      struct SynchroWaiter *prev = NULL;
+      while (*link != &waiter) {
+        prev = *link;
+        link = &((*link)->next);
+      }
+      *link = waiter.next;
+      if (synchronizer->queue_tail == &waiter) {
+        synchronizer->queue_tail = prev;
+      }
+      if (modify) {
+        synchronizer->modifying_waiting--;
+      } else {
+        synchronizer->accessing_waiting--;
+      }
+      return ETIMEDOUT;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Whether a thread that wants to visit a node has to wait, under a policy
+ * other than SYNCHRO_FIFO.
+ */
+bool synchro_must_reader_wait(struct Synchro *synchronizer) {
+  return synchronizer->is_modifying || synchronizer->modify_now ||
+         (synchronizer->modifying_waiting &&
+          synchronizer->policy != SYNCHRO_READER_PREFERRING);
+}
+
+/**
+ * Whether a thread that wants to modify a node has to wait, under a policy
+ * other than SYNCHRO_FIFO. A writer already let in doesn't wait for the node
+ * to be removed.
+ */
+bool synchro_must_writer_wait(struct Synchro *synchronizer) {
+  return !synchronizer->modify_now &&
+         (synchronizer->accessing_count > 0 || synchronizer->is_modifying ||
+          synchronizer->how_many_to_wake > 0 ||
+          synchronizer->want_to_be_removed);
+}
+
+/**
+ * Called (while holding the mutex) by a thread that stopped waiting without
+ * getting in, or gave up its rights without getting new ones. Lets in whoever
+ * could have been waiting just because of it.
+ */
+void synchro_wake_after_giving_up(struct Synchro *synchronizer) {
+  synchro_note_release(synchronizer);
+  if (synchronizer->policy == SYNCHRO_FIFO) {
+    synchro_fifo_wake(synchronizer);
+    return;
+  }
+
+  if (!synchronizer->is_modifying && !synchronizer->modify_now) {
+    if (synchronizer->accessing_count == 0 &&
+        synchronizer->how_many_to_wake == 0 &&
+        synchronizer->modifying_waiting > 0 &&
+        !synchronizer->want_to_be_removed) {
+      synchronizer->modify_now = true;
+      synchro_broadcast(synchronizer, &(synchronizer->can_modify));
+    } else if (synchronizer->modifying_waiting == 0 &&
+               synchronizer->accessing_waiting > 0) {
+      // readers were only waiting for writers to go first
+      synchro_broadcast(synchronizer, &(synchronizer->can_access));
+    }
+  }
+  synchro_wake_remover(synchronizer);
+}
+
+void synchro_visit(struct Synchro *synchronizer) {
+  synchro_visit_until(synchronizer, NULL);
+}
+
+/**
+ * extracted body of synchro_visit_until, to use in both synchro_visit_until
+ * and synchro_scan_until
+ */
+int synchro_visit_while_holding_mutex(struct Synchro *synchronizer,
+                                      const struct timespec *deadline) {
+  if (synchronizer->policy == SYNCHRO_FIFO) {
+    int result = synchro_fifo_enter(synchronizer, false, deadline);
+    if (result != 0) {
+      synchro_wake_after_giving_up(synchronizer);
+    }
+    return result;
+  }
+
+  while (synchronizer->is_dead || synchro_must_reader_wait(synchronizer)) {
+    if (synchronizer->is_dead) {
+      return ENOENT;
+    }
+    if (deadline == SYNCHRO_NO_WAIT) {
+      return EWOULDBLOCK;
+    }
+
+    synchronizer->accessing_waiting++;
+
+    int wait_result =
+        synchro_wait(synchronizer, &(synchronizer->can_access),
+                     deadline);
     synchronizer->accessing_waiting--;
 
     // imitating inheritance of critical section
+    // (even if the deadline has passed, what's granted is taken)
     if (synchronizer->how_many_to_wake > 0) {
       synchronizer->how_many_to_wake--;
       break;
     }
+
+    if (wait_result == ETIMEDOUT && !synchronizer->is_dead &&
+        synchro_must_reader_wait(synchronizer)) {
+      synchro_wake_after_giving_up(synchronizer);
+      return ETIMEDOUT;
+    }
   }
 
   synchronizer->accessing_count++;
+  return 0;
+}
 
-  if ((err = pthread_mutex_unlock(&(synchronizer->lock))) != 0) {
-    syserr(err, "mutex_unlock failed");
+int synchro_visit_until(struct Synchro *synchronizer,
+                        const struct timespec *deadline) {
+  int err;
+  if ((err = pthread_mutex_lock(&(synchronizer->lock))) != 0) {
+    syserr(err, "mutex_lock failed");
+  }
+
+  int result = synchro_visit_while_holding_mutex(synchronizer, deadline);
+
+  synchro_unlock(synchronizer);
+  return result;
+}
+
+/**
+ * extracted body of synchro_leave_after_visiting, to use by every thread
+ * surrendering reading rights
+ */
+void synchro_leave_while_holding_mutex(struct Synchro *synchronizer) {
+  synchronizer->accessing_count--;
+  synchro_note_release(synchronizer);
+
+  if (synchronizer->policy == SYNCHRO_FIFO) {
+    synchro_fifo_wake(synchronizer);
+  } else if (synchronizer->accessing_count == 0 &&
+             synchronizer->how_many_to_wake == 0 &&
+             synchronizer->modifying_waiting > 0 &&
+             !synchronizer->want_to_be_removed) {
+    synchronizer->modify_now = true;
+    synchro_broadcast(synchronizer, &(synchronizer->can_modify));
   }
 }
 
@@ -76,76 +563,186 @@ void synchro_leave_after_visiting(struct Synchro *synchronizer) {
   if ((err = pthread_mutex_lock(&(synchronizer->lock))) != 0) {
     syserr(err, "mutex_lock failed");
   }
-  synchronizer->accessing_count--;
+  synchro_leave_while_holding_mutex(synchronizer);
+  synchro_unlock(synchronizer);
+}
 
-  if (synchronizer->accessing_count == 0 &&
-      synchronizer->how_many_to_wake == 0 &&
-      synchronizer->modifying_waiting > 0) {
-    synchronizer->modify_now = true;
-    if ((err = pthread_cond_broadcast(&(synchronizer->can_modify))) != 0) {
-      syserr(err, "cond_broadcast failed");
+int synchro_scan_until(struct Synchro *synchronizer,
+                       const struct timespec *deadline) {
+  int err;
+  if ((err = pthread_mutex_lock(&(synchronizer->lock))) != 0) {
+    syserr(err, "mutex_lock failed");
+  }
+
+  int result = synchro_visit_while_holding_mutex(synchronizer, deadline);
+  // the thread is a reader already, so it doesn't hold up the writers any
+  // more than it would have anyway
+  while (result == 0 && synchronizer->intending_count > 0) {
+    synchronizer->scanning_waiting++;
+    int wait_result =
+        synchro_wait(synchronizer, &(synchronizer->can_access), deadline);
+    synchronizer->scanning_waiting--;
+    if (wait_result != 0 && synchronizer->intending_count > 0) {
+      synchro_leave_while_holding_mutex(synchronizer);
+      synchro_wake_intenders(synchronizer);
+      result = wait_result;
     }
-  } else if (synchronizer->accessing_count == 0 &&
-             synchronizer->accessing_waiting == 0 &&
-             synchronizer->modifying_waiting == 0 &&
-             synchronizer->want_to_be_removed) {
-    if ((err = pthread_cond_broadcast(&(synchronizer->can_be_removed))) != 0) {
-      syserr(err, "cond_broadcast failed");
+  }
+  if (result == 0) {
+    synchronizer->scanning_count++;
+  }
+
+  synchro_unlock(synchronizer);
+  return result;
+}
+
+void synchro_leave_after_scanning(struct Synchro *synchronizer) {
+  int err;
+  if ((err = pthread_mutex_lock(&(synchronizer->lock))) != 0) {
+    syserr(err, "mutex_lock failed");
+  }
+  synchronizer->scanning_count--;
+  synchro_leave_while_holding_mutex(synchronizer);
+  synchro_wake_intenders(synchronizer);
+  synchro_unlock(synchronizer);
+}
+
+/**
+ * Whether a reader that wants to intend to change the node has to wait.
+ * Readers of the whole node waiting already go first, so a stream of threads
+ * changing its parts doesn't keep them out.
+ */
+bool synchro_must_intender_wait(struct Synchro *synchronizer) {
+  return synchronizer->want_to_be_removed ||
+         synchronizer->scanning_count > 0 ||
+         synchronizer->scanning_waiting > 0;
+}
+
+int synchro_change_from_visiting_to_intent_until(
+    struct Synchro *synchronizer, const struct timespec *deadline) {
+  int err;
+  if ((err = pthread_mutex_lock(&(synchronizer->lock))) != 0) {
+    syserr(err, "mutex_lock failed");
+  }
+
+  int result = 0;
+  while (!synchronizer->is_dead && synchro_must_intender_wait(synchronizer)) {
+    synchronizer->intending_waiting++;
+    int wait_result =
+        synchro_wait(synchronizer, &(synchronizer->can_access), deadline);
+    synchronizer->intending_waiting--;
+    if (wait_result != 0 && !synchronizer->is_dead &&
+        synchro_must_intender_wait(synchronizer)) {
+      result = wait_result;
+      break;
     }
   }
-  if ((err = pthread_mutex_unlock(&(synchronizer->lock))) != 0) {
-    syserr(err, "mutex_unlock failed");
+  if (result == 0 && synchronizer->is_dead) {
+    result = ENOENT;
   }
+
+  if (result == 0) {
+    synchronizer->intending_count++;
+  } else {
+    synchro_leave_while_holding_mutex(synchronizer);
+  }
+  synchro_unlock(synchronizer);
+  return result;
+}
+
+void synchro_leave_after_intending(struct Synchro *synchronizer) {
+  int err;
+  if ((err = pthread_mutex_lock(&(synchronizer->lock))) != 0) {
+    syserr(err, "mutex_lock failed");
+  }
+  synchronizer->intending_count--;
+  synchro_leave_while_holding_mutex(synchronizer);
+  synchro_wake_scanners(synchronizer);
+  synchro_wake_remover(synchronizer);
+  synchro_unlock(synchronizer);
 }
 
 /**
  * extracted body of synchro_modify, to use in both synchro_modify and
  * synchro_change_from_visiting_to_mod
+ * @return 0 on success, ETIMEDOUT or EWOULDBLOCK if the thread gave up,
+ * ENOENT if the node is dead
  */
-void synchro_modify_while_holding_mutex(struct Synchro *synchronizer) {
-  int err;
+int synchro_modify_while_holding_mutex(struct Synchro *synchronizer,
+                                       const struct timespec *deadline) {
+  if (synchronizer->policy == SYNCHRO_FIFO) {
+    return synchro_fifo_enter(synchronizer, true, deadline);
+  }
 
-  while (!synchronizer->modify_now &&
-         (synchronizer->accessing_count > 0 || synchronizer->is_modifying ||
-          synchronizer->how_many_to_wake > 0)) {
+  while (synchronizer->is_dead || synchro_must_writer_wait(synchronizer)) {
+    if (synchronizer->is_dead) {
+      return ENOENT;
+    }
+    if (deadline == SYNCHRO_NO_WAIT) {
+      return EWOULDBLOCK;
+    }
 
     synchronizer->modifying_waiting++;
-    if ((err = pthread_cond_wait(&(synchronizer->can_modify),
-                                 &(synchronizer->lock))) != 0) {
-      syserr(err, "cond_wait failed");
-    }
+    int wait_result =
+        synchro_wait(synchronizer, &(synchronizer->can_modify),
+                     deadline);
     synchronizer->modifying_waiting--;
+
+    // (even if the deadline has passed, what's granted is taken)
+    if (wait_result == ETIMEDOUT && !synchronizer->is_dead &&
+        synchro_must_writer_wait(synchronizer)) {
+      return ETIMEDOUT;
+    }
   }
 
   synchronizer->modify_now = false;
   synchronizer->is_modifying = true;
+  return 0;
 }
 
 void synchro_change_from_visiting_to_mod(struct Synchro *synchronizer) {
+  synchro_change_from_visiting_to_mod_until(synchronizer, NULL);
+}
+
+int synchro_change_from_visiting_to_mod_until(
+    struct Synchro *synchronizer, const struct timespec *deadline) {
   int err;
   if ((err = pthread_mutex_lock(&(synchronizer->lock))) != 0) {
     syserr(err, "mutex_lock failed");
   }
 
   synchronizer->accessing_count--;
-  synchro_modify_while_holding_mutex(synchronizer);
-
-  if ((err = pthread_mutex_unlock(&(synchronizer->lock))) != 0) {
-    syserr(err, "mutex_unlock failed");
+  if (synchronizer->policy == SYNCHRO_FIFO) {
+    // a writer at the front may have waited just for this thread
+    synchro_fifo_wake(synchronizer);
+  }
+  int result = synchro_modify_while_holding_mutex(synchronizer, deadline);
+  if (result != 0) {
+    synchro_wake_after_giving_up(synchronizer);
   }
+
+  synchro_unlock(synchronizer);
+  return result;
 }
 
 void synchro_modify(struct Synchro *synchronizer) {
+  synchro_modify_until(synchronizer, NULL);
+}
+
+int synchro_modify_until(struct Synchro *synchronizer,
+                         const struct timespec *deadline) {
   int err;
   if ((err = pthread_mutex_lock(&(synchronizer->lock))) != 0) {
     syserr(err, "mutex_lock failed");
   }
 
-  synchro_modify_while_holding_mutex(synchronizer);
-
-  if ((err = pthread_mutex_unlock(&(synchronizer->lock))) != 0) {
-    syserr(err, "mutex_unlock failed");
+  int result = synchro_modify_while_holding_mutex(synchronizer, deadline);
+  if (result != 0) {
+    synchro_wake_after_giving_up(synchronizer);
   }
+
+  synchro_unlock(synchronizer);
+  return result;
 }
 
 void synchro_leave_after_modifying(struct Synchro *synchronizer) {
@@ -155,48 +752,71 @@ void synchro_leave_after_modifying(struct Synchro *synchronizer) {
   }
 
   synchronizer->is_modifying = false;
-  if (synchronizer->accessing_waiting > 0) {
-    synchronizer->how_many_to_wake = synchronizer->accessing_waiting;
-    if ((err = pthread_cond_broadcast(&(synchronizer->can_access))) != 0) {
-      syserr(err, "cond_broadcast failed");
-    }
-  } else if (synchronizer->modifying_waiting > 0) {
+  synchro_note_release(synchronizer);
+  if (synchronizer->policy == SYNCHRO_FIFO) {
+    synchro_fifo_wake(synchronizer);
+  } else if (synchronizer->modifying_waiting > 0 &&
+             !synchronizer->want_to_be_removed &&
+             (synchronizer->accessing_waiting == 0 ||
+              synchronizer->policy == SYNCHRO_WRITER_PREFERRING)) {
     synchronizer->modify_now = true;
-    if ((err = pthread_cond_broadcast(&(synchronizer->can_modify))) != 0) {
-      syserr(err, "cond_broadcast failed");
-    }
-  } else if (synchronizer->accessing_waiting == 0 &&
-             synchronizer->modifying_waiting == 0 &&
-             synchronizer->want_to_be_removed) {
-    if ((err = pthread_cond_broadcast(&(synchronizer->can_be_removed))) != 0) {
-      syserr(err, "cond_broadcast failed");
-    }
-  }
-  if ((err = pthread_mutex_unlock(&(synchronizer->lock))) != 0) {
-    syserr(err, "mutex_unlock failed");
+    synchro_broadcast(synchronizer, &(synchronizer->can_modify));
+  } else if (synchronizer->accessing_waiting > 0) {
+    synchronizer->how_many_to_wake = synchronizer->accessing_waiting;
+    synchro_broadcast(synchronizer, &(synchronizer->can_access));
   }
+  synchro_wake_remover(synchronizer);
+  synchro_unlock(synchronizer);
 }
 
 void synchro_prepare_for_being_removed(struct Synchro *synchronizer) {
+  synchro_prepare_for_being_removed_until(synchronizer, NULL);
+}
+
+int synchro_prepare_for_being_removed_until(struct Synchro *synchronizer,
+                                            const struct timespec *deadline) {
   int err;
   if ((err = pthread_mutex_lock(&(synchronizer->lock))) != 0) {
     syserr(err, "mutex_lock failed");
   }
 
-  synchronizer->want_to_be_removed = true;
-  while (synchronizer->accessing_count != 0 || synchronizer->is_modifying ||
-         synchronizer->modifying_waiting != 0 ||
-         synchronizer->accessing_waiting != 0) {
-
-    if ((err = pthread_cond_wait(&(synchronizer->can_be_removed),
-                                 &(synchronizer->lock))) != 0) {
-      syserr(err, "cond_wait failed");
+  // children of a folder may be removed by threads only intending to change
+  // it, so another one may be removing the same node
+  while (synchronizer->want_to_be_removed && !synchronizer->is_dead) {
+    int wait_result = synchro_wait(
+        synchronizer, &(synchronizer->can_be_removed), deadline);
+    if (wait_result != 0 && synchronizer->want_to_be_removed &&
+        !synchronizer->is_dead) {
+      synchro_unlock(synchronizer);
+      return wait_result;
     }
   }
+  if (synchronizer->is_dead) {
+    synchro_unlock(synchronizer);
+    return ENOENT;
+  }
 
-  if ((err = pthread_mutex_unlock(&(synchronizer->lock))) != 0) {
-    syserr(err, "mutex_unlock failed");
+  // readers can't change what's in the node, so only the writer and the
+  // threads intending to change it are waited for, however many readers
+  // there are
+  synchronizer->want_to_be_removed = true;
+  while (synchronizer->is_modifying || synchronizer->modify_now ||
+         synchronizer->intending_count > 0) {
+    int wait_result = synchro_wait(
+        synchronizer, &(synchronizer->can_be_removed), deadline);
+    if (wait_result != 0 &&
+        (synchronizer->is_modifying || synchronizer->modify_now ||
+         synchronizer->intending_count > 0)) {
+      synchronizer->want_to_be_removed = false;
+      synchro_wake_after_giving_up(synchronizer);
+      synchro_wake_after_lifting_flag(synchronizer);
+      synchro_unlock(synchronizer);
+      return wait_result;
+    }
   }
+
+  synchro_unlock(synchronizer);
+  return 0;
 }
 
 void synchro_leave_after_bad_remove(struct Synchro *synchronizer) {
@@ -205,8 +825,44 @@ void synchro_leave_after_bad_remove(struct Synchro *synchronizer) {
     syserr(err, "mutex_lock failed");
   }
   synchronizer->want_to_be_removed = false;
+  // writers that came in the meantime waited just for the flag
+  synchro_wake_after_giving_up(synchronizer);
+  synchro_wake_after_lifting_flag(synchronizer);
 
+  synchro_unlock(synchronizer);
+}
+
+bool synchro_is_dead(struct Synchro *synchronizer) {
+  int err;
+  if ((err = pthread_mutex_lock(&(synchronizer->lock))) != 0) {
+    syserr(err, "mutex_lock failed");
+  }
+  bool result = synchronizer->is_dead;
   if ((err = pthread_mutex_unlock(&(synchronizer->lock))) != 0) {
     syserr(err, "mutex_unlock failed");
   }
+  return result;
+}
+
+void synchro_leave_after_remove(struct Synchro *synchronizer,
+                                void (*release)(void *), void *release_data) {
+  int err;
+  if ((err = pthread_mutex_lock(&(synchronizer->lock))) != 0) {
+    syserr(err, "mutex_lock failed");
+  }
+  synchronizer->want_to_be_removed = false;
+  synchronizer->is_dead = true;
+  synchronizer->release = release;
+  synchronizer->release_data = release_data;
+
+  // no one waiting is let in anymore
+  synchronizer->how_many_to_wake = 0;
+  synchronizer->queue_head = NULL;
+  synchronizer->queue_tail = NULL;
+  synchro_note_release(synchronizer);
+  synchro_broadcast(synchronizer, &(synchronizer->can_access));
+  synchro_broadcast(synchronizer, &(synchronizer->can_modify));
+  synchro_broadcast(synchronizer, &(synchronizer->can_be_removed));
+
+  synchro_unlock(synchronizer);
 }
@@ -1,7 +1,42 @@
 #ifndef MIMUW_FORK__SYNCHRO_H_
 #define MIMUW_FORK__SYNCHRO_H_
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <time.h>
+
+// Deadlines taken by the *_until functions are absolute CLOCK_MONOTONIC times.
+// NULL means there is no deadline and SYNCHRO_NO_WAIT means that a function
+// should fail with EWOULDBLOCK instead of waiting at all.
+extern const struct timespec synchro_no_wait;
+#define SYNCHRO_NO_WAIT (&synchro_no_wait)
+
+/**
+ * Who gets in first when both readers and writers wait for a node.
+ */
+enum SynchroPolicy {
+  // A waiting writer keeps new readers out, and the readers that waited for
+  // a writer all get in right after it, before the next writer, so reading
+  // and writing phases alternate. The default.
+  SYNCHRO_PHASE_FAIR,
+  // Like SYNCHRO_PHASE_FAIR, but a writer hands the node over to the next
+  // waiting writer, so readers wait for a whole burst of writes.
+  SYNCHRO_WRITER_PREFERRING,
+  // Readers only wait for a writer that's in, so writers wait until there's
+  // a moment without any readers.
+  SYNCHRO_READER_PREFERRING,
+  // Threads get in in the order they came in, consecutive readers together.
+  SYNCHRO_FIFO,
+};
+
+/**
+ * A thread waiting in the queue of a SYNCHRO_FIFO node.
+ */
+struct SynchroWaiter {
+  bool modify;
+  bool granted; // set by the thread letting it in
+  struct SynchroWaiter *next;
+};
 
 /**
  * Structure to synchronize access to a node.
@@ -19,8 +54,8 @@ struct Synchro {
   bool is_modifying;
 
   // this conditional variable ensures that if a thread signals it's
-  // desire to remove the node, it's flagged and after all awaiting operations
-  // get done, the thread may proceed with deletion
+  // desire to remove the node, it's flagged and after the writer that's in
+  // gets done, the thread may proceed with deletion
   pthread_cond_t can_be_removed;
 
   // this variable helps to ensure that readers' cascading waking up
@@ -30,8 +65,35 @@ struct Synchro {
   // to simulate the behaviour of conditional variables on the lecture
   bool modify_now;
 
-  // flag, so we know not to grant access any new threads
+  // readers that intend to change a part of the node, alongside one another
+  // (see synchro_change_from_visiting_to_intent_until), and readers of the
+  // whole node, who keep them out (see synchro_scan_until), in and waiting
+  int intending_count;
+  int intending_waiting;
+  int scanning_count;
+  int scanning_waiting;
+
+  // flag, so we know not to let in any new writers
   bool want_to_be_removed;
+  // set once the node is removed, threads inside keep their rights but no
+  // one gets in anymore
+  bool is_dead;
+  // called by the last thread to leave a dead node
+  // (see synchro_leave_after_remove)
+  void (*release)(void *);
+  void *release_data;
+
+  // counts the times rights were given up, for the threads spinning before
+  // they wait (see synchro_wait in Synchro.c)
+  atomic_uint releases;
+  // how long it usually takes until rights are given up, in pause
+  // instructions
+  int spin_estimate;
+
+  enum SynchroPolicy policy;
+  // waiting threads of a SYNCHRO_FIFO node, who all wait on can_access
+  struct SynchroWaiter *queue_head;
+  struct SynchroWaiter *queue_tail;
 };
 
 /**
@@ -40,6 +102,12 @@ struct Synchro {
  */
 void synchro_init(struct Synchro *synchronizer);
 
+/**
+ * Like synchro_init, with a given policy instead of SYNCHRO_PHASE_FAIR.
+ */
+void synchro_init_with_policy(struct Synchro *synchronizer,
+                              enum SynchroPolicy policy);
+
 /**
  * Destroys data in the Synchro structure
  * @param synchronizer pointer to a Synchro struct to be destroyed
@@ -56,6 +124,17 @@ void synchro_destroy(struct Synchro *synchronizer);
  */
 void synchro_visit(struct Synchro *synchronizer);
 
+/**
+ * Like synchro_visit, but gives up at a deadline. A thread that gives up
+ * leaves the node as if it never tried to get in.
+ * @param synchronizer
+ * @param deadline see SYNCHRO_NO_WAIT
+ * @return 0 on success, ETIMEDOUT or EWOULDBLOCK on failure, ENOENT if the
+ * node is dead (see synchro_leave_after_remove)
+ */
+int synchro_visit_until(struct Synchro *synchronizer,
+                        const struct timespec *deadline);
+
 /**
  * Similar to a reader's exit protocol.
  * A thread that is leaving the node and surrendering it's reading rights calls
@@ -64,6 +143,36 @@ void synchro_visit(struct Synchro *synchronizer);
  */
 void synchro_leave_after_visiting(struct Synchro *synchronizer);
 
+/**
+ * Like synchro_visit_until, but also waits for the threads that intend to
+ * change the node to leave and keeps new ones out, so the whole node can be
+ * read, like by a reader of the times before those threads.
+ */
+int synchro_scan_until(struct Synchro *synchronizer,
+                       const struct timespec *deadline);
+
+/**
+ * Surrenders reading rights taken with synchro_scan_until.
+ */
+void synchro_leave_after_scanning(struct Synchro *synchronizer);
+
+/**
+ * Turns reading rights into the rights to change a part of the node that no
+ * other thread changes at the same time (in a way the caller ensures),
+ * alongside readers and other such threads. Waits for the threads reading
+ * the whole node (see synchro_scan_until) and for the node not to be removed.
+ * @return 0 on success, ETIMEDOUT or EWOULDBLOCK on failure, ENOENT if the
+ * node is dead; a thread that fails has no rights left
+ */
+int synchro_change_from_visiting_to_intent_until(
+    struct Synchro *synchronizer, const struct timespec *deadline);
+
+/**
+ * Surrenders the rights taken with
+ * synchro_change_from_visiting_to_intent_until.
+ */
+void synchro_leave_after_intending(struct Synchro *synchronizer);
+
 /**
  * Similar to a writers entry protocol.
  * Let's a thread "into" the node. Grants modifying(writing) rights. If a thread
@@ -73,6 +182,12 @@ void synchro_leave_after_visiting(struct Synchro *synchronizer);
  */
 void synchro_modify(struct Synchro *synchronizer);
 
+/**
+ * Like synchro_modify, but gives up at a deadline (see synchro_visit_until).
+ */
+int synchro_modify_until(struct Synchro *synchronizer,
+                         const struct timespec *deadline);
+
 /**
  * Similar to a writer's exit protocol.
  * A thread that is leaving the node and surrendering it's modifying rights
@@ -92,11 +207,30 @@ void synchro_leave_after_modifying(struct Synchro *synchronizer);
 void synchro_change_from_visiting_to_mod(struct Synchro *synchronizer);
 
 /**
- * Flags a node to be removed, doesn't let anyone new get in queue for access.
+ * Like synchro_change_from_visiting_to_mod, but gives up at a deadline
+ * (see synchro_visit_until). A thread that gives up has no rights left.
+ */
+int synchro_change_from_visiting_to_mod_until(struct Synchro *synchronizer,
+                                              const struct timespec *deadline);
+
+/**
+ * Flags a node to be removed, doesn't let any new writers (or threads
+ * intending to change it) in and waits for the ones that are in, so the
+ * caller can check that the node is empty. Readers are neither waited for
+ * nor kept out. Threads removing the same node take turns.
  * @param synchronizer
  */
 void synchro_prepare_for_being_removed(struct Synchro *synchronizer);
 
+/**
+ * Like synchro_prepare_for_being_removed, but gives up at a deadline
+ * (see synchro_visit_until). A thread that gives up lifts the flag, like
+ * synchro_leave_after_bad_remove does. Returns ENOENT if the node died while
+ * the thread waited for its turn.
+ */
+int synchro_prepare_for_being_removed_until(struct Synchro *synchronizer,
+                                            const struct timespec *deadline);
+
 /**
  * If for some reason a node cannot be removed, this function is called.
  * It "lifts" the "to be removed" flag and leaves the node in  a valid state.
@@ -104,4 +238,19 @@ void synchro_prepare_for_being_removed(struct Synchro *synchronizer);
  */
 void synchro_leave_after_bad_remove(struct Synchro *synchronizer);
 
+/**
+ * Whether the node is dead (see synchro_leave_after_remove).
+ */
+bool synchro_is_dead(struct Synchro *synchronizer);
+
+/**
+ * Called after synchro_prepare_for_being_removed once the node is removed.
+ * Marks the node dead: threads that are in keep their rights, the ones
+ * waiting to get in and any that come later get ENOENT. The last one to
+ * leave (possibly the caller, right away) calls release(release_data),
+ * after which the synchronizer can be destroyed.
+ */
+void synchro_leave_after_remove(struct Synchro *synchronizer,
+                                void (*release)(void *), void *release_data);
+
 #endif // MIMUW_FORK__SYNCHRO_H_
@@ -0,0 +1,19 @@
+#include "Trace.h"
+
+// the semaphores of the probes, see Trace.h
+TRACE_DEFINE(op_start);
+TRACE_DEFINE(op_done);
+TRACE_DEFINE(wait_start);
+TRACE_DEFINE(wait_done);
+TRACE_DEFINE(wake);
+
+#ifndef TREE_TRACE
+void trace_discard(int ignored, ...) { (void)ignored; }
+#endif
+
+long trace_ns_since(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000000L +
+         (now.tv_nsec - start->tv_nsec);
+}
@@ -0,0 +1,89 @@
+#ifndef MIMUW_FORK__TRACE_H_
+#define MIMUW_FORK__TRACE_H_
+
+#include <stdbool.h>
+#include <time.h>
+
+// Static tracepoints (USDT) of provider "tree", to be attached to by tools
+// like bpftrace without rebuilding (see the scripts in trace/).
+// A probe compiles to a nop. Every probe has a semaphore that a tracer
+// increments while attached, and arguments that take work to compute, like
+// timings, are only computed while it's nonzero (see TRACE_ENABLED).
+// Without <sys/sdt.h>, or with TREE_NO_TRACE defined, probes compile to
+// nothing.
+
+#if !defined(TREE_NO_TRACE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define TREE_TRACE 1
+#endif
+#endif
+
+#ifdef TREE_TRACE
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define TRACE_SEMAPHORE(name) tree_##name##_semaphore
+
+#define TRACE_DECLARE(name)                                                    \
+  extern volatile unsigned short TRACE_SEMAPHORE(name)
+
+/**
+ * Defines the semaphore of a probe, see Trace.c.
+ */
+#define TRACE_DEFINE(name)                                                     \
+  volatile unsigned short TRACE_SEMAPHORE(name)                                \
+      __attribute__((unused, section(".probes")))
+
+#define TRACE_ENABLED(name) __builtin_expect(TRACE_SEMAPHORE(name) != 0, 0)
+
+#define TRACE_PROBE(name, ...) STAP_PROBEV(tree, name, __VA_ARGS__)
+
+#else
+
+#define TRACE_DECLARE(name) extern int tree_no_##name##_semaphore
+#define TRACE_DEFINE(name) extern int tree_no_##name##_semaphore
+#define TRACE_ENABLED(name) false
+// the arguments are never evaluated, only kept from looking unused
+#define TRACE_PROBE(name, ...)                                                 \
+  do {                                                                         \
+    if (false) {                                                               \
+      trace_discard(0, __VA_ARGS__);                                           \
+    }                                                                          \
+  } while (0)
+
+void trace_discard(int ignored, ...);
+
+#endif
+
+// The probes, with their arguments:
+// op_start(const char *op, Tree *tree, const char *path, int depth)
+//   a tree_* call begins; depth is the number of components of path, which
+//   is NULL for calls without one (like tree_transaction_commit)
+// op_done(const char *op, Tree *tree, const char *path, int depth,
+//         int result, long ns)
+//   it returns result (an error code, 0 on success) after ns nanoseconds
+// wait_start(struct Synchro *node, int kind)
+//   a thread is about to wait for a node's lock: kind is
+//   TRACE_WAIT_ACCESS, TRACE_WAIT_MODIFY or TRACE_WAIT_REMOVE
+// wait_done(struct Synchro *node, int kind, long ns, int result)
+//   the wait ends after ns nanoseconds, with result 0 (woken up) or
+//   ETIMEDOUT
+// wake(struct Synchro *node, int kind)
+//   threads waiting for a node's lock are woken up
+TRACE_DECLARE(op_start);
+TRACE_DECLARE(op_done);
+TRACE_DECLARE(wait_start);
+TRACE_DECLARE(wait_done);
+TRACE_DECLARE(wake);
+
+#define TRACE_WAIT_ACCESS 0
+#define TRACE_WAIT_MODIFY 1
+#define TRACE_WAIT_REMOVE 2
+
+/**
+ * Returns the nanoseconds since a given time on CLOCK_MONOTONIC.
+ */
+long trace_ns_since(const struct timespec *start);
+
+#endif // MIMUW_FORK__TRACE_H_
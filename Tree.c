@@ -1,393 +1,3703 @@
 #include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
+#include "BRLock.h"
+#include "Glob.h"
+#include "NameTable.h"
 #include "Synchro.h"
+#include "Trace.h"
 #include "Tree.h"
+#include "TreeWatch.h"
 #include "err.h"
 #include "path_utils.h"
 
 /**
- * A utility function that receives a pointer to a pointer to a node  (folder)
- * for which the caller must possess reading rights and a VALID path.
+ * A tree_* call, from its op_start probe to its op_done probe (see Trace.h).
+ */
+struct TraceOp {
+  const char *name;
+  Tree *tree;
+  const char *path;
+  int depth;
+  bool is_timed;
+  struct timespec start;
+};
+
+void trace_op_start(struct TraceOp *op, const char *name, Tree *tree,
+                    const char *path) {
+  op->name = name;
+  op->tree = tree;
+  op->path = path;
+  op->depth = -1;
+  if (TRACE_ENABLED(op_start) || TRACE_ENABLED(op_done)) {
+    op->depth = 0;
+    for (const char *c = path; c != NULL && *c != '\0'; c++) {
+      op->depth += *c == '/';
+    }
+    op->depth = op->depth > 0 ? op->depth - 1 : 0;
+  }
+  op->is_timed = TRACE_ENABLED(op_done);
+  if (op->is_timed) {
+    clock_gettime(CLOCK_MONOTONIC, &(op->start));
+  }
+  TRACE_PROBE(op_start, name, tree, path, op->depth);
+}
+
+/**
+ * Fires the op_done probe of a call returning a given result.
+ * @return the result
+ */
+int trace_op_done(struct TraceOp *op, int result) {
+  TRACE_PROBE(op_done, op->name, op->tree, op->path, op->depth, result,
+              op->is_timed ? trace_ns_since(&(op->start)) : -1L);
+  return result;
+}
+
+/**
+ * Like trace_op_done, for calls returning a listing (NULL on failure, which
+ * is in errno then).
+ */
+char *trace_op_done_listing(struct TraceOp *op, char *listing) {
+  trace_op_done(op, listing != NULL ? 0 : errno);
+  return listing;
+}
+
+/**
+ * Computes the index of the stripe of a folder that holds the child with
+ * a given name. Regular folders have a single stripe, so it's always 0 there.
+ * @param folder pointer to a node (folder)
+ * @param name name of the child
+ * @return index of the stripe
+ */
+int stripe_index(Tree *folder, const char *name) {
+  if (folder->stripes == NULL) {
+    return 0;
+  }
+  return hmap_hash(name) % folder->stripes_count;
+}
+
+/**
+ * Like stripe_index, for a name whose hash (see hmap_hash) is known.
+ */
+int stripe_index_hashed(Tree *folder, unsigned int hash) {
+  return folder->stripes == NULL ? 0 : hash % folder->stripes_count;
+}
+
+int stripes_of(Tree *folder) {
+  return folder->stripes == NULL ? 1 : folder->stripes_count;
+}
+
+struct Synchro *stripe_synchro(Tree *folder, int index) {
+  if (folder->stripes == NULL) {
+    return &(folder->synchronizer);
+  }
+  return &(folder->stripes[index].synchronizer);
+}
+
+HashMap *stripe_children(Tree *folder, int index) {
+  if (folder->stripes == NULL) {
+    return folder->children;
+  }
+  return folder->stripes[index].children;
+}
+
+/**
+ * Returns the synchronizer guarding the child with a given name
+ * (and guarding the folder itself for the thread that holds it).
+ */
+struct Synchro *synchro_of(Tree *folder, const char *name) {
+  return stripe_synchro(folder, stripe_index(folder, name));
+}
+
+/**
+ * Returns the map that holds the child with a given name.
+ */
+HashMap *children_of(Tree *folder, const char *name) {
+  return stripe_children(folder, stripe_index(folder, name));
+}
+
+/**
+ * Puts a child into the map of a folder that's to hold it, under its name,
+ * hashed once already when it was interned. The caller holds the rights to
+ * change that map.
+ * @return false if there's a child with that name already
+ */
+bool children_insert(Tree *folder, Tree *child) {
+  unsigned int hash = name_interned_hash(child->name);
+  return hmap_insert_hashed(
+      stripe_children(folder, stripe_index_hashed(folder, hash)), child->name,
+      hash, child);
+}
+
+/**
+ * Takes a child out of the map of a folder that holds it, like
+ * children_insert puts it there.
+ */
+void children_remove(Tree *folder, Tree *child) {
+  unsigned int hash = name_interned_hash(child->name);
+  hmap_remove_hashed(stripe_children(folder, stripe_index_hashed(folder, hash)),
+                     child->name, hash);
+}
+
+pthread_mutex_t *stripe_children_lock(Tree *folder, int index) {
+  if (folder->stripes == NULL) {
+    return &(folder->children_lock);
+  }
+  return &(folder->stripes[index].children_lock);
+}
+
+/**
+ * Locks the map that holds the child with a given name (see Tree).
+ */
+void lock_children(Tree *folder, const char *name) {
+  int err;
+  if ((err = pthread_mutex_lock(stripe_children_lock(
+           folder, stripe_index(folder, name)))) != 0) {
+    syserr(err, "mutex_lock failed");
+  }
+}
+
+void unlock_children(Tree *folder, const char *name) {
+  int err;
+  if ((err = pthread_mutex_unlock(stripe_children_lock(
+           folder, stripe_index(folder, name)))) != 0) {
+    syserr(err, "mutex_unlock failed");
+  }
+}
+
+void tree_node_unref(Tree *node);
+
+/**
+ * Looks up the child with a given name, for a thread with reading rights to
+ * the part of the folder covering it. The child may be removed right after
+ * (see tree_remove_until), so a reference to it is taken, which the caller
+ * drops with tree_node_unref once it's inside the child or done with it.
+ * @return the child, or NULL if there's none
+ */
+Tree *child_acquire(Tree *folder, const char *name) {
+  lock_children(folder, name);
+  Tree *child = hmap_get(children_of(folder, name), name);
+  if (child != NULL) {
+    atomic_fetch_add(&(child->references), 1);
+  }
+  unlock_children(folder, name);
+  return child;
+}
+
+/**
+ * Grants reading rights to the part of a folder covering a given name,
+ * or to the whole folder (every stripe, in order) if name is NULL. Rights to
+ * the whole folder keep out the threads creating and removing its children
+ * (see synchro_scan_until), so its children can be read without locking.
+ * @return 0 on success, ETIMEDOUT or EWOULDBLOCK if the deadline has passed
+ * (see synchro_visit_until), ENOENT if the folder was removed, no rights are
+ * granted then
+ */
+int synchro_visit_covering(Tree *folder, const char *name,
+                           const struct timespec *deadline) {
+  if (name != NULL) {
+    return synchro_visit_until(synchro_of(folder, name), deadline);
+  }
+  for (int i = 0; i < stripes_of(folder); i++) {
+    int err = synchro_scan_until(stripe_synchro(folder, i), deadline);
+    if (err != 0) {
+      while (i > 0) {
+        i--;
+        synchro_leave_after_scanning(stripe_synchro(folder, i));
+      }
+      return err;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Surrenders reading rights taken by synchro_visit_covering.
+ */
+void synchro_leave_covering_after_visiting(Tree *folder, const char *name) {
+  if (name != NULL) {
+    synchro_leave_after_visiting(synchro_of(folder, name));
+    return;
+  }
+  // the folder may be gone right after its last stripe is left
+  int stripes_count = stripes_of(folder);
+  for (int i = 0; i < stripes_count; i++) {
+    synchro_leave_after_scanning(stripe_synchro(folder, i));
+  }
+}
+
+/**
+ * Grants writing rights to the whole folder: to every stripe, in order, so
+ * no thread is left in any part of it (a hot folder's own synchronizer
+ * guards none of it).
+ * @return 0 on success, ETIMEDOUT or EWOULDBLOCK if the deadline has passed
+ * (see synchro_modify_until), no rights are granted then
+ */
+int synchro_modify_whole_until(Tree *folder, const struct timespec *deadline) {
+  for (int i = 0; i < stripes_of(folder); i++) {
+    int err = synchro_modify_until(stripe_synchro(folder, i), deadline);
+    if (err != 0) {
+      while (i > 0) {
+        i--;
+        synchro_leave_after_modifying(stripe_synchro(folder, i));
+      }
+      return err;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Surrenders writing rights taken by synchro_modify_whole_until.
+ */
+void synchro_leave_whole_after_modifying(Tree *folder) {
+  for (int i = stripes_of(folder) - 1; i >= 0; i--) {
+    synchro_leave_after_modifying(stripe_synchro(folder, i));
+  }
+}
+
+/**
+ * A utility function that receives a pointer to a pointer to a node (folder)
+ * and a VALID path. The caller must possess reading rights to the part of
+ * the node covering the first component of path (or covering name if path
+ * is "/", see synchro_visit_covering).
  * It tries to set the cur_folder to point to a node specified in path.
- * On success, returns 0 and cur_folder is pointing to a node specified in path.
- * On failure returns ENOENT and cur_folder is pointing to the last node
- * for which the caller now has reading rights. (the caller must surrender
- * those rights)
+ * On success, returns 0, cur_folder is pointing to a node specified in path
+ * and the caller has reading rights to the part of it covering name.
+ * On failure the caller has no rights left anywhere.
  * @param cur_folder pointer to a pointer to a node (folder)
  * @param path c-string representing path
- * @return 0 on success, ENOENT on failure
+ * @param name name covered by the rights granted at the destination,
+ * NULL for the whole destination folder
+ * @param deadline see synchro_visit_until
+ * @return 0 on success, ENOENT if there's no such node, ETIMEDOUT or
+ * EWOULDBLOCK if the deadline has passed
  */
-int synchro_get_to_path(Tree **cur_folder, const char *path) {
+int synchro_get_to_path(Tree **cur_folder, const char *path, const char *name,
+                        const struct timespec *deadline) {
   Tree *prev_folder = NULL;
-  const char *subpath = path;
-  char component[MAX_FOLDER_NAME_LENGTH + 1];
+  char buffer1[MAX_FOLDER_NAME_LENGTH + 1];
+  char buffer2[MAX_FOLDER_NAME_LENGTH + 1];
+  char *component = buffer1;
+  char *next_component = buffer2;
 
-  subpath = split_path(subpath, component);
+  const char *subpath = split_path(path, component);
   while (subpath) {
     prev_folder = *cur_folder;
-    *cur_folder = hmap_get(prev_folder->children, component);
+    *cur_folder = child_acquire(prev_folder, component);
     if (*cur_folder == NULL) {
-      *cur_folder = prev_folder;
+      synchro_leave_after_visiting(synchro_of(prev_folder, component));
       return ENOENT;
     }
-    synchro_visit(&((*cur_folder)->synchronizer));
-    synchro_leave_after_visiting(&(prev_folder->synchronizer));
 
-    subpath = split_path(subpath, component);
+    const char *next_subpath = split_path(subpath, next_component);
+    int err = synchro_visit_covering(
+        *cur_folder, next_subpath ? next_component : name, deadline);
+    synchro_leave_after_visiting(synchro_of(prev_folder, component));
+    tree_node_unref(*cur_folder);
+    if (err != 0) {
+      return err;
+    }
+
+    char *tmp = component;
+    component = next_component;
+    next_component = tmp;
+    subpath = next_subpath;
+  }
+
+  return 0;
+}
+
+/**
+ * Claims the root and gets to a node specified in path (see
+ * synchro_get_to_path).
+ */
+int synchro_visit_path(Tree **cur_folder, const char *path, const char *name,
+                       const struct timespec *deadline) {
+  char component[MAX_FOLDER_NAME_LENGTH + 1];
+
+  int err = synchro_visit_covering(
+      *cur_folder, split_path(path, component) ? component : name, deadline);
+  if (err != 0) {
+    return err;
+  }
+  return synchro_get_to_path(cur_folder, path, name, deadline);
+}
+
+/**
+ * Creates a node with a given name and stripes_count stripes
+ * (0 for a regular folder), whose locks follow a given policy, with
+ * payload_size bytes of zeroed payload.
+ */
+Tree *tree_node_new(const char *name, int stripes_count,
+                    enum SynchroPolicy policy, size_t payload_size) {
+  Tree *result = malloc(sizeof(Tree) + payload_size);
+  CHECK_PTR(result);
+  memset(result->payload, 0, payload_size);
+
+  result->name = name == NULL ? NULL : name_intern(name);
+  result->children = hmap_new_borrowing();
+  int err;
+  if ((err = pthread_mutex_init(&(result->children_lock), 0)) != 0) {
+    syserr(err, "mutex_init failed");
+  }
+  synchro_init_with_policy(&(result->synchronizer), policy);
+
+  result->global = NULL;
+  result->stripes = NULL;
+  result->stripes_count = stripes_count;
+  if (stripes_count > 0) {
+    result->stripes = malloc(stripes_count * sizeof(struct TreeStripe));
+    CHECK_PTR(result->stripes);
+    for (int i = 0; i < stripes_count; i++) {
+      result->stripes[i].children = hmap_new_borrowing();
+      if ((err = pthread_mutex_init(&(result->stripes[i].children_lock), 0)) !=
+          0) {
+        syserr(err, "mutex_init failed");
+      }
+      synchro_init_with_policy(&(result->stripes[i].synchronizer), policy);
+      atomic_init(&(result->stripes[i].descendants), 0);
+    }
+  }
+
+  result->parent = NULL;
+  atomic_init(&(result->moves), 0);
+  atomic_init(&(result->references), 1);
+  atomic_init(&(result->descendants), 0);
+  atomic_init(&(result->height), 0);
+  atomic_init(&(result->height_dirty), false);
+
+  return result;
+}
+
+/**
+ * Changes the name kept in a node. The caller must have modifying rights to
+ * the part of the node's parent that holds it.
+ */
+void tree_node_rename(Tree *node, const char *name) {
+  const char *old_name = node->name;
+  node->name = name_intern(name);
+  name_release(old_name);
+}
+
+void tree_stripes_free(Tree *tree) {
+  int err;
+  for (int i = 0; i < tree->stripes_count && tree->stripes; i++) {
+    hmap_free(tree->stripes[i].children);
+    if ((err = pthread_mutex_destroy(&(tree->stripes[i].children_lock))) !=
+        0) {
+      syserr(err, "mutex_destroy failed");
+    }
+    synchro_destroy(&(tree->stripes[i].synchronizer));
+  }
+  free(tree->stripes);
+  if ((err = pthread_mutex_destroy(&(tree->children_lock))) != 0) {
+    syserr(err, "mutex_destroy failed");
+  }
+}
+
+bool is_folder_empty(Tree *folder) {
+  for (int i = 0; i < stripes_of(folder); i++) {
+    if (hmap_size(stripe_children(folder, i)) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Sorted iterators over every stripe of a folder, merged into one sorted
+ * sequence of the names of its children.
+ */
+struct ChildrenMerge {
+  Tree *folder;
+  HashMapIterator iterators[TREE_MAX_STRIPES];
+  const char *heads[TREE_MAX_STRIPES]; // next name in each stripe, or NULL
+  void *head_children[TREE_MAX_STRIPES];
+};
+
+void children_merge_advance(struct ChildrenMerge *merge, int index) {
+  if (!hmap_sorted_next(stripe_children(merge->folder, index),
+                        &(merge->iterators[index]), &(merge->heads[index]),
+                        &(merge->head_children[index]))) {
+    merge->heads[index] = NULL;
+  }
+}
+
+/**
+ * Starts merging the names of children of a folder not less than from
+ * (greater than from if exclusive is set, all of them if from is NULL).
+ * The caller must possess reading rights to the whole folder for as long as
+ * the merge is used.
+ */
+void children_merge_init(struct ChildrenMerge *merge, Tree *folder,
+                         const char *from, bool exclusive) {
+  merge->folder = folder;
+  for (int i = 0; i < stripes_of(folder); i++) {
+    HashMap *children = stripe_children(folder, i);
+    if (from == NULL) {
+      merge->iterators[i] = hmap_sorted_iterator(children);
+    } else {
+      merge->iterators[i] = hmap_seek(children, from);
+    }
+    children_merge_advance(merge, i);
+    if (exclusive && from != NULL && merge->heads[i] != NULL &&
+        strcmp(merge->heads[i], from) == 0) {
+      children_merge_advance(merge, i);
+    }
+  }
+}
+
+/**
+ * Returns the next name of a merge, or NULL at its end.
+ * @param child if not NULL, set to the child with that name
+ */
+const char *children_merge_next(struct ChildrenMerge *merge, Tree **child) {
+  int smallest = -1;
+  for (int i = 0; i < stripes_of(merge->folder); i++) {
+    if (merge->heads[i] != NULL &&
+        (smallest == -1 ||
+         strcmp(merge->heads[i], merge->heads[smallest]) < 0)) {
+      smallest = i;
+    }
+  }
+  if (smallest == -1) {
+    return NULL;
+  }
+
+  const char *result = merge->heads[smallest];
+  if (child != NULL) {
+    *child = merge->head_children[smallest];
+  }
+  children_merge_advance(merge, smallest);
+  return result;
+}
+
+/**
+ * Writes the names of children of a folder greater than after (of all
+ * children if after is NULL) into buf, sorted and separated by commas, as
+ * many of them as fit. The caller must possess reading rights to the whole
+ * folder.
+ * @param buf buffer of size cap > 0, null-terminated afterwards
+ * @param last set to the last name written, if any
+ * @return number of names written
+ */
+size_t write_children_after(Tree *folder, const char *after, char *buf,
+                            size_t cap, const char **last) {
+  struct ChildrenMerge merge;
+  children_merge_init(&merge, folder, after, true);
+
+  size_t written = 0;
+  char *position = buf;
+  const char *name;
+  while ((name = children_merge_next(&merge, NULL)) != NULL) {
+    size_t keylen = strlen(name);
+    size_t separator = written > 0 ? 1 : 0;
+    if ((size_t)(position - buf) + separator + keylen + 1 > cap) {
+      break;
+    }
+    if (separator) {
+      *position = ',';
+      position++;
+    }
+    memcpy(position, name, keylen);
+    position += keylen;
+    written++;
+    *last = name;
+  }
+
+  *position = '\0';
+  return written;
+}
+
+/**
+ * Returns the size of the c-string listing the children of a folder
+ * (including ending null character). The caller must possess reading rights
+ * to the whole folder.
+ */
+size_t folder_contents_size(Tree *folder) {
+  size_t result_size = 1;
+  for (int i = 0; i < stripes_of(folder); i++) {
+    HashMap *children = stripe_children(folder, i);
+    HashMapIterator it = hmap_iterator(children);
+    const char *key;
+    void *value;
+    while (hmap_next(children, &it, &key, &value)) {
+      result_size += strlen(key) + 1;
+    }
+  }
+  return result_size > 1 ? result_size - 1 : 1; // no trailing comma
+}
+
+/**
+ * Returns a c-string with the names of all children of a folder, sorted and
+ * separated by commas. The caller must possess reading rights to the whole
+ * folder and should free the result.
+ */
+char *make_folder_contents_string(Tree *folder) {
+  size_t result_size = folder_contents_size(folder);
+  char *result = malloc(result_size);
+  CHECK_PTR(result);
+
+  const char *last;
+  write_children_after(folder, NULL, result, result_size, &last);
+  return result;
+}
+
+/**
+ * Checks whether a name read from a merge (see children_merge_init) is still
+ * in a range bounded by to (exclusive, no bound if NULL) and prefix.
+ */
+bool is_in_range(const char *name, const char *to, const char *prefix,
+                 size_t prefix_length) {
+  return name != NULL && (to == NULL || strcmp(name, to) < 0) &&
+         strncmp(name, prefix, prefix_length) == 0;
+}
+
+/**
+ * Returns a c-string with the names of children of a folder from from
+ * (inclusive, from the first one if NULL) to to (exclusive, to the last one
+ * if NULL) that start with prefix, at most limit of them (all if 0), sorted
+ * and separated by commas. Takes time proportional to the size of the
+ * result. The caller must possess reading rights to the whole folder and
+ * should free the result.
+ */
+char *make_folder_range_string(Tree *folder, const char *from, const char *to,
+                               const char *prefix, size_t limit) {
+  // names starting with prefix are not less than it
+  if (from == NULL || strcmp(from, prefix) < 0) {
+    from = prefix;
+  }
+  size_t prefix_length = strlen(prefix);
+
+  struct ChildrenMerge merge;
+  const char *name;
+  size_t result_size = 1; // Including ending null character.
+  size_t count = 0;
+  children_merge_init(&merge, folder, from, false);
+  while ((limit == 0 || count < limit) &&
+         is_in_range(name = children_merge_next(&merge, NULL), to, prefix,
+                     prefix_length)) {
+    result_size += strlen(name) + 1;
+    count++;
+  }
+  if (count > 0) {
+    result_size--; // no trailing comma
+  }
+
+  char *result = malloc(result_size);
+  CHECK_PTR(result);
+
+  char *position = result;
+  children_merge_init(&merge, folder, from, false);
+  for (size_t i = 0; i < count; i++) {
+    name = children_merge_next(&merge, NULL);
+    size_t keylen = strlen(name);
+    if (i > 0) {
+      *position = ',';
+      position++;
+    }
+    memcpy(position, name, keylen);
+    position += keylen;
+  }
+  *position = '\0';
+  return result;
+}
+
+/**
+ * Returns the share of a folder's descendant count updated by the calling
+ * thread. Hot folders have one per stripe, chosen by the CPU, so the counts
+ * of the root and other hot folders don't become contended.
+ */
+atomic_long *descendants_shard(Tree *folder) {
+  if (folder->stripes == NULL) {
+    return &(folder->descendants);
+  }
+  int index = brlock_current_cpu() % folder->stripes_count;
+  return &(folder->stripes[index].descendants);
+}
+
+long descendants_of(Tree *folder) {
+  if (folder->stripes == NULL) {
+    return atomic_load(&(folder->descendants));
+  }
+  long result = 0;
+  for (int i = 0; i < folder->stripes_count; i++) {
+    result += atomic_load(&(folder->stripes[i].descendants));
+  }
+  return result;
+}
+
+/**
+ * Raises a height to at least a given value.
+ * @return false if it was that high already
+ */
+bool raise_height(atomic_int *height, int value) {
+  int current = atomic_load(height);
+  while (current < value) {
+    if (atomic_compare_exchange_weak(height, &current, value)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Like aggregates_add, but stops below a given ancestor (NULL for none).
+ */
+void aggregates_add_below(Tree *folder, Tree *stop, long count, int height) {
+  for (Tree *ancestor = folder; ancestor != stop;
+       ancestor = ancestor->parent) {
+    atomic_fetch_add(descendants_shard(ancestor), count);
+
+    // once an ancestor is high enough, so are the ones above it
+    if (height >= 0) {
+      height++;
+      if (!raise_height(&(ancestor->height), height)) {
+        height = -1;
+      }
+    }
+  }
+}
+
+/**
+ * Updates the aggregates of a folder and all of its ancestors after a subtree
+ * with count nodes and of a given height has been put below the folder.
+ * The caller must hold the aggregates lock and rights keeping the folder from
+ * being removed.
+ */
+void aggregates_add(Tree *folder, long count, int height) {
+  aggregates_add_below(folder, NULL, count, height);
+}
+
+/**
+ * Marks the heights of a folder and its ancestors that could have come from
+ * a subtree of a given height below the folder dirty, to be recomputed when
+ * they're asked for (see repair_height).
+ */
+void mark_heights_dirty(Tree *folder, int height) {
+  for (Tree *ancestor = folder; ancestor != NULL;
+       ancestor = ancestor->parent) {
+    height++;
+    // an ancestor higher than the subtree made it is left as it was, and so
+    // are the ones above it, unless its height is dirty already (and could
+    // be too big)
+    if (atomic_load(&(ancestor->height)) == height) {
+      atomic_store(&(ancestor->height_dirty), true);
+    } else if (!atomic_load(&(ancestor->height_dirty))) {
+      return;
+    }
+  }
+}
+
+/**
+ * Updates the aggregates of a folder and all of its ancestors after a subtree
+ * with count nodes and of a given height has been taken from below the
+ * folder. Heights are only marked dirty (see mark_heights_dirty).
+ * The caller must hold the aggregates lock and rights keeping the folder from
+ * being removed.
+ */
+void aggregates_subtract(Tree *folder, long count, int height) {
+  for (Tree *ancestor = folder; ancestor != NULL;
+       ancestor = ancestor->parent) {
+    atomic_fetch_sub(descendants_shard(ancestor), count);
+  }
+  mark_heights_dirty(folder, height);
+}
+
+void repair_height(Tree *folder);
+
+/**
+ * Computes the height of a folder from the heights of its children,
+ * repairing the dirty ones first if repair is set. The caller must possess
+ * reading rights to the whole folder.
+ */
+int children_height(Tree *folder, bool repair) {
+  int height = 0;
+  for (int i = 0; i < stripes_of(folder); i++) {
+    HashMap *children = stripe_children(folder, i);
+    HashMapIterator it = hmap_iterator(children);
+    const char *key;
+    Tree *child;
+    while (hmap_next(children, &it, &key, (void **)&child)) {
+      if (repair && atomic_load(&(child->height_dirty))) {
+        synchro_visit_covering(child, NULL, NULL);
+        repair_height(child);
+        synchro_leave_covering_after_visiting(child, NULL);
+      }
+      int child_height = atomic_load(&(child->height));
+      if (child_height + 1 > height) {
+        height = child_height + 1;
+      }
+    }
+  }
+  return height;
+}
+
+/**
+ * Recomputes the height of a folder marked dirty. If the height changes in
+ * the meantime, the folder is left dirty. The caller must possess reading
+ * rights to the whole folder.
+ */
+void repair_height(Tree *folder) {
+  atomic_store(&(folder->height_dirty), false);
+  int old_height = atomic_load(&(folder->height));
+
+  int height = children_height(folder, true);
+  if (!atomic_compare_exchange_strong(&(folder->height), &old_height,
+                                      height)) {
+    atomic_store(&(folder->height_dirty), true);
+    return;
+  }
+
+  // a child raised in the meantime could have seen the old height and left
+  // it as it was, so the children are checked again
+  raise_height(&(folder->height), children_height(folder, false));
+}
+
+int tree_destroy(Tree *tree) {
+  name_release(tree->name);
+  hmap_free(tree->children);
+  synchro_destroy(&(tree->synchronizer));
+  tree_stripes_free(tree);
+  free(tree);
+  return 0;
+}
+
+/**
+ * Drops a reference to a node, destroying it if that was the last one.
+ */
+void tree_node_unref(Tree *node) {
+  if (atomic_fetch_sub(&(node->references), 1) == 1) {
+    tree_destroy(node);
+  }
+}
+
+/**
+ * Called by the last thread to leave a stripe of a removed node.
+ */
+void tree_node_release(void *data) {
+  tree_node_unref(data);
+}
+
+/**
+ * Marks a node that was unlinked from the tree dead (see
+ * synchro_leave_after_remove). The threads still inside it finish what they
+ * do there, and the last one to leave it or to close a handle to it destroys
+ * it, so the caller must not touch it anymore.
+ */
+void tree_node_bury(Tree *node) {
+  int stripes_count = stripes_of(node);
+  atomic_fetch_add(&(node->references), stripes_count);
+  for (int i = 0; i < stripes_count; i++) {
+    synchro_leave_after_remove(stripe_synchro(node, i), tree_node_release,
+                               node);
+  }
+  // the reference of the link from its parent
+  tree_node_unref(node);
+}
+
+Tree *tree_new_with_options(const struct TreeOptions *options) {
+  Tree *result = tree_node_new(NULL, TREE_ROOT_STRIPES, options->policy,
+                               options->payload_size);
+
+  result->global = malloc(sizeof(struct TreeGlobal));
+  CHECK_PTR(result->global);
+
+  int err;
+  if ((err = pthread_mutex_init(&(result->global->rename_lock), 0)) != 0) {
+    syserr(err, "mutex_init failed");
+  }
+  result->global->aggregates = options->aggregates;
+  result->global->policy = options->policy;
+  result->global->payload_size = options->payload_size;
+  brlock_init(&(result->global->aggregates_lock));
+  result->global->watchers = tree_watchers_new();
+
+  return result;
+}
+
+Tree *tree_new() {
+  struct TreeOptions options = {.aggregates = false,
+                                .policy = SYNCHRO_PHASE_FAIR};
+  return tree_new_with_options(&options);
+}
+
+void tree_free(Tree *tree) {
+  Tree *value;
+  const char *key;
+  for (int i = 0; i < stripes_of(tree); i++) {
+    HashMap *children = stripe_children(tree, i);
+    HashMapIterator it = hmap_iterator(children);
+    while (hmap_next(children, &it, &key, (void **)&value)) {
+      tree_free(value);
+    }
+  }
+
+  if (tree->global != NULL) {
+    int err;
+    if ((err = pthread_mutex_destroy(&(tree->global->rename_lock))) != 0) {
+      syserr(err, "mutex_destroy failed");
+    }
+    brlock_destroy(&(tree->global->aggregates_lock));
+    tree_watchers_free(tree->global->watchers);
+    free(tree->global);
+  }
+
+  name_release(tree->name);
+  hmap_free(tree->children);
+  synchro_destroy(&(tree->synchronizer));
+  tree_stripes_free(tree);
+  free(tree);
+}
+
+// times an operation on a handle is retried after its path is looked up again
+#define HANDLE_MAX_REFRESHES 8
+
+/**
+ * A folder passed on the way to the folder of a handle.
+ */
+struct HandleStep {
+  Tree *folder;        // holds a reference to it
+  unsigned long moves; // of the folder when it was passed
+};
+
+struct TreeHandle {
+  Tree *tree;
+  Tree *folder; // holds a reference to it
+  char *path;   // where the folder was opened
+  // the folders below the root on the way to folder (itself included), as
+  // path was last looked up; replaced by handle_refresh under the lock
+  pthread_rwlock_t steps_lock;
+  struct HandleStep *steps;
+  int steps_count;
+};
+
+/**
+ * The folder paths of an operation start at: the root, or the folder of
+ * a handle if at isn't NULL.
+ */
+Tree *start_of(Tree *tree, TreeHandle *at) {
+  return at == NULL ? tree : at->folder;
+}
+
+/**
+ * Whether a path is valid, and short enough to be made absolute if it's
+ * relative to the folder of a handle.
+ */
+bool is_path_valid_at(TreeHandle *at, const char *path) {
+  return is_path_valid(path) &&
+         (at == NULL || strlen(at->path) + strlen(path) - 1 <= MAX_PATH_LENGTH);
+}
+
+/**
+ * Returns the absolute path of a path relative to the folder of a handle
+ * (written to buffer, of MAX_PATH_LENGTH + 1 chars), or path itself if at is
+ * NULL.
+ */
+const char *absolute_path(TreeHandle *at, const char *path, char *buffer) {
+  if (at == NULL) {
+    return path;
+  }
+  strcpy(buffer, at->path);
+  strcat(buffer, path + 1);
+  return buffer;
+}
+
+/**
+ * Checks that the folder of a handle is still where the handle's path leads,
+ * so an operation on it works where it's meant to. Called by the operation
+ * once it holds the rights to what it changes or reads, all the time having
+ * held rights below the folder: a move committed since then would have to
+ * come after the operation.
+ * @return 0 if none of the folders on the way was moved since the path was
+ * last looked up, ESTALE otherwise (then it's looked up again, see
+ * handle_refresh)
+ */
+int handle_check(TreeHandle *at) {
+  if (at == NULL) {
+    return 0;
+  }
+  int err;
+  if ((err = pthread_rwlock_rdlock(&(at->steps_lock))) != 0) {
+    syserr(err, "rwlock_rdlock failed");
+  }
+  int result = 0;
+  for (int i = at->steps_count - 1; i >= 0; i--) {
+    if (atomic_load(&(at->steps[i].folder->moves)) != at->steps[i].moves) {
+      result = ESTALE;
+      break;
+    }
+  }
+  if ((err = pthread_rwlock_unlock(&(at->steps_lock))) != 0) {
+    syserr(err, "rwlock_unlock failed");
+  }
+  return result;
+}
+
+/**
+ * tree_list giving up at a deadline (see synchro_visit_until), with path
+ * relative to the folder of a handle if at isn't NULL.
+ * On failure returns NULL and sets errno.
+ */
+char *tree_list_until(Tree *tree, TreeHandle *at, const char *path,
+                      const struct timespec *deadline) {
+  struct TraceOp trace;
+  trace_op_start(&trace, "list", tree, path);
+  if (!is_path_valid_at(at, path)) {
+    errno = EINVAL;
+    return trace_op_done_listing(&trace, NULL);
+  }
+
+  // getting to destination
+  Tree *cur_folder = start_of(tree, at);
+  int err = synchro_visit_path(&cur_folder, path, NULL, deadline);
+  if (err != 0) {
+    errno = err;
+    return trace_op_done_listing(&trace, NULL);
+  }
+  if ((err = handle_check(at)) != 0) {
+    synchro_leave_covering_after_visiting(cur_folder, NULL);
+    errno = err;
+    return trace_op_done_listing(&trace, NULL);
+  }
+
+  char *result = make_folder_contents_string(cur_folder);
+  synchro_leave_covering_after_visiting(cur_folder, NULL);
+  return trace_op_done_listing(&trace, result);
+}
+
+char *tree_list(Tree *tree, const char *path) {
+  return tree_list_until(tree, NULL, path, NULL);
+}
+
+char *tree_list_timed(Tree *tree, const char *path,
+                      const struct timespec *deadline) {
+  return tree_list_until(tree, NULL, path, deadline);
+}
+
+char *tree_list_try(Tree *tree, const char *path) {
+  return tree_list_until(tree, NULL, path, SYNCHRO_NO_WAIT);
+}
+
+char *tree_list_range(Tree *tree, const char *path, const char *from,
+                      const char *to, size_t limit) {
+  struct TraceOp trace;
+  trace_op_start(&trace, "list_range", tree, path);
+  if (!is_path_valid(path)) {
+    errno = EINVAL;
+    return trace_op_done_listing(&trace, NULL);
+  }
+
+  Tree *cur_folder = tree;
+  if (synchro_visit_path(&cur_folder, path, NULL, NULL) == ENOENT) {
+    errno = ENOENT;
+    return trace_op_done_listing(&trace, NULL);
+  }
+
+  char *result = make_folder_range_string(cur_folder, from, to, "", limit);
+  synchro_leave_covering_after_visiting(cur_folder, NULL);
+  return trace_op_done_listing(&trace, result);
+}
+
+char *tree_list_prefix(Tree *tree, const char *path, const char *prefix,
+                       size_t limit) {
+  struct TraceOp trace;
+  trace_op_start(&trace, "list_prefix", tree, path);
+  if (!is_path_valid(path)) {
+    errno = EINVAL;
+    return trace_op_done_listing(&trace, NULL);
+  }
+
+  Tree *cur_folder = tree;
+  if (synchro_visit_path(&cur_folder, path, NULL, NULL) == ENOENT) {
+    errno = ENOENT;
+    return trace_op_done_listing(&trace, NULL);
+  }
+
+  char *result =
+      make_folder_range_string(cur_folder, NULL, NULL, prefix, limit);
+  synchro_leave_covering_after_visiting(cur_folder, NULL);
+  return trace_op_done_listing(&trace, result);
+}
+
+int tree_list_into(Tree *tree, const char *path, char *buf, size_t cap,
+                   size_t *needed) {
+  struct TraceOp trace;
+  trace_op_start(&trace, "list_into", tree, path);
+  if (!is_path_valid(path)) {
+    return trace_op_done(&trace, EINVAL);
+  }
+
+  Tree *cur_folder = tree;
+  if (synchro_visit_path(&cur_folder, path, NULL, NULL) == ENOENT) {
+    return trace_op_done(&trace, ENOENT);
+  }
+
+  size_t result_size = folder_contents_size(cur_folder);
+  *needed = result_size;
+
+  int result = ERANGE;
+  if (cap >= result_size) {
+    const char *last;
+    write_children_after(cur_folder, NULL, buf, cap, &last);
+    result = 0;
+  }
+  synchro_leave_covering_after_visiting(cur_folder, NULL);
+  return trace_op_done(&trace, result);
+}
+
+void tree_list_cursor_init(struct TreeListCursor *cursor) {
+  cursor->last[0] = '\0';
+}
+
+int tree_list_iter(Tree *tree, const char *path,
+                   struct TreeListCursor *cursor, char *buf, size_t cap,
+                   size_t *count) {
+  struct TraceOp trace;
+  trace_op_start(&trace, "list_iter", tree, path);
+  if (!is_path_valid(path) || cap < MAX_FOLDER_NAME_LENGTH + 1) {
+    return trace_op_done(&trace, EINVAL);
+  }
+
+  Tree *cur_folder = tree;
+  if (synchro_visit_path(&cur_folder, path, NULL, NULL) == ENOENT) {
+    return trace_op_done(&trace, ENOENT);
+  }
+
+  const char *last = NULL;
+  *count = write_children_after(
+      cur_folder, cursor->last[0] == '\0' ? NULL : cursor->last, buf, cap,
+      &last);
+  if (last != NULL) {
+    strcpy(cursor->last, last);
+  }
+
+  synchro_leave_covering_after_visiting(cur_folder, NULL);
+  return trace_op_done(&trace, 0);
+}
+
+int tree_stat(Tree *tree, const char *path, struct TreeStat *stat) {
+  struct TraceOp trace;
+  trace_op_start(&trace, "stat", tree, path);
+  if (!is_path_valid(path)) {
+    return trace_op_done(&trace, EINVAL);
+  }
+  if (!tree->global->aggregates) {
+    return trace_op_done(&trace, ENOTSUP);
+  }
+
+  Tree *cur_folder = tree;
+  if (synchro_visit_path(&cur_folder, path, NULL, NULL) == ENOENT) {
+    return trace_op_done(&trace, ENOENT);
+  }
+
+  if (atomic_load(&(cur_folder->height_dirty))) {
+    repair_height(cur_folder);
+  }
+  stat->descendants = descendants_of(cur_folder);
+  stat->max_depth = atomic_load(&(cur_folder->height));
+
+  synchro_leave_covering_after_visiting(cur_folder, NULL);
+  return trace_op_done(&trace, 0);
+}
+
+/**
+ * Gets to a node specified in path and takes reading (or, if is_modifying,
+ * writing) rights to its first stripe, which guards its payload.
+ * @return 0 on success, ENOENT if the node doesn't exist (no rights are held
+ * then)
+ */
+int synchro_enter_payload(Tree **cur_folder, const char *path,
+                          bool is_modifying) {
+  char folder_name[MAX_FOLDER_NAME_LENGTH + 1];
+  char *parent_path = make_path_to_parent(path, folder_name);
+
+  if (parent_path == NULL) { // the root, which can't be removed
+    struct Synchro *synchronizer = stripe_synchro(*cur_folder, 0);
+    return is_modifying ? synchro_modify_until(synchronizer, NULL)
+                        : synchro_visit_until(synchronizer, NULL);
+  }
+
+  Tree *parent = *cur_folder;
+  int err = synchro_visit_path(&parent, parent_path, folder_name, NULL);
+  free(parent_path);
+  if (err != 0) {
+    return err;
+  }
+
+  *cur_folder = child_acquire(parent, folder_name);
+  if (*cur_folder == NULL) {
+    err = ENOENT;
+  } else {
+    struct Synchro *synchronizer = stripe_synchro(*cur_folder, 0);
+    err = is_modifying ? synchro_modify_until(synchronizer, NULL)
+                       : synchro_visit_until(synchronizer, NULL);
+    tree_node_unref(*cur_folder);
+  }
+  synchro_leave_after_visiting(synchro_of(parent, folder_name));
+  return err;
+}
+
+void synchro_leave_payload(Tree *node, bool is_modifying) {
+  if (is_modifying) {
+    synchro_leave_after_modifying(stripe_synchro(node, 0));
+  } else {
+    synchro_leave_after_visiting(stripe_synchro(node, 0));
+  }
+}
+
+int tree_payload_get(Tree *tree, const char *path, void *payload) {
+  struct TraceOp trace;
+  trace_op_start(&trace, "payload_get", tree, path);
+  if (!is_path_valid(path)) {
+    return trace_op_done(&trace, EINVAL);
+  }
+  if (tree->global->payload_size == 0) {
+    return trace_op_done(&trace, ENOTSUP);
+  }
+
+  Tree *node = tree;
+  int err = synchro_enter_payload(&node, path, false);
+  if (err != 0) {
+    return trace_op_done(&trace, err);
+  }
+  memcpy(payload, node->payload, tree->global->payload_size);
+  synchro_leave_payload(node, false);
+  return trace_op_done(&trace, 0);
+}
+
+int tree_payload_update(Tree *tree, const char *path,
+                        TreePayloadUpdate update, void *arg) {
+  struct TraceOp trace;
+  trace_op_start(&trace, "payload_update", tree, path);
+  if (!is_path_valid(path)) {
+    return trace_op_done(&trace, EINVAL);
+  }
+  if (tree->global->payload_size == 0) {
+    return trace_op_done(&trace, ENOTSUP);
+  }
+
+  Tree *node = tree;
+  int err = synchro_enter_payload(&node, path, true);
+  if (err != 0) {
+    return trace_op_done(&trace, err);
+  }
+  update(node->payload, arg);
+  synchro_leave_payload(node, true);
+  return trace_op_done(&trace, 0);
+}
+
+struct PayloadCopy {
+  const void *data;
+  size_t size;
+};
+
+void copy_payload(void *payload, void *arg) {
+  struct PayloadCopy *copy = arg;
+  memcpy(payload, copy->data, copy->size);
+}
+
+int tree_payload_set(Tree *tree, const char *path, const void *payload) {
+  struct PayloadCopy copy = {payload, tree->global->payload_size};
+  return tree_payload_update(tree, path, copy_payload, &copy);
+}
+
+/**
+ * Creates a new directory in a given path (relative to the folder of
+ * a handle if at isn't NULL), with stripes_count stripes (0 for a regular
+ * directory) and locks following policy, giving up at a deadline (see
+ * synchro_visit_until).
+ */
+int tree_create_striped(Tree *tree, TreeHandle *at, const char *path,
+                        int stripes_count, enum SynchroPolicy policy,
+                        const struct timespec *deadline) {
+  struct TraceOp trace;
+  trace_op_start(&trace, "create", tree, path);
+  if (!is_path_valid_at(at, path)) {
+    return trace_op_done(&trace, EINVAL);
+  }
+
+  char folder_name[MAX_FOLDER_NAME_LENGTH + 1];
+
+  // getting the name of the folder to make
+  const char *subpath = make_path_to_parent(path, folder_name);
+  if (subpath == NULL) { // if wants to create "/"
+    return trace_op_done(&trace, EEXIST);
+  }
+  const char *to_free = subpath; // cause make_path_to_parent copies
+
+  // getting to the needed place in the folder tree
+  Tree *cur_folder = start_of(tree, at);
+  int err = synchro_visit_path(&cur_folder, subpath, folder_name, deadline);
+  free((void *)to_free);
+  if (err != 0) {
+    return trace_op_done(&trace, err);
+  }
+
+  // children with other names are created and removed at the same time,
+  // the map is only locked for looking the name up and for inserting it
+  struct Synchro *synchronizer = synchro_of(cur_folder, folder_name);
+  HashMap *children = children_of(cur_folder, folder_name);
+  if ((err = synchro_change_from_visiting_to_intent_until(synchronizer,
+                                                          deadline)) != 0) {
+    return trace_op_done(&trace, err);
+  }
+  if ((err = handle_check(at)) != 0) {
+    synchro_leave_after_intending(synchronizer);
+    return trace_op_done(&trace, err);
+  }
+
+  // if the folder already exists
+  lock_children(cur_folder, folder_name);
+  bool exists = hmap_get(children, folder_name) != NULL;
+  unlock_children(cur_folder, folder_name);
+  if (exists) {
+    synchro_leave_after_intending(synchronizer);
+    return trace_op_done(&trace, EEXIST);
+  }
+
+  // getting ready to modify
+  Tree *new_folder = tree_node_new(folder_name, stripes_count, policy,
+                                   tree->global->payload_size);
+  new_folder->parent = cur_folder;
+  // it can't be removed before it's counted in the aggregates
+  struct Synchro *new_synchro = stripe_synchro(new_folder, 0);
+  synchro_modify(new_synchro);
+  lock_children(cur_folder, folder_name);
+  bool is_inserted = children_insert(cur_folder, new_folder);
+  unlock_children(cur_folder, folder_name);
+  if (!is_inserted) { // made by another thread in the meantime
+    synchro_leave_after_modifying(new_synchro);
+    tree_destroy(new_folder);
+    synchro_leave_after_intending(synchronizer);
+    return trace_op_done(&trace, EEXIST);
+  }
+
+  if (tree->global->aggregates) {
+    struct BRLock *aggregates_lock = &(tree->global->aggregates_lock);
+    int shard = brlock_read_lock(aggregates_lock);
+    aggregates_add(cur_folder, 1, 0);
+    brlock_read_unlock(aggregates_lock, shard);
+  }
+
+  synchro_leave_after_modifying(new_synchro);
+  synchro_leave_after_intending(synchronizer);
+
+  char buffer[MAX_PATH_LENGTH + 1];
+  tree_watchers_publish(tree->global->watchers, TREE_EVENT_CREATE,
+                        absolute_path(at, path, buffer), NULL);
+  return trace_op_done(&trace, 0);
+}
+
+int tree_create(Tree *tree, const char *path) {
+  return tree_create_striped(tree, NULL, path, 0, tree->global->policy, NULL);
+}
+
+int tree_create_timed(Tree *tree, const char *path,
+                      const struct timespec *deadline) {
+  return tree_create_striped(tree, NULL, path, 0, tree->global->policy,
+                             deadline);
+}
+
+int tree_create_try(Tree *tree, const char *path) {
+  return tree_create_striped(tree, NULL, path, 0, tree->global->policy,
+                             SYNCHRO_NO_WAIT);
+}
+
+int tree_create_hot(Tree *tree, const char *path, int stripes_count) {
+  if (stripes_count < 1 || stripes_count > TREE_MAX_STRIPES) {
+    return EINVAL;
+  }
+  return tree_create_striped(tree, NULL, path, stripes_count,
+                             tree->global->policy, NULL);
+}
+
+int tree_create_with_policy(Tree *tree, const char *path,
+                            enum SynchroPolicy policy) {
+  if (policy < SYNCHRO_PHASE_FAIR || policy > SYNCHRO_FIFO) {
+    return EINVAL;
+  }
+  return tree_create_striped(tree, NULL, path, 0, policy, NULL);
+}
+
+/**
+ * tree_remove giving up at a deadline (see synchro_visit_until), with path
+ * relative to the folder of a handle if at isn't NULL.
+ */
+int tree_remove_until(Tree *tree, TreeHandle *at, const char *path,
+                      const struct timespec *deadline) {
+  struct TraceOp trace;
+  trace_op_start(&trace, "remove", tree, path);
+  if (!is_path_valid_at(at, path)) {
+    return trace_op_done(&trace, EINVAL);
+  }
+
+  char folder_name[MAX_FOLDER_NAME_LENGTH + 1];
+
+  const char *subpath = make_path_to_parent(path, folder_name);
+  if (subpath == NULL) {
+    return trace_op_done(&trace, EBUSY);
+  }
+  const char *to_free = subpath;
+
+  Tree *cur_folder = start_of(tree, at);
+  Tree *folder_to_delete;
+
+  // getting to my destination
+  int err = synchro_visit_path(&cur_folder, subpath, folder_name, deadline);
+  free((void *)to_free);
+  if (err != 0) {
+    return trace_op_done(&trace, err);
+  }
+
+  // like in tree_create, children with other names are created and removed
+  // at the same time
+  struct Synchro *synchronizer = synchro_of(cur_folder, folder_name);
+  if ((err = synchro_change_from_visiting_to_intent_until(synchronizer,
+                                                          deadline)) != 0) {
+    return trace_op_done(&trace, err);
+  }
+  if ((err = handle_check(at)) != 0) {
+    synchro_leave_after_intending(synchronizer);
+    return trace_op_done(&trace, err);
+  }
+
+  // folder to delete doesn't exist (a reference keeps it from being
+  // destroyed by another thread removing it at the same time)
+  if ((folder_to_delete = child_acquire(cur_folder, folder_name)) == NULL) {
+    synchro_leave_after_intending(synchronizer);
+    return trace_op_done(&trace, ENOENT);
+  }
+
+  // fails with ENOENT if the other thread removed it first
+  for (int i = 0; i < stripes_of(folder_to_delete); i++) {
+    err = synchro_prepare_for_being_removed_until(
+        stripe_synchro(folder_to_delete, i), deadline);
+    if (err != 0) {
+      while (i > 0) {
+        i--;
+        synchro_leave_after_bad_remove(stripe_synchro(folder_to_delete, i));
+      }
+      synchro_leave_after_intending(synchronizer);
+      tree_node_unref(folder_to_delete);
+      return trace_op_done(&trace, err);
+    }
+  }
+
+  // no writer is in, so it can't be filled while it's checked, and readers
+  // still inside are left to finish
+  if (is_folder_empty(folder_to_delete)) {
+    lock_children(cur_folder, folder_name);
+    children_remove(cur_folder, folder_to_delete);
+    unlock_children(cur_folder, folder_name);
+    // a dirty height of an empty folder can be more than 0
+    int height = atomic_load(&(folder_to_delete->height));
+    tree_node_bury(folder_to_delete);
+
+    if (tree->global->aggregates) {
+      struct BRLock *aggregates_lock = &(tree->global->aggregates_lock);
+      int shard = brlock_read_lock(aggregates_lock);
+      aggregates_subtract(cur_folder, 1, height);
+      brlock_read_unlock(aggregates_lock, shard);
+    }
+  } else {
+    for (int i = 0; i < stripes_of(folder_to_delete); i++) {
+      synchro_leave_after_bad_remove(stripe_synchro(folder_to_delete, i));
+    }
+    synchro_leave_after_intending(synchronizer);
+    tree_node_unref(folder_to_delete);
+    return trace_op_done(&trace, ENOTEMPTY);
+  }
+
+  synchro_leave_after_intending(synchronizer);
+  tree_node_unref(folder_to_delete);
+
+  char buffer[MAX_PATH_LENGTH + 1];
+  tree_watchers_publish(tree->global->watchers, TREE_EVENT_REMOVE,
+                        absolute_path(at, path, buffer), NULL);
+  return trace_op_done(&trace, 0);
+}
+
+int tree_remove(Tree *tree, const char *path) {
+  return tree_remove_until(tree, NULL, path, NULL);
+}
+
+int tree_remove_timed(Tree *tree, const char *path,
+                      const struct timespec *deadline) {
+  return tree_remove_until(tree, NULL, path, deadline);
+}
+
+int tree_remove_try(Tree *tree, const char *path) {
+  return tree_remove_until(tree, NULL, path, SYNCHRO_NO_WAIT);
+}
+
+/**
+ * Utility function that computes the number of nodes from root to lca
+ * @param first first path
+ * @param second second path
+ * @return number of nodes (folders) from root to lca
+ */
+int get_lca_path_length(const char *first, const char *second) {
+  char component1[MAX_FOLDER_NAME_LENGTH + 1];
+  char component2[MAX_FOLDER_NAME_LENGTH + 1];
+  const char *subpath1 = first;
+  const char *subpath2 = second;
+
+  int how_many_dirs_without_base = 0;
+  while ((subpath1 = split_path(subpath1, component1)) &&
+         ((subpath2 = split_path(subpath2, component2))) &&
+         strcmp(component1, component2) == 0) {
+    how_many_dirs_without_base++;
+  }
+
+  return how_many_dirs_without_base;
+}
+
+
+/**
+ * Takes rights to a stripe, modifying ones if modify is set and reading ones
+ * otherwise, giving up at a deadline (see synchro_visit_until).
+ */
+int synchro_take_until(struct Synchro *synchronizer, bool modify,
+                       const struct timespec *deadline) {
+  if (modify) {
+    return synchro_modify_until(synchronizer, deadline);
+  }
+  return synchro_visit_until(synchronizer, deadline);
+}
+
+/**
+ * Takes rights to two stripes of one folder (they may be the same stripe),
+ * modifying ones if the matching flag is set and reading ones otherwise.
+ * Stripes of a folder are always taken in the order they're laid out in,
+ * so threads taking more than one of them can't wait for one another.
+ * @return 0 on success, ETIMEDOUT or EWOULDBLOCK if the deadline has passed,
+ * no rights are held then
+ */
+int synchro_take_pair(struct Synchro *first, bool modify_first,
+                      struct Synchro *second, bool modify_second,
+                      const struct timespec *deadline) {
+  if (first == second) {
+    return synchro_take_until(first, modify_first || modify_second, deadline);
+  }
+  if (first > second) {
+    struct Synchro *tmp = first;
+    first = second;
+    second = tmp;
+    bool tmp_modify = modify_first;
+    modify_first = modify_second;
+    modify_second = tmp_modify;
+  }
+
+  int err = synchro_take_until(first, modify_first, deadline);
+  if (err != 0) {
+    return err;
+  }
+  if ((err = synchro_take_until(second, modify_second, deadline)) != 0) {
+    if (modify_first) {
+      synchro_leave_after_modifying(first);
+    } else {
+      synchro_leave_after_visiting(first);
+    }
+  }
+  return err;
+}
+
+/**
+ * Surrenders the rights taken with synchro_take_pair. If only_visits is set,
+ * the modifying rights are kept.
+ */
+void synchro_leave_pair(struct Synchro *first, bool modify_first,
+                        struct Synchro *second, bool modify_second,
+                        bool only_visits) {
+  if (first == second) {
+    modify_first = modify_first || modify_second;
+  }
+  if (modify_first && !only_visits) {
+    synchro_leave_after_modifying(first);
+  } else if (!modify_first) {
+    synchro_leave_after_visiting(first);
+  }
+  if (first == second) {
+    return;
+  }
+  if (modify_second && !only_visits) {
+    synchro_leave_after_modifying(second);
+  } else if (!modify_second) {
+    synchro_leave_after_visiting(second);
+  }
+}
+
+/**
+ * Gets to a folder specified in path and takes rights to its stripes
+ * covering two names with synchro_take_pair.
+ * @return 0 on success, ENOENT if the folder doesn't exist, ETIMEDOUT or
+ * EWOULDBLOCK if the deadline has passed (no rights are held then)
+ */
+int synchro_take_pair_at_path(Tree **cur_folder, const char *path,
+                              const char *first_name, bool modify_first,
+                              const char *second_name, bool modify_second,
+                              const struct timespec *deadline) {
+  char folder_name[MAX_FOLDER_NAME_LENGTH + 1];
+  char *parent_path = make_path_to_parent(path, folder_name);
+
+  // the folder paths start at doesn't need its parent's protection: the root
+  // can't be removed, and an open folder that's removed is dead
+  // (see synchro_leave_after_remove)
+  if (parent_path != NULL) {
+    Tree *parent = *cur_folder;
+    int err = synchro_visit_path(&parent, parent_path, folder_name, deadline);
+    free(parent_path);
+    if (err != 0) {
+      return err;
+    }
+
+    *cur_folder = child_acquire(parent, folder_name);
+    if (*cur_folder == NULL) {
+      synchro_leave_after_visiting(synchro_of(parent, folder_name));
+      return ENOENT;
+    }
+    err = synchro_take_pair(synchro_of(*cur_folder, first_name), modify_first,
+                            synchro_of(*cur_folder, second_name),
+                            modify_second, deadline);
+    synchro_leave_after_visiting(synchro_of(parent, folder_name));
+    tree_node_unref(*cur_folder);
+    return err;
+  }
+
+  return synchro_take_pair(synchro_of(*cur_folder, first_name), modify_first,
+                           synchro_of(*cur_folder, second_name), modify_second,
+                           deadline);
+}
+
+/**
+ * Gets from a folder to a node specified in path, like synchro_get_to_path
+ * does, but the rights to the starting folder are kept (also on failure).
+ */
+int synchro_get_to_path_from(Tree **cur_folder, const char *path,
+                             const char *name,
+                             const struct timespec *deadline) {
+  char component[MAX_FOLDER_NAME_LENGTH + 1];
+  char next_component[MAX_FOLDER_NAME_LENGTH + 1];
+
+  const char *subpath = split_path(path, component);
+  if (subpath == NULL) {
+    return 0;
+  }
+
+  Tree *start = *cur_folder;
+  *cur_folder = child_acquire(start, component);
+  if (*cur_folder == NULL) {
+    *cur_folder = start;
+    return ENOENT;
+  }
+  int err = synchro_visit_covering(
+      *cur_folder, split_path(subpath, next_component) ? next_component : name,
+      deadline);
+  tree_node_unref(*cur_folder);
+  if (err != 0) {
+    *cur_folder = start;
+    return err;
+  }
+  return synchro_get_to_path(cur_folder, subpath, name, deadline);
+}
+
+/**
+ * Moves the child to_move of the folder source to the folder target, where
+ * it is called new_name, both relative to the folder of a handle if at isn't
+ * NULL. The caller must hold the rename lock.
+ * The lca of both parents is only visited, and only until both parents are
+ * locked. Of the parents, the one being the lca (if any) is locked first,
+ * otherwise they lie in different subtrees of the lca, so the traversal to
+ * one of them never runs into the other one.
+ */
+int move_child(Tree *tree, TreeHandle *at, const char *source,
+               const char *to_move, const char *target, const char *new_name,
+               const struct timespec *deadline) {
+  int lca_path = get_lca_path_length(source, target);
+
+  // cutting the path to lca from beginning of source and target
+  const char *lca_end = source;
+  while (lca_path > 0) {
+    lca_path--;
+    lca_end = split_path(lca_end, NULL);
+    target = split_path(target, NULL);
+  }
+  size_t lca_path_length = lca_end - source + 1;
+  char *lca_path_string = malloc(lca_path_length + 1);
+  CHECK_PTR(lca_path_string);
+  strncpy(lca_path_string, source, lca_path_length);
+  lca_path_string[lca_path_length] = '\0';
+  source = lca_end;
+
+  // here source and target are paths from lca
+  bool is_target_first = split_path(target, NULL) == NULL;
+  const char *first_path = is_target_first ? target : source;
+  const char *first_name = is_target_first ? new_name : to_move;
+  const char *second_path = is_target_first ? source : target;
+  const char *second_name = is_target_first ? to_move : new_name;
+
+  char first_component[MAX_FOLDER_NAME_LENGTH + 1];
+  char second_component[MAX_FOLDER_NAME_LENGTH + 1];
+  bool is_first_the_lca = split_path(first_path, first_component) == NULL;
+  bool is_second_the_lca = split_path(second_path, second_component) == NULL;
+  const char *first_at_lca = is_first_the_lca ? first_name : first_component;
+  const char *second_at_lca =
+      is_second_the_lca ? second_name : second_component;
+
+  // parents being the lca are modified, otherwise it's only visited
+  Tree *lca = start_of(tree, at);
+  int err = synchro_take_pair_at_path(&lca, lca_path_string, first_at_lca,
+                                      is_first_the_lca, second_at_lca,
+                                      is_second_the_lca, deadline);
+  free(lca_path_string);
+  if (err != 0) {
+    return err;
+  }
+  struct Synchro *first_at_lca_synchro = synchro_of(lca, first_at_lca);
+  struct Synchro *second_at_lca_synchro = synchro_of(lca, second_at_lca);
+
+  Tree *first_folder = lca;
+  if (!is_first_the_lca) {
+    if ((err = synchro_get_to_path_from(&first_folder, first_path, first_name,
+                                        deadline)) == 0) {
+      err = synchro_change_from_visiting_to_mod_until(
+          synchro_of(first_folder, first_name), deadline);
+    }
+    if (err != 0) {
+      synchro_leave_pair(first_at_lca_synchro, is_first_the_lca,
+                         second_at_lca_synchro, is_second_the_lca, false);
+      return err;
+    }
+  }
+
+  Tree *second_folder = lca;
+  if (!is_second_the_lca) {
+    if ((err = synchro_get_to_path_from(&second_folder, second_path,
+                                        second_name, deadline)) == 0) {
+      err = synchro_change_from_visiting_to_mod_until(
+          synchro_of(second_folder, second_name), deadline);
+    }
+    if (err != 0) {
+      synchro_leave_pair(first_at_lca_synchro, is_first_the_lca,
+                         second_at_lca_synchro, is_second_the_lca, false);
+      if (!is_first_the_lca) {
+        synchro_leave_after_modifying(synchro_of(first_folder, first_name));
+      }
+      return err;
+    }
+  }
+
+  // both parents are locked, lca isn't needed anymore
+  synchro_leave_pair(first_at_lca_synchro, is_first_the_lca,
+                     second_at_lca_synchro, is_second_the_lca, true);
+
+  Tree *source_folder = is_target_first ? second_folder : first_folder;
+  Tree *dest_folder = is_target_first ? first_folder : second_folder;
+  struct Synchro *source_synchro = synchro_of(source_folder, to_move);
+  struct Synchro *dest_synchro = synchro_of(dest_folder, new_name);
+
+  int result = handle_check(at);
+  Tree *child = hmap_get(children_of(source_folder, to_move), to_move);
+  if (result != 0) {
+    // the paths may lead somewhere else than meant
+  } else if (child == NULL) {
+    result = ENOENT;
+  } else if (hmap_get(children_of(dest_folder, new_name), new_name) != NULL) {
+    result = EEXIST;
+  } else if ((result = synchro_modify_whole_until(child, deadline)) == 0) {
+    children_remove(source_folder, child);
+    tree_node_rename(child, new_name);
+    children_insert(dest_folder, child);
+
+    if (tree->global->aggregates) {
+      struct BRLock *aggregates_lock = &(tree->global->aggregates_lock);
+      brlock_write_lock(aggregates_lock);
+      long count = descendants_of(child) + 1;
+      int height = atomic_load(&(child->height));
+      aggregates_subtract(source_folder, count, height);
+      child->parent = dest_folder;
+      aggregates_add(dest_folder, count, height);
+      if (atomic_load(&(child->height_dirty))) {
+        mark_heights_dirty(dest_folder, height);
+      }
+      brlock_write_unlock(aggregates_lock);
+    } else {
+      child->parent = dest_folder;
+    }
+    atomic_fetch_add(&(child->moves), 1);
+    synchro_leave_whole_after_modifying(child);
+  }
+
+  synchro_leave_after_modifying(source_synchro);
+  if (dest_synchro != source_synchro) {
+    synchro_leave_after_modifying(dest_synchro);
+  }
+  return result;
+}
+
+/**
+ * Returns the length of the path to the parent of a VALID path other than
+ * "/" (together with the final '/').
+ */
+size_t get_parent_path_length(const char *path) {
+  const char *p = path + strlen(path) - 2; // Point before final '/'.
+  while (*p != '/') {
+    p--;
+  }
+  return p - path + 1;
+}
+
+/**
+ * Renames a folder without moving it anywhere else: source and target are
+ * VALID paths, other than "/", sharing the parent (relative to the folder of
+ * a handle if at isn't NULL). The parent is reached with one traversal and
+ * only its part covering both names is modified.
+ */
+int rename_child(Tree *tree, TreeHandle *at, const char *source,
+                 const char *target, const struct timespec *deadline) {
+  char parent_path[MAX_PATH_LENGTH + 1];
+  char to_move[MAX_FOLDER_NAME_LENGTH + 1];
+  char new_name[MAX_FOLDER_NAME_LENGTH + 1];
+
+  size_t parent_path_length = get_parent_path_length(source);
+  memcpy(parent_path, source, parent_path_length);
+  parent_path[parent_path_length] = '\0';
+  split_path(source + parent_path_length - 1, to_move);
+  split_path(target + parent_path_length - 1, new_name);
+
+  Tree *parent = start_of(tree, at);
+  int err = synchro_take_pair_at_path(&parent, parent_path, to_move, true,
+                                      new_name, true, deadline);
+  if (err != 0) {
+    return err;
+  }
+
+  HashMap *source_children = children_of(parent, to_move);
+  HashMap *dest_children = children_of(parent, new_name);
+
+  int result = handle_check(at);
+  Tree *child = hmap_get(source_children, to_move);
+  // the key of the child until it's renamed, the maps borrow their keys
+  const char *name = name_intern(new_name);
+  if (result != 0) {
+    // the paths may lead somewhere else than meant
+  } else if (child == NULL) {
+    result = ENOENT;
+  } else if (source_children == dest_children) {
+    if (!hmap_rename(source_children, to_move, name)) {
+      result = EEXIST;
+    }
+  } else if (!hmap_insert_hashed(dest_children, name, name_interned_hash(name),
+                                 child)) {
+    result = EEXIST;
+  } else {
+    children_remove(parent, child);
+  }
+  if (result == 0) {
+    tree_node_rename(child, new_name);
+    atomic_fetch_add(&(child->moves), 1);
+  }
+  name_release(name);
+
+  synchro_leave_pair(synchro_of(parent, to_move), true,
+                     synchro_of(parent, new_name), true, false);
+  return result;
+}
+
+/**
+ * Takes the rename lock of a tree, giving up at a deadline
+ * (see synchro_visit_until).
+ */
+int rename_lock_until(Tree *tree, const struct timespec *deadline) {
+  pthread_mutex_t *rename_lock = &(tree->global->rename_lock);
+  int err;
+  if (deadline == NULL) {
+    err = pthread_mutex_lock(rename_lock);
+  } else if (deadline == SYNCHRO_NO_WAIT) {
+    if ((err = pthread_mutex_trylock(rename_lock)) == EBUSY) {
+      return EWOULDBLOCK;
+    }
+  } else {
+    // pthread_mutex_timedlock only takes CLOCK_REALTIME times
+    struct timespec now, realtime_deadline;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    clock_gettime(CLOCK_REALTIME, &realtime_deadline);
+    realtime_deadline.tv_sec += deadline->tv_sec - now.tv_sec;
+    realtime_deadline.tv_nsec += deadline->tv_nsec - now.tv_nsec;
+    if (realtime_deadline.tv_nsec < 0) {
+      realtime_deadline.tv_sec--;
+      realtime_deadline.tv_nsec += 1000000000;
+    } else if (realtime_deadline.tv_nsec >= 1000000000) {
+      realtime_deadline.tv_sec++;
+      realtime_deadline.tv_nsec -= 1000000000;
+    }
+    if ((err = pthread_mutex_timedlock(rename_lock, &realtime_deadline)) ==
+        ETIMEDOUT) {
+      return ETIMEDOUT;
+    }
+  }
+  if (err != 0) {
+    syserr(err, "mutex_lock failed");
+  }
+  return 0;
+}
+
+/**
+ * Moves a folder to a different parent: source and target are VALID paths,
+ * other than "/", with different parents (relative to the folder of a handle
+ * if at isn't NULL).
+ */
+int move_to_other_parent(Tree *tree, TreeHandle *at, const char *source,
+                         const char *target,
+                         const struct timespec *deadline) {
+  char new_name[MAX_FOLDER_NAME_LENGTH + 1];
+  char to_move[MAX_FOLDER_NAME_LENGTH + 1];
+
+  // for sure can't be null since they can't be "/"
+  char *target_parent = make_path_to_parent(target, new_name);
+  char *source_parent = make_path_to_parent(source, to_move);
+
+  int result = rename_lock_until(tree, deadline);
+  if (result == 0) {
+    result = move_child(tree, at, source_parent, to_move, target_parent,
+                        new_name, deadline);
+
+    int err;
+    if ((err = pthread_mutex_unlock(&(tree->global->rename_lock))) != 0) {
+      syserr(err, "mutex_unlock failed");
+    }
+  }
+
+  free(source_parent);
+  free(target_parent);
+  return result;
+}
+
+/**
+ * Checks the paths of a move, before looking at the tree.
+ * @return 0 if the move may succeed, its error otherwise
+ */
+int check_move(const char *source, const char *target) {
+  if (!is_path_valid(source) || !is_path_valid(target)) {
+    return EINVAL;
+  }
+  if (strcmp(source, "/") == 0) {
+    return EBUSY;
+  }
+  if (strcmp(target, "/") == 0) {
+    return EEXIST;
+  }
+  if (strncmp(source, target, strlen(source)) == 0) {
+    return EILLEGALMOVE;
+  }
+  return 0;
+}
+
+/**
+ * tree_move giving up at a deadline (see synchro_visit_until), with paths
+ * relative to the folder of a handle if at isn't NULL.
+ */
+int tree_move_until(Tree *tree, TreeHandle *at, const char *source,
+                    const char *target, const struct timespec *deadline) {
+  struct TraceOp trace;
+  trace_op_start(&trace, "move", tree, source);
+  int result = check_move(source, target);
+  if (result == 0 &&
+      (!is_path_valid_at(at, source) || !is_path_valid_at(at, target))) {
+    result = EINVAL;
+  }
+  if (result != 0) {
+    return trace_op_done(&trace, result);
+  }
+
+  size_t parent_path_length = get_parent_path_length(source);
+  if (parent_path_length == get_parent_path_length(target) &&
+      strncmp(source, target, parent_path_length) == 0) {
+    result = rename_child(tree, at, source, target, deadline);
+  } else {
+    result = move_to_other_parent(tree, at, source, target, deadline);
+  }
+
+  if (result == 0) {
+    char source_buffer[MAX_PATH_LENGTH + 1];
+    char target_buffer[MAX_PATH_LENGTH + 1];
+    tree_watchers_publish(tree->global->watchers, TREE_EVENT_MOVE,
+                          absolute_path(at, source, source_buffer),
+                          absolute_path(at, target, target_buffer));
+  }
+  return trace_op_done(&trace, result);
+}
+
+int tree_move(Tree *tree, const char *source, const char *target) {
+  return tree_move_until(tree, NULL, source, target, NULL);
+}
+
+int tree_move_timed(Tree *tree, const char *source, const char *target,
+                    const struct timespec *deadline) {
+  return tree_move_until(tree, NULL, source, target, deadline);
+}
+
+int tree_move_try(Tree *tree, const char *source, const char *target) {
+  return tree_move_until(tree, NULL, source, target, SYNCHRO_NO_WAIT);
+}
+
+
+/**
+ * A subtree waiting to be walked, given by the path of its root. Waiting
+ * subtrees hold no rights, like any other reader a worker only holds the
+ * folders on its way from the root of the tree to the folder it's at.
+ */
+struct WalkTask {
+  char *path;
+  int depth;
+  GlobStates states; // of the automaton of a glob after reading path
+};
+
+/**
+ * Subtrees handed out by one worker of a walk. The worker takes them from the
+ * back, and the others steal them from the front, getting the ones closest to
+ * the root, so the largest ones.
+ */
+struct WalkDeque {
+  pthread_mutex_t lock;
+  struct WalkTask *tasks; // tasks[head..tail) are waiting
+  size_t head;
+  size_t tail;
+  size_t capacity;
+};
+
+/**
+ * A folder being walked by a worker, with a merge of its children.
+ */
+struct WalkFrame {
+  Tree *folder;
+  struct ChildrenMerge *merge;
+  size_t path_length;
+  int depth;
+
+  // of a glob, the children that can match all start with prefix
+  GlobStates states;
+  char prefix[MAX_FOLDER_NAME_LENGTH + 1];
+  size_t prefix_length;
+};
+
+struct Walk {
+  Tree *tree;
+  TreeWalkCallback callback;
+  void *arg;
+  int max_depth;
+  bool is_parallel;
+  const Glob *glob; // only the paths it matches are passed to the callback
+
+  int workers_count;
+  struct WalkDeque *deques;
+
+  atomic_size_t pending; // subtrees waiting or being walked
+  atomic_size_t waiting; // subtrees waiting in the deques
+  atomic_int result;     // value the walk was stopped with, 0 if it wasn't
+
+  // workers with nothing to steal sleep here
+  pthread_mutex_t idle_lock;
+  pthread_cond_t idle_cond;
+  atomic_int idle;
+};
+
+struct WalkWorker {
+  struct Walk *walk;
+  int index;
+
+  // reused by every subtree the worker walks
+  char *path;
+  size_t path_capacity;
+  struct WalkFrame *frames;
+  int frames_capacity;
+};
+
+void walk_lock(pthread_mutex_t *lock) {
+  int err;
+  if ((err = pthread_mutex_lock(lock)) != 0) {
+    syserr(err, "mutex_lock failed");
+  }
+}
+
+void walk_unlock(pthread_mutex_t *lock) {
+  int err;
+  if ((err = pthread_mutex_unlock(lock)) != 0) {
+    syserr(err, "mutex_unlock failed");
+  }
+}
+
+void walk_wake_idle(struct Walk *walk) {
+  walk_lock(&(walk->idle_lock));
+  int err;
+  if ((err = pthread_cond_broadcast(&(walk->idle_cond))) != 0) {
+    syserr(err, "cond_broadcast failed");
+  }
+  walk_unlock(&(walk->idle_lock));
+}
+
+/**
+ * Hands out a subtree, to be walked by any worker.
+ */
+void walk_push(struct Walk *walk, int index, const char *path, int depth,
+               GlobStates states) {
+  struct WalkTask task = {strdup(path), depth, states};
+  CHECK_PTR(task.path);
+  atomic_fetch_add(&(walk->pending), 1);
+
+  struct WalkDeque *deque = &(walk->deques[index]);
+  walk_lock(&(deque->lock));
+  if (deque->tail == deque->capacity) {
+    if (deque->head > 0) {
+      memmove(deque->tasks, deque->tasks + deque->head,
+              (deque->tail - deque->head) * sizeof(struct WalkTask));
+      deque->tail -= deque->head;
+      deque->head = 0;
+    } else {
+      deque->capacity = deque->capacity ? 2 * deque->capacity : 16;
+      deque->tasks =
+          realloc(deque->tasks, deque->capacity * sizeof(struct WalkTask));
+      CHECK_PTR(deque->tasks);
+    }
+  }
+  deque->tasks[deque->tail] = task;
+  deque->tail++;
+  walk_unlock(&(deque->lock));
+
+  atomic_fetch_add(&(walk->waiting), 1);
+  if (atomic_load(&(walk->idle)) > 0) {
+    walk_wake_idle(walk);
+  }
+}
+
+/**
+ * Takes a subtree from the back of a worker's own deque or, if it's empty,
+ * from the front of another one.
+ * @return true if a subtree was taken
+ */
+bool walk_take(struct Walk *walk, int index, struct WalkTask *task) {
+  for (int i = 0; i < walk->workers_count; i++) {
+    struct WalkDeque *deque =
+        &(walk->deques[(index + i) % walk->workers_count]);
+    walk_lock(&(deque->lock));
+    bool found = deque->head < deque->tail;
+    if (found && i == 0) {
+      deque->tail--;
+      *task = deque->tasks[deque->tail];
+    } else if (found) {
+      *task = deque->tasks[deque->head];
+      deque->head++;
+    }
+    walk_unlock(&(deque->lock));
+    if (found) {
+      atomic_fetch_sub(&(walk->waiting), 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Calls the callback for a folder the worker has reading rights to (unless
+ * the glob doesn't match it) and, if its children are to be walked, starts
+ * a frame for it. Otherwise surrenders the rights.
+ */
+void walk_enter(struct WalkWorker *worker, Tree *folder, size_t path_length,
+                int depth, GlobStates states, int *frames_count) {
+  struct Walk *walk = worker->walk;
+
+  int action = TREE_WALK_CONTINUE;
+  if (walk->glob == NULL || glob_is_match(walk->glob, states)) {
+    action = walk->callback(worker->path, depth, walk->arg);
+  }
+  if (action != TREE_WALK_CONTINUE && action != TREE_WALK_PRUNE) {
+    int expected = 0;
+    atomic_compare_exchange_strong(&(walk->result), &expected, action);
+  }
+  if (action != TREE_WALK_CONTINUE || depth == walk->max_depth ||
+      (walk->glob != NULL && !glob_can_continue(walk->glob, states))) {
+    synchro_leave_covering_after_visiting(folder, NULL);
+    return;
+  }
+
+  if (*frames_count == worker->frames_capacity) {
+    int capacity = worker->frames_capacity ? 2 * worker->frames_capacity : 16;
+    worker->frames =
+        realloc(worker->frames, capacity * sizeof(struct WalkFrame));
+    CHECK_PTR(worker->frames);
+    for (int i = worker->frames_capacity; i < capacity; i++) {
+      worker->frames[i].merge = malloc(sizeof(struct ChildrenMerge));
+      CHECK_PTR(worker->frames[i].merge);
+    }
+    worker->frames_capacity = capacity;
+  }
+  struct WalkFrame *frame = &(worker->frames[*frames_count]);
+  frame->folder = folder;
+  frame->path_length = path_length;
+  frame->depth = depth;
+  frame->states = states;
+  frame->prefix_length = 0;
+  if (walk->glob != NULL) {
+    frame->prefix_length = glob_prefix(walk->glob, states, frame->prefix);
+  }
+  // the merge skips right to the children that can match
+  children_merge_init(frame->merge, folder,
+                      frame->prefix_length > 0 ? frame->prefix : NULL, false);
+  (*frames_count)++;
+}
+
+/**
+ * Walks a subtree depth first, holding the rights to every folder from its
+ * root to the current one. Children are handed out to other workers instead,
+ * while some of them are idle.
+ */
+void walk_subtree(struct WalkWorker *worker, struct WalkTask *task) {
+  struct Walk *walk = worker->walk;
+
+  Tree *folder = walk->tree;
+  if (atomic_load(&(walk->result)) != 0 ||
+      synchro_visit_path(&folder, task->path, NULL, NULL) != 0) {
+    return; // the subtree was removed or moved in the meantime
+  }
+
+  size_t path_length = strlen(task->path);
+  if (path_length + 1 > worker->path_capacity) {
+    worker->path_capacity = 2 * (path_length + 1);
+    worker->path = realloc(worker->path, worker->path_capacity);
+    CHECK_PTR(worker->path);
+  }
+  memcpy(worker->path, task->path, path_length + 1);
+
+  int frames_count = 0;
+  walk_enter(worker, folder, path_length, task->depth, task->states,
+             &frames_count);
+  while (frames_count > 0) {
+    struct WalkFrame *frame = &(worker->frames[frames_count - 1]);
+    Tree *child;
+    const char *name = NULL;
+    if (atomic_load(&(walk->result)) == 0) {
+      name = children_merge_next(frame->merge, &child);
+    }
+    if (name != NULL &&
+        strncmp(name, frame->prefix, frame->prefix_length) != 0) {
+      name = NULL; // past the names starting with the prefix
+    }
+    if (name == NULL) {
+      synchro_leave_covering_after_visiting(frame->folder, NULL);
+      frames_count--;
+      continue;
+    }
+    GlobStates states = 0;
+    if (walk->glob != NULL) {
+      states = glob_step(walk->glob, frame->states, name);
+      if (states == 0) {
+        continue; // nothing below can match, it isn't even locked
+      }
+    }
+
+    size_t name_length = strlen(name);
+    path_length = frame->path_length + name_length + 1;
+    if (path_length + 1 > worker->path_capacity) {
+      worker->path_capacity = 2 * (path_length + 1);
+      worker->path = realloc(worker->path, worker->path_capacity);
+      CHECK_PTR(worker->path);
+    }
+    memcpy(worker->path + frame->path_length, name, name_length);
+    worker->path[path_length - 1] = '/';
+    worker->path[path_length] = '\0';
+
+    if (walk->is_parallel && atomic_load(&(walk->idle)) > 0) {
+      walk_push(walk, worker->index, worker->path, frame->depth + 1, states);
+      continue;
+    }
+
+    int depth = frame->depth + 1;
+    synchro_visit_covering(child, NULL, NULL);
+    walk_enter(worker, child, path_length, depth, states, &frames_count);
+  }
+}
+
+void *walk_worker(void *data) {
+  struct WalkWorker *worker = data;
+  struct Walk *walk = worker->walk;
+  struct WalkTask task;
+
+  while (true) {
+    if (walk_take(walk, worker->index, &task)) {
+      walk_subtree(worker, &task);
+      free(task.path);
+      if (atomic_fetch_sub(&(walk->pending), 1) == 1) {
+        walk_wake_idle(walk);
+      }
+      continue;
+    }
+
+    walk_lock(&(walk->idle_lock));
+    atomic_fetch_add(&(walk->idle), 1);
+    while (atomic_load(&(walk->pending)) > 0 &&
+           atomic_load(&(walk->waiting)) == 0) {
+      int err;
+      if ((err = pthread_cond_wait(&(walk->idle_cond), &(walk->idle_lock))) !=
+          0) {
+        syserr(err, "cond_wait failed");
+      }
+    }
+    atomic_fetch_sub(&(walk->idle), 1);
+    bool is_done = atomic_load(&(walk->pending)) == 0;
+    walk_unlock(&(walk->idle_lock));
+    if (is_done) {
+      return NULL;
+    }
+  }
+}
+
+/**
+ * Walks the subtree of the directory path (see tree_walk), passing only the
+ * paths matched by glob to the callback, if it isn't NULL, starting in given
+ * states at a given depth.
+ * @param is_missing set to whether there's no directory path, if not NULL
+ * (a callback can stop the walk with ENOENT as well)
+ * @return like tree_walk
+ */
+int walk_run(Tree *tree, const char *path, const Glob *glob, GlobStates states,
+             int depth, TreeWalkCallback callback, void *arg, int flags,
+             int max_depth, bool *is_missing) {
+  struct Walk walk;
+  walk.tree = tree;
+  walk.callback = callback;
+  walk.arg = arg;
+  walk.max_depth = max_depth;
+  walk.is_parallel = flags & TREE_WALK_PARALLEL;
+  walk.glob = glob;
+  size_t workers_count = 1;
+  if (walk.is_parallel) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    workers_count = cpus > 1 ? (size_t)cpus : 1;
+  }
+  walk.workers_count = (int)workers_count;
+  walk.deques = calloc(workers_count, sizeof(struct WalkDeque));
+  CHECK_PTR(walk.deques);
+  atomic_init(&(walk.pending), 0);
+  atomic_init(&(walk.waiting), 0);
+  atomic_init(&(walk.result), 0);
+  atomic_init(&(walk.idle), 0);
+
+  int err;
+  if ((err = pthread_mutex_init(&(walk.idle_lock), 0)) != 0) {
+    syserr(err, "mutex_init failed");
+  }
+  if ((err = pthread_cond_init(&(walk.idle_cond), 0)) != 0) {
+    syserr(err, "cond_init failed");
+  }
+  for (int i = 0; i < walk.workers_count; i++) {
+    if ((err = pthread_mutex_init(&(walk.deques[i].lock), 0)) != 0) {
+      syserr(err, "mutex_init failed");
+    }
+  }
+
+  struct WalkWorker *workers = calloc(workers_count, sizeof(struct WalkWorker));
+  CHECK_PTR(workers);
+  for (int i = 0; i < walk.workers_count; i++) {
+    workers[i].walk = &walk;
+    workers[i].index = i;
+  }
+
+  // the start is walked by the calling thread, which is the first worker
+  int result = 0;
+  Tree *start = tree;
+  bool is_start_missing =
+      synchro_visit_path(&start, path, NULL, NULL) == ENOENT;
+  if (is_missing != NULL) {
+    *is_missing = is_start_missing;
+  }
+  if (is_start_missing) {
+    result = ENOENT;
+  } else {
+    synchro_leave_covering_after_visiting(start, NULL);
+    walk_push(&walk, 0, path, depth, states);
+
+    pthread_t *threads = malloc(workers_count * sizeof(pthread_t));
+    CHECK_PTR(threads);
+    for (int i = 1; i < walk.workers_count; i++) {
+      if ((err = pthread_create(&threads[i], NULL, walk_worker,
+                                &workers[i])) != 0) {
+        syserr(err, "pthread_create failed");
+      }
+    }
+    walk_worker(&workers[0]);
+    for (int i = 1; i < walk.workers_count; i++) {
+      if ((err = pthread_join(threads[i], NULL)) != 0) {
+        syserr(err, "pthread_join failed");
+      }
+    }
+    free(threads);
+    result = atomic_load(&(walk.result));
+  }
+
+  for (int i = 0; i < walk.workers_count; i++) {
+    for (int j = 0; j < workers[i].frames_capacity; j++) {
+      free(workers[i].frames[j].merge);
+    }
+    free(workers[i].frames);
+    free(workers[i].path);
+    if ((err = pthread_mutex_destroy(&(walk.deques[i].lock))) != 0) {
+      syserr(err, "mutex_destroy failed");
+    }
+    free(walk.deques[i].tasks);
+  }
+  if ((err = pthread_cond_destroy(&(walk.idle_cond))) != 0) {
+    syserr(err, "cond_destroy failed");
+  }
+  if ((err = pthread_mutex_destroy(&(walk.idle_lock))) != 0) {
+    syserr(err, "mutex_destroy failed");
+  }
+  free(workers);
+  free(walk.deques);
+  return result;
+}
+
+int tree_walk(Tree *tree, const char *path, TreeWalkCallback callback,
+              void *arg, int flags, int max_depth) {
+  struct TraceOp trace;
+  trace_op_start(&trace, "walk", tree, path);
+  if (!is_path_valid(path)) {
+    return trace_op_done(&trace, EINVAL);
+  }
+  return trace_op_done(&trace, walk_run(tree, path, NULL, 0, 0, callback, arg,
+                                        flags, max_depth, NULL));
+}
+
+int tree_glob(Tree *tree, const char *pattern, TreeWalkCallback callback,
+              void *arg, int flags) {
+  struct TraceOp trace;
+  trace_op_start(&trace, "glob", tree, NULL);
+  Glob *glob = glob_compile(pattern);
+  if (glob == NULL) {
+    return trace_op_done(&trace, EINVAL);
+  }
+
+  // the literal components are looked up like any path, and the walk starts
+  // below them
+  const char *path = glob_literal_path(glob);
+  int depth = 0;
+  for (const char *c = path + 1; *c != '\0'; c++) {
+    depth += *c == '/';
+  }
+  // no directory can match if the literal ones don't exist, while the
+  // callback's value is passed on whatever it is
+  bool is_missing;
+  int result = walk_run(tree, path, glob, glob_start(glob), depth, callback,
+                        arg, flags, -1, &is_missing);
+  glob_free(glob);
+  return trace_op_done(&trace, is_missing ? 0 : result);
+}
+
+/**
+ * Adds the memory of a folder and of its subtree to stats. The caller has
+ * reading rights to the whole folder, which it surrenders.
+ */
+void memory_stats_of(Tree *folder, size_t payload_size,
+                     struct TreeMemoryStats *stats) {
+  size_t locks = sizeof(struct Synchro) + sizeof(pthread_mutex_t);
+  stats->nodes += sizeof(Tree) - locks + payload_size;
+  if (folder->global != NULL) {
+    stats->nodes += sizeof(struct TreeGlobal);
+  }
+  stats->locks += locks;
+  size_t keys = 0; // none, the maps borrow the names of the children
+  stats->maps += hmap_memory(folder->children, &keys);
+  for (int i = 0; i < folder->stripes_count && folder->stripes; i++) {
+    stats->nodes += sizeof(struct TreeStripe) - locks;
+    stats->locks += locks;
+    stats->maps += hmap_memory(folder->stripes[i].children, &keys);
+  }
+
+  for (int i = 0; i < stripes_of(folder); i++) {
+    HashMap *children = stripe_children(folder, i);
+    HashMapIterator it = hmap_iterator(children);
+    const char *name;
+    Tree *child;
+    while (hmap_next(children, &it, &name, (void **)&child)) {
+      synchro_visit_covering(child, NULL, NULL);
+      memory_stats_of(child, payload_size, stats);
+    }
+  }
+  synchro_leave_covering_after_visiting(folder, NULL);
+}
+
+/**
+ * Returns the bytes the allocator holds on to after they were freed.
+ */
+size_t heap_free_bytes(void) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  return mallinfo2().fordblks;
+#else
+  return 0;
+#endif
+}
+
+int tree_memory_stats(Tree *tree, const char *path,
+                      struct TreeMemoryStats *stats) {
+  struct TraceOp trace;
+  trace_op_start(&trace, "memory_stats", tree, path);
+  if (!is_path_valid(path)) {
+    return trace_op_done(&trace, EINVAL);
+  }
+
+  Tree *folder = tree;
+  if (synchro_visit_path(&folder, path, NULL, NULL) == ENOENT) {
+    return trace_op_done(&trace, ENOENT);
+  }
+  memset(stats, 0, sizeof(struct TreeMemoryStats));
+  memory_stats_of(folder, tree->global->payload_size, stats);
+  stats->names = name_memory();
+  stats->free_slack = heap_free_bytes();
+  return trace_op_done(&trace, 0);
+}
+
+/**
+ * Compacts the maps of a folder and of its subtree (see tree_compact), the
+ * maps of each folder under writing rights to all of it. The caller has
+ * reading rights to the whole parent of the folder, so it stays in place,
+ * unless it's the root.
+ */
+void compact_subtree(Tree *folder) {
+  int stripes_count = stripes_of(folder);
+  synchro_modify_whole_until(folder, NULL);
+  int err;
+  for (int i = 0; i < stripes_count; i++) {
+    if ((err = pthread_mutex_lock(stripe_children_lock(folder, i))) != 0) {
+      syserr(err, "mutex_lock failed");
+    }
+    hmap_compact(stripe_children(folder, i));
+    if ((err = pthread_mutex_unlock(stripe_children_lock(folder, i))) != 0) {
+      syserr(err, "mutex_unlock failed");
+    }
+  }
+  synchro_leave_whole_after_modifying(folder);
+
+  synchro_visit_covering(folder, NULL, NULL);
+  for (int i = 0; i < stripes_count; i++) {
+    HashMap *children = stripe_children(folder, i);
+    HashMapIterator it = hmap_iterator(children);
+    const char *name;
+    Tree *child;
+    while (hmap_next(children, &it, &name, (void **)&child)) {
+      compact_subtree(child);
+    }
+  }
+  synchro_leave_covering_after_visiting(folder, NULL);
+}
+
+int tree_compact(Tree *tree, const char *path) {
+  struct TraceOp trace;
+  trace_op_start(&trace, "compact", tree, path);
+  if (!is_path_valid(path)) {
+    return trace_op_done(&trace, EINVAL);
+  }
+
+  char folder_name[MAX_FOLDER_NAME_LENGTH + 1];
+  char *parent_path = make_path_to_parent(path, folder_name);
+  if (parent_path == NULL) {
+    compact_subtree(tree);
+  } else {
+    Tree *parent = tree;
+    int err = synchro_visit_path(&parent, parent_path, NULL, NULL);
+    free(parent_path);
+    if (err == ENOENT) {
+      return trace_op_done(&trace, ENOENT);
+    }
+    Tree *folder = hmap_get(children_of(parent, folder_name), folder_name);
+    if (folder != NULL) {
+      compact_subtree(folder);
+    }
+    synchro_leave_covering_after_visiting(parent, NULL);
+    if (folder == NULL) {
+      return trace_op_done(&trace, ENOENT);
+    }
+  }
+
+#ifdef __GLIBC__
+  malloc_trim(0);
+#endif
+  return trace_op_done(&trace, 0);
+}
+
+enum TransactionOpType {
+  TRANSACTION_CREATE,
+  TRANSACTION_REMOVE,
+  TRANSACTION_MOVE,
+};
+
+struct TransactionOp {
+  enum TransactionOpType type;
+  char *path;
+  char *target; // only for moves
+};
+
+struct TreeTransaction {
+  struct TransactionOp *ops;
+  size_t count;
+  size_t capacity;
+};
+
+/**
+ * Rights a transaction needs: to the part of a folder covering a name, or to
+ * the whole folder (every stripe of a hot one) if name is NULL. Folders are
+ * given by their paths in the tree from before the transaction.
+ */
+struct TransactionLock {
+  char *path;
+  char *name;
+  bool modify;
+};
+
+/**
+ * Rights taken by a transaction. Several locks may map to one synchronizer.
+ */
+struct TransactionHeld {
+  Tree *folder;
+  struct Synchro *synchronizer;
+  bool modify;
+  bool is_held; // false after being given up to remove the folder
+};
+
+/**
+ * An operation applied by a transaction, to be undone if a later one fails.
+ */
+struct TransactionUndo {
+  enum TransactionOpType type;
+  Tree *child;
+  Tree *from;     // folder it was taken out of, NULL for creates
+  Tree *to;       // folder it was put into, NULL for removes
+  char *old_name; // only for moves
+};
+
+struct TransactionCommit {
+  Tree *tree;
+  TreeTransaction *transaction;
+  struct TransactionLock *locks;
+  size_t locks_count;
+  size_t locks_capacity;
+  struct TransactionHeld *held;
+  size_t held_count;
+  size_t held_capacity;
+  struct TransactionUndo *undo;
+  size_t undo_count;
+};
+
+TreeTransaction *tree_transaction_new(void) {
+  TreeTransaction *transaction = malloc(sizeof(TreeTransaction));
+  CHECK_PTR(transaction);
+  transaction->ops = NULL;
+  transaction->count = 0;
+  transaction->capacity = 0;
+  return transaction;
+}
+
+void tree_transaction_free(TreeTransaction *transaction) {
+  for (size_t i = 0; i < transaction->count; i++) {
+    free(transaction->ops[i].path);
+    free(transaction->ops[i].target);
+  }
+  free(transaction->ops);
+  free(transaction);
+}
+
+char *copy_string(const char *string) {
+  char *result = malloc(strlen(string) + 1);
+  CHECK_PTR(result);
+  strcpy(result, string);
+  return result;
+}
+
+void transaction_add(TreeTransaction *transaction, enum TransactionOpType type,
+                     const char *path, const char *target) {
+  if (transaction->count == transaction->capacity) {
+    transaction->capacity =
+        transaction->capacity == 0 ? 4 : 2 * transaction->capacity;
+    transaction->ops = realloc(
+        transaction->ops, transaction->capacity * sizeof(struct TransactionOp));
+    CHECK_PTR(transaction->ops);
+  }
+  struct TransactionOp *op = &(transaction->ops[transaction->count++]);
+  op->type = type;
+  op->path = copy_string(path);
+  op->target = target == NULL ? NULL : copy_string(target);
+}
+
+void tree_transaction_create(TreeTransaction *transaction, const char *path) {
+  transaction_add(transaction, TRANSACTION_CREATE, path, NULL);
+}
+
+void tree_transaction_remove(TreeTransaction *transaction, const char *path) {
+  transaction_add(transaction, TRANSACTION_REMOVE, path, NULL);
+}
+
+void tree_transaction_move(TreeTransaction *transaction, const char *source,
+                           const char *target) {
+  transaction_add(transaction, TRANSACTION_MOVE, source, target);
+}
+
+/**
+ * Checks the paths of an operation of a transaction, before looking at the
+ * tree, like the matching tree operation does.
+ * @return 0 if the operation may succeed, its error otherwise
+ */
+int check_transaction_op(struct TransactionOp *op) {
+  switch (op->type) {
+  case TRANSACTION_CREATE:
+    if (!is_path_valid(op->path)) {
+      return EINVAL;
+    }
+    return strcmp(op->path, "/") == 0 ? EEXIST : 0;
+  case TRANSACTION_REMOVE:
+    if (!is_path_valid(op->path)) {
+      return EINVAL;
+    }
+    return strcmp(op->path, "/") == 0 ? EBUSY : 0;
+  case TRANSACTION_MOVE:
+    return check_move(op->path, op->target);
+  }
+  return EINVAL;
+}
+
+/**
+ * Translates a path, as seen by the operation of a transaction with a given
+ * index, to the tree from before the transaction, undoing the moves before
+ * the operation.
+ * @return the translated path, to be freed by the caller, or NULL if it's
+ * inside a folder created by the transaction (which no other thread can get
+ * into, as getting there needs rights the transaction holds)
+ */
+char *original_path(TreeTransaction *transaction, size_t index,
+                    const char *path) {
+  char *result = copy_string(path);
+  for (size_t i = index; i > 0; i--) {
+    struct TransactionOp *op = &(transaction->ops[i - 1]);
+    const char *created = op->type == TRANSACTION_MOVE ? op->target : op->path;
+    size_t created_length = strlen(created);
+    if (op->type == TRANSACTION_REMOVE ||
+        strncmp(result, created, created_length) != 0) {
+      continue;
+    }
+    if (op->type == TRANSACTION_CREATE) {
+      free(result);
+      return NULL;
+    }
+
+    // the path may get longer than MAX_PATH_LENGTH here, which is fine
+    size_t source_length = strlen(op->path);
+    size_t rest_length = strlen(result) - created_length;
+    char *moved = malloc(source_length + rest_length + 1);
+    CHECK_PTR(moved);
+    memcpy(moved, op->path, source_length);
+    memcpy(moved + source_length, result + created_length, rest_length + 1);
+    free(result);
+    result = moved;
+  }
+  return result;
+}
+
+void transaction_add_lock(struct TransactionCommit *commit, char *path,
+                          const char *name, bool modify) {
+  if (commit->locks_count == commit->locks_capacity) {
+    commit->locks_capacity =
+        commit->locks_capacity == 0 ? 16 : 2 * commit->locks_capacity;
+    commit->locks =
+        realloc(commit->locks,
+                commit->locks_capacity * sizeof(struct TransactionLock));
+    CHECK_PTR(commit->locks);
+  }
+  struct TransactionLock *lock = &(commit->locks[commit->locks_count++]);
+  lock->path = path;
+  lock->name = name == NULL ? NULL : copy_string(name);
+  lock->modify = modify;
+}
+
+/**
+ * Adds the rights to a folder (see TransactionLock) to the ones a transaction
+ * needs, with reading rights to the parts of its ancestors on the way to it.
+ * Takes over path, which may be NULL (see original_path), then nothing is
+ * needed.
+ */
+void transaction_lock_path(struct TransactionCommit *commit, char *path,
+                           const char *name, bool modify) {
+  if (path == NULL) {
+    return;
+  }
+
+  char component[MAX_FOLDER_NAME_LENGTH + 1];
+  const char *subpath = path;
+  const char *next_subpath;
+  while ((next_subpath = split_path(subpath, component)) != NULL) {
+    size_t length = subpath - path + 1;
+    char *ancestor = malloc(length + 1);
+    CHECK_PTR(ancestor);
+    memcpy(ancestor, path, length);
+    ancestor[length] = '\0';
+    transaction_add_lock(commit, ancestor, component, false);
+    subpath = next_subpath;
+  }
+  transaction_add_lock(commit, path, name, modify);
+}
+
+int compare_transaction_locks(const void *first, const void *second) {
+  // '/' comes before the letters, so this is the order of a pre-order walk
+  return strcmp(((const struct TransactionLock *)first)->path,
+                ((const struct TransactionLock *)second)->path);
+}
+
+/**
+ * Computes the rights a transaction needs, sorted by folder in the order of
+ * a pre-order walk of the tree.
+ */
+void transaction_collect_locks(struct TransactionCommit *commit) {
+  TreeTransaction *transaction = commit->transaction;
+  char name[MAX_FOLDER_NAME_LENGTH + 1];
+  for (size_t i = 0; i < transaction->count; i++) {
+    struct TransactionOp *op = &(transaction->ops[i]);
+    // the transaction never gets past an operation failing here
+    if (check_transaction_op(op) != 0) {
+      break;
+    }
+
+    char *parent = make_path_to_parent(op->path, name);
+    transaction_lock_path(commit, original_path(transaction, i, parent), name,
+                          true);
+    free(parent);
+    if (op->type == TRANSACTION_MOVE) {
+      parent = make_path_to_parent(op->target, name);
+      transaction_lock_path(commit, original_path(transaction, i, parent),
+                            name, true);
+      free(parent);
+      // like move_child, waits for the ones inside the moved folder
+      transaction_lock_path(commit, original_path(transaction, i, op->path),
+                            NULL, true);
+    }
+  }
+
+  if (commit->locks_count > 0) {
+    qsort(commit->locks, commit->locks_count, sizeof(struct TransactionLock),
+          compare_transaction_locks);
+  }
+}
+
+/**
+ * Finds the folder of a path without taking any rights, so the caller must
+ * hold the ones covering the way to it.
+ * @return the folder, or NULL if there's none
+ */
+Tree *find_folder(Tree *tree, const char *path) {
+  char component[MAX_FOLDER_NAME_LENGTH + 1];
+  const char *subpath = path;
+  while (tree != NULL && (subpath = split_path(subpath, component)) != NULL) {
+    tree = hmap_get(children_of(tree, component), component);
+  }
+  return tree;
+}
+
+int compare_transaction_held(const void *first, const void *second) {
+  const struct Synchro *first_synchro =
+      ((const struct TransactionHeld *)first)->synchronizer;
+  const struct Synchro *second_synchro =
+      ((const struct TransactionHeld *)second)->synchronizer;
+  return (first_synchro > second_synchro) - (first_synchro < second_synchro);
+}
+
+/**
+ * Takes the rights of a held entry. Reading rights keep out the threads
+ * creating and removing children (see synchro_scan_until), so the folders
+ * found below stay there, and the ones that don't exist aren't created.
+ */
+int transaction_take(struct TransactionHeld *held,
+                     const struct timespec *deadline) {
+  if (held->modify) {
+    return synchro_modify_until(held->synchronizer, deadline);
+  }
+  return synchro_scan_until(held->synchronizer, deadline);
+}
+
+void transaction_leave(struct TransactionHeld *held) {
+  if (held->modify) {
+    synchro_leave_after_modifying(held->synchronizer);
+  } else {
+    synchro_leave_after_scanning(held->synchronizer);
+  }
+  held->is_held = false;
+}
+
+/**
+ * Adds a synchronizer of a folder to the ones a transaction holds, unless
+ * it's among them since first already (several locks may map to it).
+ */
+void transaction_hold(struct TransactionCommit *commit, size_t first,
+                      Tree *folder, struct Synchro *synchronizer,
+                      bool modify) {
+  size_t k = first;
+  while (k < commit->held_count &&
+         commit->held[k].synchronizer != synchronizer) {
+    k++;
+  }
+  if (k == commit->held_count) {
+    if (commit->held_count == commit->held_capacity) {
+      commit->held_capacity *= 2;
+      commit->held =
+          realloc(commit->held,
+                  commit->held_capacity * sizeof(struct TransactionHeld));
+      CHECK_PTR(commit->held);
+    }
+    commit->held[k].folder = folder;
+    commit->held[k].synchronizer = synchronizer;
+    commit->held[k].modify = false;
+    commit->held[k].is_held = false;
+    commit->held_count++;
   }
-
-  return 0;
+  commit->held[k].modify = commit->held[k].modify || modify;
 }
 
-int tree_destroy(Tree *tree) {
-  free(tree->name);
-  free(tree->children);
-  synchro_destroy(&(tree->synchronizer));
-  free(tree);
+/**
+ * Takes the rights a transaction needs, folder after folder in the order of
+ * a pre-order walk, and the synchronizers of a folder in the order they're
+ * laid out in (see synchro_take_pair). Every other operation takes rights
+ * from the root down, and moves (which don't) are kept out by the rename
+ * lock, so no thread can hold rights the transaction waits for while waiting
+ * for the ones it holds. Folders that don't exist are skipped, they can't be
+ * created while the rights to their parents are held.
+ * @return 0 on success, ETIMEDOUT or EWOULDBLOCK if the deadline has passed,
+ * the rights taken so far are held then
+ */
+int transaction_take_locks(struct TransactionCommit *commit,
+                           const struct timespec *deadline) {
+  struct TransactionLock *locks = commit->locks;
+  size_t i = 0;
+  while (i < commit->locks_count) {
+    size_t end = i;
+    while (end < commit->locks_count &&
+           strcmp(locks[end].path, locks[i].path) == 0) {
+      end++;
+    }
+
+    Tree *folder = find_folder(commit->tree, locks[i].path);
+    if (folder != NULL) {
+      size_t first = commit->held_count;
+      for (size_t j = i; j < end; j++) {
+        if (locks[j].name != NULL) {
+          transaction_hold(commit, first, folder,
+                           synchro_of(folder, locks[j].name), locks[j].modify);
+          continue;
+        }
+        for (int s = 0; s < stripes_of(folder); s++) {
+          transaction_hold(commit, first, folder, stripe_synchro(folder, s),
+                           locks[j].modify);
+        }
+      }
+      qsort(commit->held + first, commit->held_count - first,
+            sizeof(struct TransactionHeld), compare_transaction_held);
+
+      for (size_t k = first; k < commit->held_count; k++) {
+        struct TransactionHeld *held = &(commit->held[k]);
+        int err = transaction_take(held, deadline);
+        if (err != 0) {
+          return err;
+        }
+        held->is_held = true;
+      }
+    }
+    i = end;
+  }
   return 0;
 }
 
-Tree *tree_new() {
-  Tree *result = malloc(sizeof(Tree));
-  CHECK_PTR(result);
+/**
+ * Takes child out of from (if not NULL) and puts it into to (if not NULL)
+ * under name, keeping the aggregates. The caller must hold the rights to
+ * modify both.
+ */
+void relink_child(Tree *tree, Tree *child, Tree *from, Tree *to,
+                  const char *name) {
+  if (from != NULL) {
+    children_remove(from, child);
+  }
+  if (to != NULL && strcmp(child->name, name) != 0) {
+    tree_node_rename(child, name);
+  }
+  if (from != NULL && to != NULL) {
+    atomic_fetch_add(&(child->moves), 1);
+  }
 
-  result->name = NULL;
-  result->children = hmap_new();
-  synchro_init(&(result->synchronizer));
+  if (!tree->global->aggregates) {
+    if (to != NULL) {
+      child->parent = to;
+      children_insert(to, child);
+    }
+    return;
+  }
 
-  return result;
+  // like in move_child, the ancestors of a moved folder can't change while
+  // the aggregates of its ancestors are updated
+  struct BRLock *aggregates_lock = &(tree->global->aggregates_lock);
+  bool is_move = from != NULL && to != NULL;
+  int shard = 0;
+  if (is_move) {
+    brlock_write_lock(aggregates_lock);
+  } else {
+    shard = brlock_read_lock(aggregates_lock);
+  }
+  long count = descendants_of(child) + 1;
+  int height = atomic_load(&(child->height));
+  if (from != NULL) {
+    aggregates_subtract(from, count, height);
+  }
+  if (to != NULL) {
+    child->parent = to;
+    children_insert(to, child);
+    aggregates_add(to, count, height);
+    if (atomic_load(&(child->height_dirty))) {
+      mark_heights_dirty(to, height);
+    }
+  }
+  if (is_move) {
+    brlock_write_unlock(aggregates_lock);
+  } else {
+    brlock_read_unlock(aggregates_lock, shard);
+  }
 }
 
-void tree_free(Tree *tree) {
-  Tree *value;
-  const char *key;
-  HashMapIterator it = hmap_iterator(tree->children);
-  while (hmap_next(tree->children, &it, &key, (void **)&value)) {
-    tree_free(value);
+/**
+ * Takes back the rights a transaction gave up to remove a folder.
+ * Nothing waits for them, as getting into the folder needs the rights to
+ * its parent, which the transaction holds.
+ */
+void transaction_retake(struct TransactionCommit *commit, Tree *folder) {
+  for (size_t k = 0; k < commit->held_count; k++) {
+    struct TransactionHeld *held = &(commit->held[k]);
+    if (held->folder == folder && !held->is_held) {
+      transaction_take(held, NULL);
+      held->is_held = true;
+    }
   }
-
-  free(tree->name);
-  hmap_free(tree->children);
-  synchro_destroy(&(tree->synchronizer));
-  free(tree);
 }
 
-char *tree_list(Tree *tree, const char *path) {
-  if (!is_path_valid(path)) {
-    return NULL;
+/**
+ * Waits until no writer other than the transaction is in a folder it removes
+ * and checks that it's empty, like tree_remove does. The transaction gives up
+ * its own rights to the folder for that.
+ * Parts of the folder the transaction holds are checked first: anything the
+ * transaction holds below the folder is in one of them, and it can't wait
+ * for the threads waiting for that to leave the folder.
+ * @return 0 on success, ENOTEMPTY, ETIMEDOUT or EWOULDBLOCK otherwise, the
+ * rights to the folder are held again then
+ */
+int transaction_prepare_removal(struct TransactionCommit *commit,
+                                Tree *folder,
+                                const struct timespec *deadline) {
+  for (size_t k = 0; k < commit->held_count; k++) {
+    struct TransactionHeld *held = &(commit->held[k]);
+    if (held->folder != folder || !held->is_held) {
+      continue;
+    }
+    for (int i = 0; i < stripes_of(folder); i++) {
+      if (stripe_synchro(folder, i) == held->synchronizer &&
+          hmap_size(stripe_children(folder, i)) != 0) {
+        return ENOTEMPTY;
+      }
+    }
   }
 
-  // claiming root
-  synchro_visit(&(tree->synchronizer));
-  Tree *cur_folder = tree;
+  for (size_t k = commit->held_count; k > 0; k--) {
+    struct TransactionHeld *held = &(commit->held[k - 1]);
+    if (held->folder == folder && held->is_held) {
+      transaction_leave(held);
+    }
+  }
 
-  // getting to destination
-  if (synchro_get_to_path(&cur_folder, path) == ENOENT) {
-    synchro_leave_after_visiting(&(cur_folder->synchronizer));
-    return NULL;
+  int err = 0;
+  int prepared = 0;
+  while (prepared < stripes_of(folder)) {
+    err = synchro_prepare_for_being_removed_until(
+        stripe_synchro(folder, prepared), deadline);
+    if (err != 0) {
+      break;
+    }
+    prepared++;
+  }
+  if (err == 0 && !is_folder_empty(folder)) {
+    err = ENOTEMPTY;
   }
 
-  char *result = make_map_contents_string(cur_folder->children);
-  synchro_leave_after_visiting(&(cur_folder->synchronizer));
-  return result;
+  if (err != 0) {
+    for (int i = 0; i < prepared; i++) {
+      synchro_leave_after_bad_remove(stripe_synchro(folder, i));
+    }
+    transaction_retake(commit, folder);
+  }
+  return err;
 }
 
-int tree_create(Tree *tree, const char *path) {
-  if (!is_path_valid(path)) {
-    return EINVAL;
+/**
+ * Applies the operation of a transaction with a given index. The rights to
+ * everything it touches are held.
+ * @return 0 on success, the error of the operation otherwise (it has no
+ * effect then)
+ */
+int transaction_apply(struct TransactionCommit *commit, size_t index,
+                      const struct timespec *deadline) {
+  struct TransactionOp *op = &(commit->transaction->ops[index]);
+  int err = check_transaction_op(op);
+  if (err != 0) {
+    return err;
   }
 
-  char folder_name[MAX_FOLDER_NAME_LENGTH + 1];
+  char name[MAX_FOLDER_NAME_LENGTH + 1];
+  char *parent_path = make_path_to_parent(op->path, name);
+  Tree *parent = find_folder(commit->tree, parent_path);
+  free(parent_path);
+  Tree *child =
+      parent == NULL ? NULL : hmap_get(children_of(parent, name), name);
 
-  // getting the name of the folder to make
-  const char *subpath = make_path_to_parent(path, folder_name);
-  if (subpath == NULL) { // if wants to create "/"
-    return EEXIST;
+  struct TransactionUndo *undo = &(commit->undo[commit->undo_count]);
+  undo->type = op->type;
+  undo->old_name = NULL;
+  switch (op->type) {
+  case TRANSACTION_CREATE:
+    if (parent == NULL) {
+      return ENOENT;
+    }
+    if (child != NULL) {
+      return EEXIST;
+    }
+    child = tree_node_new(name, 0, commit->tree->global->policy,
+                          commit->tree->global->payload_size);
+    relink_child(commit->tree, child, NULL, parent, name);
+    undo->from = NULL;
+    undo->to = parent;
+    break;
+  case TRANSACTION_REMOVE:
+    if (child == NULL) {
+      return ENOENT;
+    }
+    if ((err = transaction_prepare_removal(commit, child, deadline)) != 0) {
+      return err;
+    }
+    relink_child(commit->tree, child, parent, NULL, NULL);
+    undo->from = parent;
+    undo->to = NULL;
+    break;
+  case TRANSACTION_MOVE: {
+    char new_name[MAX_FOLDER_NAME_LENGTH + 1];
+    char *target_parent_path = make_path_to_parent(op->target, new_name);
+    Tree *target_parent = find_folder(commit->tree, target_parent_path);
+    free(target_parent_path);
+    if (child == NULL || target_parent == NULL) {
+      return ENOENT;
+    }
+    if (hmap_get(children_of(target_parent, new_name), new_name) != NULL) {
+      return EEXIST;
+    }
+    undo->old_name = copy_string(name);
+    relink_child(commit->tree, child, parent, target_parent, new_name);
+    undo->from = parent;
+    undo->to = target_parent;
+    break;
   }
-  const char *to_free = subpath; // cause make_path_to_parent copies
+  }
+  undo->child = child;
+  commit->undo_count++;
+  return 0;
+}
 
-  // claiming root
-  synchro_visit(&(tree->synchronizer));
-  Tree *cur_folder = tree;
+/**
+ * Undoes the operations a transaction applied, the last one first.
+ */
+void transaction_undo(struct TransactionCommit *commit) {
+  while (commit->undo_count > 0) {
+    struct TransactionUndo *undo = &(commit->undo[--commit->undo_count]);
+    Tree *child = undo->child;
+    switch (undo->type) {
+    case TRANSACTION_CREATE:
+      // no one else could get into it
+      relink_child(commit->tree, child, undo->to, NULL, NULL);
+      tree_destroy(child);
+      break;
+    case TRANSACTION_REMOVE:
+      relink_child(commit->tree, child, NULL, undo->from, child->name);
+      for (int i = 0; i < stripes_of(child); i++) {
+        synchro_leave_after_bad_remove(stripe_synchro(child, i));
+      }
+      transaction_retake(commit, child);
+      break;
+    case TRANSACTION_MOVE:
+      relink_child(commit->tree, child, undo->to, undo->from, undo->old_name);
+      free(undo->old_name);
+      break;
+    }
+  }
+}
 
-  // getting to the needed place in the folder tree
-  if (synchro_get_to_path(&cur_folder, subpath) == ENOENT) {
-    synchro_leave_after_visiting(&(cur_folder->synchronizer));
-    free((void *)to_free);
-    return ENOENT;
+/**
+ * Drops the undo log of a transaction that succeeded, burying the folders
+ * it removed like tree_remove does.
+ */
+void transaction_finish(struct TransactionCommit *commit) {
+  for (size_t u = 0; u < commit->undo_count; u++) {
+    struct TransactionUndo *undo = &(commit->undo[u]);
+    if (undo->type != TRANSACTION_REMOVE) {
+      continue;
+    }
+    tree_node_bury(undo->child);
   }
-  free((void *)to_free);
+  for (size_t u = 0; u < commit->undo_count; u++) {
+    free(commit->undo[u].old_name);
+  }
+}
 
-  synchro_change_from_visiting_to_mod(&(cur_folder->synchronizer));
+/**
+ * tree_transaction_commit giving up at a deadline (see synchro_visit_until).
+ */
+int tree_transaction_commit_until(Tree *tree, TreeTransaction *transaction,
+                                  const struct timespec *deadline,
+                                  size_t *failed) {
+  struct TraceOp trace;
+  trace_op_start(&trace, "commit", tree, NULL);
+  struct TransactionCommit commit;
+  commit.tree = tree;
+  commit.transaction = transaction;
+  commit.locks = NULL;
+  commit.locks_count = 0;
+  commit.locks_capacity = 0;
+  transaction_collect_locks(&commit);
+  commit.held_capacity = commit.locks_count + 1;
+  commit.held =
+      malloc(commit.held_capacity * sizeof(struct TransactionHeld));
+  CHECK_PTR(commit.held);
+  commit.held_count = 0;
+  commit.undo = malloc((transaction->count + 1) *
+                       sizeof(struct TransactionUndo));
+  CHECK_PTR(commit.undo);
+  commit.undo_count = 0;
 
-  // if the folder already exists
-  if (hmap_get(cur_folder->children, folder_name) != NULL) {
-    synchro_leave_after_modifying(&(cur_folder->synchronizer));
-    return EEXIST;
-  }
+  size_t failed_op = transaction->count;
+  int result = rename_lock_until(tree, deadline);
+  if (result == 0) {
+    result = transaction_take_locks(&commit, deadline);
+    for (size_t i = 0; result == 0 && i < transaction->count; i++) {
+      if ((result = transaction_apply(&commit, i, deadline)) != 0) {
+        failed_op = i;
+      }
+    }
 
-  // getting ready to modify
-  Tree *new_folder = tree_new();
-  new_folder->name = malloc(strlen(folder_name) + 1);
-  CHECK_PTR(new_folder->name);
+    if (result != 0) {
+      transaction_undo(&commit);
+    } else {
+      transaction_finish(&commit);
+    }
+    for (size_t k = commit.held_count; k > 0; k--) {
+      if (commit.held[k - 1].is_held) {
+        transaction_leave(&(commit.held[k - 1]));
+      }
+    }
 
-  strcpy(new_folder->name, folder_name);
+    int err;
+    if ((err = pthread_mutex_unlock(&(tree->global->rename_lock))) != 0) {
+      syserr(err, "mutex_unlock failed");
+    }
+  }
 
-  hmap_insert(cur_folder->children, folder_name, new_folder);
+  if (result == 0) {
+    for (size_t i = 0; i < transaction->count; i++) {
+      struct TransactionOp *op = &(transaction->ops[i]);
+      enum TreeEventType type = op->type == TRANSACTION_CREATE
+                                    ? TREE_EVENT_CREATE
+                                    : op->type == TRANSACTION_REMOVE
+                                          ? TREE_EVENT_REMOVE
+                                          : TREE_EVENT_MOVE;
+      tree_watchers_publish(tree->global->watchers, type, op->path,
+                            op->target);
+    }
+  } else if (failed != NULL) {
+    *failed = failed_op;
+  }
 
-  synchro_leave_after_modifying(&(cur_folder->synchronizer));
+  for (size_t j = 0; j < commit.locks_count; j++) {
+    free(commit.locks[j].path);
+    free(commit.locks[j].name);
+  }
+  free(commit.locks);
+  free(commit.held);
+  free(commit.undo);
+  return trace_op_done(&trace, result);
+}
 
-  return 0;
+int tree_transaction_commit(Tree *tree, TreeTransaction *transaction,
+                            size_t *failed) {
+  return tree_transaction_commit_until(tree, transaction, NULL, failed);
 }
 
-int tree_remove(Tree *tree, const char *path) {
-  if (!is_path_valid(path)) {
-    return EINVAL;
-  }
+int tree_transaction_commit_timed(Tree *tree, TreeTransaction *transaction,
+                                  const struct timespec *deadline,
+                                  size_t *failed) {
+  return tree_transaction_commit_until(tree, transaction, deadline, failed);
+}
 
-  char folder_name[MAX_FOLDER_NAME_LENGTH + 1];
+int tree_transaction_commit_try(Tree *tree, TreeTransaction *transaction,
+                                size_t *failed) {
+  return tree_transaction_commit_until(tree, transaction, SYNCHRO_NO_WAIT,
+                                       failed);
+}
 
-  const char *subpath = make_path_to_parent(path, folder_name);
-  if (subpath == NULL) {
-    return EBUSY;
+/**
+ * Drops the references of the steps of a handle and frees them.
+ */
+void handle_steps_free(struct HandleStep *steps, int steps_count) {
+  for (int i = 0; i < steps_count; i++) {
+    tree_node_unref(steps[i].folder);
   }
-  const char *to_free = subpath;
+  free(steps);
+}
 
-  // claiming root
-  synchro_visit(&(tree->synchronizer));
-  Tree *cur_folder = tree;
-  Tree *folder_to_delete;
+/**
+ * Looks up a VALID path for a handle, noting the folders on the way below
+ * the root (see TreeHandle) and how many times each was moved so far. The
+ * number is read while the part of the parent holding the folder is
+ * visited, so a move after that is one made since.
+ * @return 0 on success, ENOENT if there's no such folder
+ */
+int handle_lookup(Tree *tree, const char *path, struct HandleStep **steps,
+                  int *steps_count) {
+  char buffer1[MAX_FOLDER_NAME_LENGTH + 1];
+  char buffer2[MAX_FOLDER_NAME_LENGTH + 1];
+  char *component = buffer1;
+  char *next_component = buffer2;
 
-  // getting to my destination
-  if (synchro_get_to_path(&cur_folder, subpath) == ENOENT) {
-    synchro_leave_after_visiting(&(cur_folder->synchronizer));
-    free((void *)to_free);
-    return ENOENT;
-  }
-  free((void *)to_free);
-  synchro_change_from_visiting_to_mod(&(cur_folder->synchronizer));
+  // a path has less than half as many components as chars
+  *steps = malloc((strlen(path) / 2 + 1) * sizeof(struct HandleStep));
+  CHECK_PTR(*steps);
+  *steps_count = 0;
 
-  // folder to delete doesn't exist
-  if ((folder_to_delete = hmap_get(cur_folder->children, folder_name)) ==
-      NULL) {
-    synchro_leave_after_modifying(&(cur_folder->synchronizer));
-    return ENOENT;
-  }
+  Tree *folder = tree;
+  const char *subpath = split_path(path, component);
+  int err = synchro_visit_covering(folder, subpath ? component : NULL, NULL);
+  while (err == 0 && subpath != NULL) {
+    Tree *child = child_acquire(folder, component);
+    if (child == NULL) {
+      synchro_leave_after_visiting(synchro_of(folder, component));
+      err = ENOENT;
+      break;
+    }
+    (*steps)[*steps_count].folder = child;
+    (*steps)[*steps_count].moves = atomic_load(&(child->moves));
+    (*steps_count)++;
 
-  synchro_prepare_for_being_removed(&(folder_to_delete->synchronizer));
+    const char *next_subpath = split_path(subpath, next_component);
+    err = synchro_visit_covering(child, next_subpath ? next_component : NULL,
+                                 NULL);
+    synchro_leave_after_visiting(synchro_of(folder, component));
+    folder = child;
 
-  if (hmap_size(folder_to_delete->children) == 0) {
-    hmap_remove(cur_folder->children, folder_name);
-    // without the next two lines helgrind shows errors but they're not
-    // necessary
-    synchro_modify(&(folder_to_delete->synchronizer));
-    synchro_leave_after_modifying(&(folder_to_delete->synchronizer));
-    tree_destroy(folder_to_delete);
-  } else {
-    synchro_leave_after_bad_remove(&(folder_to_delete->synchronizer));
-    synchro_leave_after_modifying(&(cur_folder->synchronizer));
-    return ENOTEMPTY;
+    char *tmp = component;
+    component = next_component;
+    next_component = tmp;
+    subpath = next_subpath;
   }
 
-  synchro_leave_after_modifying(&(cur_folder->synchronizer));
-
+  if (err != 0) {
+    handle_steps_free(*steps, *steps_count);
+    return err;
+  }
+  synchro_leave_covering_after_visiting(folder, NULL);
   return 0;
 }
 
-/**
- * Utility function that computes the number of nodes from root to lca
- * @param first first path
- * @param second second path
- * @return number of nodes (folders) from root to lca
- */
-int get_lca_path_length(const char *first, const char *second) {
-  char component1[MAX_FOLDER_NAME_LENGTH + 1];
-  char component2[MAX_FOLDER_NAME_LENGTH + 1];
-  const char *subpath1 = first;
-  const char *subpath2 = second;
+TreeHandle *tree_open(Tree *tree, const char *path) {
+  if (!is_path_valid(path)) {
+    errno = EINVAL;
+    return NULL;
+  }
 
-  int how_many_dirs_without_base = 0;
-  while ((subpath1 = split_path(subpath1, component1)) &&
-         ((subpath2 = split_path(subpath2, component2))) &&
-         strcmp(component1, component2) == 0) {
-    how_many_dirs_without_base++;
+  struct HandleStep *steps;
+  int steps_count;
+  int err = handle_lookup(tree, path, &steps, &steps_count);
+  if (err != 0) {
+    errno = err;
+    return NULL;
   }
+  Tree *folder = steps_count == 0 ? tree : steps[steps_count - 1].folder;
+  atomic_fetch_add(&(folder->references), 1);
 
-  return how_many_dirs_without_base;
+  TreeHandle *handle = malloc(sizeof(TreeHandle));
+  CHECK_PTR(handle);
+  handle->tree = tree;
+  handle->folder = folder;
+  handle->path = copy_string(path);
+  if ((err = pthread_rwlock_init(&(handle->steps_lock), NULL)) != 0) {
+    syserr(err, "rwlock_init failed");
+  }
+  handle->steps = steps;
+  handle->steps_count = steps_count;
+  return handle;
 }
 
-int tree_move(Tree *tree, const char *source, const char *target) { // TODO
-  if (!is_path_valid(source) || !is_path_valid(target)) {
-    return EINVAL;
+void tree_close(TreeHandle *handle) {
+  int err;
+  if ((err = pthread_rwlock_destroy(&(handle->steps_lock))) != 0) {
+    syserr(err, "rwlock_destroy failed");
   }
-  if (strcmp(source, "/") == 0) {
-    return EBUSY;
+  handle_steps_free(handle->steps, handle->steps_count);
+  tree_node_unref(handle->folder);
+  free(handle->path);
+  free(handle);
+}
+
+/**
+ * Looks the path of a handle up again, after an operation on it found that
+ * a folder on the way was moved.
+ * @return 0 if the path still leads to the folder of the handle (the
+ * operation can be retried then), ESTALE otherwise
+ */
+int handle_refresh(TreeHandle *handle) {
+  struct HandleStep *steps;
+  int steps_count;
+  if (handle_lookup(handle->tree, handle->path, &steps, &steps_count) != 0) {
+    return ESTALE;
   }
-  if (strcmp(target, "/") == 0) {
-    return EEXIST;
+  Tree *folder =
+      steps_count == 0 ? handle->tree : steps[steps_count - 1].folder;
+  if (folder != handle->folder) {
+    handle_steps_free(steps, steps_count);
+    return ESTALE;
   }
-  if (strncmp(source, target, strlen(source)) == 0) {
-    return EILLEGALMOVE;
+
+  int err;
+  if ((err = pthread_rwlock_wrlock(&(handle->steps_lock))) != 0) {
+    syserr(err, "rwlock_wrlock failed");
   }
+  struct HandleStep *old_steps = handle->steps;
+  int old_steps_count = handle->steps_count;
+  handle->steps = steps;
+  handle->steps_count = steps_count;
+  if ((err = pthread_rwlock_unlock(&(handle->steps_lock))) != 0) {
+    syserr(err, "rwlock_unlock failed");
+  }
+  handle_steps_free(old_steps, old_steps_count);
+  return 0;
+}
 
-  bool is_father_dest_the_lca = false;
-  bool is_father_source_the_lca = false;
+/**
+ * Whether an operation on a handle that failed with err is to be retried:
+ * once it found the handle stale, if its path still leads to the folder.
+ * The path is looked up at most HANDLE_MAX_REFRESHES times, so moves made
+ * all the time can't keep the operation from returning.
+ */
+bool handle_should_retry(TreeHandle *handle, int err, int *refreshes) {
+  return err == ESTALE && (*refreshes)++ < HANDLE_MAX_REFRESHES &&
+         handle_refresh(handle) == 0;
+}
 
-  char component[MAX_FOLDER_NAME_LENGTH + 1];
-  const char *subpath;
-  char new_name[MAX_FOLDER_NAME_LENGTH + 1];
-  char to_move[MAX_FOLDER_NAME_LENGTH + 1];
-  Tree *cur_folder = tree;
-  Tree *lca = tree;
-  Tree *dest_folder = tree;
-  Tree *prev_folder = NULL;
-  const char *to_free1, *to_free2;
+/**
+ * Returns the error of an operation on an open folder, or ESTALE if it
+ * didn't find what it looked for because the folder was removed.
+ */
+int handle_result(TreeHandle *handle, int err) {
+  if (err == ENOENT && synchro_is_dead(stripe_synchro(handle->folder, 0))) {
+    return ESTALE;
+  }
+  return err;
+}
 
-  // getting to lca
-  synchro_visit(&(tree->synchronizer));
-  // for sure can't be null since they can't be "/"
-  target = make_path_to_parent(target, new_name);
-  source = make_path_to_parent(source, to_move);
-  subpath = split_path(source, component);
-  to_free1 = source;
-  to_free2 = target;
-  int lca_path = get_lca_path_length(source, target);
+int tree_create_at(TreeHandle *dir, const char *path) {
+  int refreshes = 0;
+  int err;
+  do {
+    err = handle_result(dir, tree_create_striped(dir->tree, dir, path, 0,
+                                                 dir->tree->global->policy,
+                                                 NULL));
+  } while (handle_should_retry(dir, err, &refreshes));
+  return err;
+}
 
-  // setting cur folder as their lca
-  // source and target with path to lca cut from beginning
-  while (subpath && lca_path > 0) {
-    lca_path--;
-    prev_folder = lca;
-    lca = hmap_get(prev_folder->children, component);
-    // if any of the parents don't exist
-    if (lca == NULL) {
-      synchro_leave_after_visiting(&(prev_folder->synchronizer));
-      free((void *)to_free1);
-      free((void *)to_free2);
-      return ENOENT;
+char *tree_list_at(TreeHandle *dir, const char *path) {
+  int refreshes = 0;
+  char *result;
+  while ((result = tree_list_until(dir->tree, dir, path, NULL)) == NULL) {
+    int err = handle_result(dir, errno);
+    if (!handle_should_retry(dir, err, &refreshes)) {
+      errno = err;
+      break;
     }
-    synchro_visit(&(lca->synchronizer));
-    synchro_leave_after_visiting(&(prev_folder->synchronizer));
-    source = split_path(source, component);
-    target = split_path(target, component);
-    subpath = split_path(subpath, component);
   }
+  return result;
+}
 
-  // here lca is the lca, source and target are paths from lca
-  *component = '\0';
+int tree_remove_at(TreeHandle *dir, const char *path) {
+  int refreshes = 0;
+  int err;
+  do {
+    err = handle_result(dir, tree_remove_until(dir->tree, dir, path, NULL));
+  } while (handle_should_retry(dir, err, &refreshes));
+  return err;
+}
 
-  synchro_change_from_visiting_to_mod(&(lca->synchronizer));
+int tree_move_at(TreeHandle *dir, const char *source, const char *target) {
+  int refreshes = 0;
+  int err;
+  do {
+    err = handle_result(
+        dir, tree_move_until(dir->tree, dir, source, target, NULL));
+  } while (handle_should_retry(dir, err, &refreshes));
+  return err;
+}
 
-  dest_folder = lca;
+/**
+ * State of a tree_bulk_load shared by its threads.
+ */
+struct BulkLoad {
+  Tree *tree;
+  const char *const *paths;
+  size_t paths_count;
+  int workers_count;
+  int *owners; // the worker building each path, -1 for "/"
+  atomic_bool is_invalid;
+};
 
-  // here extracting the name of folder to "create"
-  subpath = split_path(target, component);
+struct BulkWorker {
+  struct BulkLoad *load;
+  int index;
+  HashMap *new_tops; // top-level folders it made, attached after the build
+  long added;        // folders it made below top-level folders that existed
+  int height;        // the most levels it made below such a folder
+  bool is_top_new;   // whether the top-level folder of last is in new_tops
+  const char *last;  // the path it built before
+  Tree **chain;      // the folders on the way to last, by depth
+};
 
-  if (subpath == NULL) {
-    is_father_dest_the_lca = true;
-  } else {
-    // if father of dest is  not the lca, then we go to father of dest
-    prev_folder = lca;
-    dest_folder = hmap_get(dest_folder->children, component);
-    if (dest_folder == NULL) {
-      synchro_leave_after_modifying(&(lca->synchronizer));
-      free((void *)to_free1);
-      free((void *)to_free2);
-      return ENOENT;
-    }
-    synchro_visit(&(dest_folder->synchronizer));
+/**
+ * Same as is_path_valid, but checks the characters in one pass without
+ * branches (which the compiler vectorizes) and finds separators with memchr.
+ */
+bool bulk_is_path_valid(const char *path) {
+  size_t length = strlen(path);
+  if (length == 0 || length > MAX_PATH_LENGTH || path[0] != '/' ||
+      path[length - 1] != '/') {
+    return false;
+  }
 
-    if (synchro_get_to_path(&dest_folder, subpath) == ENOENT) {
-      free((void *)to_free1);
-      free((void *)to_free2);
-      synchro_leave_after_modifying(&(lca->synchronizer));
-      synchro_leave_after_visiting(&(dest_folder->synchronizer));
-      return ENOENT;
-    }
-    // target exists and lca is not father of dest
+  unsigned char is_bad = 0;
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = path[i];
+    is_bad |= (unsigned char)(c - 'a') > 'z' - 'a' && c != '/';
+  }
+  if (is_bad) {
+    return false;
   }
 
-  // if target exists and lca is the father of dest
-  if (hmap_get(dest_folder->children, new_name) != NULL) {
-    synchro_leave_after_modifying(&(lca->synchronizer));
-    if (!is_father_dest_the_lca) {
-      synchro_leave_after_visiting(&(dest_folder->synchronizer));
+  const char *name_start = path + 1;
+  const char *end = path + length;
+  while (name_start < end) {
+    // there's always one, as the path ends with '/'
+    const char *name_end = memchr(name_start, '/', end - name_start);
+    if (name_end == name_start ||
+        name_end - name_start > MAX_FOLDER_NAME_LENGTH) {
+      return false;
     }
-    free((void *)to_free1);
-    free((void *)to_free2);
-    return EEXIST;
+    name_start = name_end + 1;
   }
+  return true;
+}
 
-  cur_folder = lca;
-  subpath = split_path(source, component);
-  if (subpath == NULL) {
-    is_father_source_the_lca = true;
-  } else {
-    cur_folder = hmap_get(cur_folder->children, component);
+/**
+ * Validates a worker's share of the paths and finds the worker building
+ * each of them, by the name of its top-level folder.
+ */
+void *bulk_validate(void *data) {
+  struct BulkWorker *worker = data;
+  struct BulkLoad *load = worker->load;
+  size_t begin = load->paths_count * worker->index / load->workers_count;
+  size_t end = load->paths_count * (worker->index + 1) / load->workers_count;
 
-    if (cur_folder == NULL) {
-      synchro_leave_after_modifying(&(lca->synchronizer));
-      if (!is_father_dest_the_lca) {
-        synchro_leave_after_visiting(&(dest_folder->synchronizer));
-      }
-      free((void *)to_free1);
-      free((void *)to_free2);
-      return ENOENT;
+  char component[MAX_FOLDER_NAME_LENGTH + 1];
+  for (size_t i = begin; i < end && !atomic_load(&(load->is_invalid)); i++) {
+    if (!bulk_is_path_valid(load->paths[i])) {
+      atomic_store(&(load->is_invalid), true);
+    } else if (split_path(load->paths[i], component) == NULL) {
+      load->owners[i] = -1;
+    } else {
+      load->owners[i] = hmap_hash(component) % load->workers_count;
     }
-    synchro_visit(&(cur_folder->synchronizer));
+  }
+  return NULL;
+}
 
-    if (synchro_get_to_path(&cur_folder, subpath) == ENOENT) {
-      synchro_leave_after_modifying(&(lca->synchronizer));
-      if (!is_father_dest_the_lca) {
-        synchro_leave_after_visiting(&(dest_folder->synchronizer));
+/**
+ * Makes the folders of a path that don't exist yet. Starts from the deepest
+ * folder it shares with the path built before, so that sorted paths are
+ * built without looking up their common ancestors again.
+ */
+void bulk_build_path(struct BulkWorker *worker, const char *path) {
+  Tree *tree = worker->load->tree;
+  int depth = 0;
+  const char *subpath = path;
+  if (worker->last != NULL) {
+    for (size_t i = 1; path[i] != '\0' && path[i] == worker->last[i]; i++) {
+      if (path[i] == '/') {
+        depth++;
+        subpath = path + i;
       }
-      synchro_leave_after_visiting(&(cur_folder->synchronizer));
-      free((void *)to_free1);
-      free((void *)to_free2);
-      return ENOENT;
     }
   }
 
-  // would have to be all are lca
-  if (cur_folder != dest_folder) {
-    if (!is_father_dest_the_lca) {
-      synchro_change_from_visiting_to_mod(&(dest_folder->synchronizer));
+  char component[MAX_FOLDER_NAME_LENGTH + 1];
+  while ((subpath = split_path(subpath, component)) != NULL) {
+    Tree *folder = worker->chain[depth];
+    Tree *child;
+    if (depth == 0) {
+      child = hmap_get(children_of(tree, component), component);
+      worker->is_top_new = child == NULL;
+      if (child == NULL) {
+        child = hmap_get(worker->new_tops, component);
+      }
+      if (child == NULL) {
+        // its aggregates are added to the root's when it's attached
+        child = tree_node_new(component, 0, tree->global->policy,
+                              tree->global->payload_size);
+        child->parent = tree;
+        hmap_insert(worker->new_tops, component, child);
+      }
+    } else {
+      HashMap *children = children_of(folder, component);
+      child = hmap_get(children, component);
+      if (child == NULL) {
+        child = tree_node_new(component, 0, tree->global->policy,
+                              tree->global->payload_size);
+        child->parent = folder;
+        children_insert(folder, child);
+        if (tree->global->aggregates) {
+          aggregates_add_below(folder, tree, 1, 0);
+          if (!worker->is_top_new) {
+            worker->added++;
+            if (depth > worker->height) {
+              worker->height = depth;
+            }
+          }
+        }
+      }
     }
-    if (!is_father_source_the_lca) {
-      synchro_change_from_visiting_to_mod(&(cur_folder->synchronizer));
+    depth++;
+    worker->chain[depth] = child;
+  }
+  worker->last = path;
+}
+
+/**
+ * Builds the paths owned by a worker. No other worker touches the subtrees
+ * of their top-level folders, so no locks are taken.
+ */
+void *bulk_build(void *data) {
+  struct BulkWorker *worker = data;
+  struct BulkLoad *load = worker->load;
+  worker->chain[0] = load->tree;
+  for (size_t i = 0; i < load->paths_count; i++) {
+    if (load->owners[i] == worker->index) {
+      bulk_build_path(worker, load->paths[i]);
     }
   }
+  return NULL;
+}
 
-  if (hmap_get(cur_folder->children, to_move) == NULL) {
-    synchro_leave_after_modifying(&(lca->synchronizer));
-    if (!is_father_dest_the_lca) {
-      synchro_leave_after_modifying(&(dest_folder->synchronizer));
+/**
+ * Runs a step of tree_bulk_load on all workers, the calling thread being the
+ * first one.
+ */
+void bulk_run(struct BulkWorker *workers, int workers_count,
+              void *(*step)(void *)) {
+  pthread_t *threads = malloc(workers_count * sizeof(pthread_t));
+  CHECK_PTR(threads);
+  int err;
+  for (int i = 1; i < workers_count; i++) {
+    if ((err = pthread_create(&threads[i], NULL, step, &workers[i])) != 0) {
+      syserr(err, "pthread_create failed");
     }
-    if (!is_father_source_the_lca) {
-      synchro_leave_after_modifying(&(cur_folder->synchronizer));
+  }
+  step(&workers[0]);
+  for (int i = 1; i < workers_count; i++) {
+    if ((err = pthread_join(threads[i], NULL)) != 0) {
+      syserr(err, "pthread_join failed");
     }
+  }
+  free(threads);
+}
 
-    free((void *)to_free1);
-    free((void *)to_free2);
-    return ENOENT;
+int tree_bulk_load(Tree *tree, const char *const *paths, size_t paths_count,
+                   int threads) {
+  struct TraceOp trace;
+  trace_op_start(&trace, "bulk_load", tree, NULL);
+  if (threads < 1) {
+    return trace_op_done(&trace, EINVAL);
   }
 
-  Tree *child = hmap_get(cur_folder->children, to_move);
-  hmap_remove(cur_folder->children, child->name);
-  synchro_modify(&(child->synchronizer));
-  strcpy(child->name, new_name);
-  hmap_insert(dest_folder->children, child->name, child);
-  synchro_leave_after_modifying(&(child->synchronizer));
-  synchro_leave_after_modifying(&(lca->synchronizer));
-  if (!is_father_dest_the_lca) {
-    synchro_leave_after_modifying(&(dest_folder->synchronizer));
+  struct BulkLoad load;
+  load.tree = tree;
+  load.paths = paths;
+  load.paths_count = paths_count;
+  load.workers_count = threads;
+  load.owners = malloc(paths_count * sizeof(int));
+  CHECK_PTR(load.owners);
+  atomic_init(&(load.is_invalid), false);
+
+  struct BulkWorker *workers = calloc(threads, sizeof(struct BulkWorker));
+  CHECK_PTR(workers);
+  for (int i = 0; i < threads; i++) {
+    workers[i].load = &load;
+    workers[i].index = i;
   }
-  if (!is_father_source_the_lca) {
-    synchro_leave_after_modifying(&(cur_folder->synchronizer));
+
+  bulk_run(workers, threads, bulk_validate);
+  if (atomic_load(&(load.is_invalid))) {
+    free(workers);
+    free(load.owners);
+    return trace_op_done(&trace, EINVAL);
   }
-  free((void *)to_free1);
-  free((void *)to_free2);
-  return 0;
+
+  for (int i = 0; i < threads; i++) {
+    workers[i].new_tops = hmap_new();
+    // a path has at most this many folders
+    workers[i].chain = malloc((MAX_PATH_LENGTH / 2 + 1) * sizeof(Tree *));
+    CHECK_PTR(workers[i].chain);
+  }
+  struct BRLock *aggregates_lock = &(tree->global->aggregates_lock);
+  int shard = brlock_read_lock(aggregates_lock);
+  bulk_run(workers, threads, bulk_build);
+
+  // attaches the new top-level folders
+  for (int i = 0; i < threads; i++) {
+    const char *name;
+    Tree *top;
+    HashMapIterator it = hmap_iterator(workers[i].new_tops);
+    while (hmap_next(workers[i].new_tops, &it, &name, (void **)&top)) {
+      children_insert(tree, top);
+      if (tree->global->aggregates) {
+        aggregates_add(tree, descendants_of(top) + 1,
+                       atomic_load(&(top->height)));
+      }
+    }
+    if (tree->global->aggregates && workers[i].added > 0) {
+      aggregates_add(tree, workers[i].added, workers[i].height);
+    }
+    hmap_free(workers[i].new_tops);
+    free(workers[i].chain);
+  }
+  brlock_read_unlock(aggregates_lock, shard);
+
+  free(workers);
+  free(load.owners);
+  return trace_op_done(&trace, 0);
 }
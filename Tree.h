@@ -1,14 +1,126 @@
 #pragma once
 
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "BRLock.h"
 #include "HashMap.h"
 #include "Synchro.h"
+#include "path_utils.h"
+
+// Number of stripes the root's children are split into.
+#define TREE_ROOT_STRIPES 16
+
+// Max number of stripes a hot directory can be split into.
+#define TREE_MAX_STRIPES 256
 
 typedef struct Tree Tree; // Let "Tree" mean the same as "struct Tree".
 
+struct TreeWatchers;
+
+/**
+ * State shared by the whole tree, kept in its root.
+ */
+struct TreeGlobal {
+  // Moves between different folders take it, so they can't wait for one
+  // another or make a folder its own descendant (like rename_lock in Linux).
+  pthread_mutex_t rename_lock;
+
+  // Policy of the locks of folders created without one (see TreeOptions).
+  enum SynchroPolicy policy;
+
+  // Bytes of payload kept in every node (see TreeOptions).
+  size_t payload_size;
+
+  // Whether the aggregates below are kept (see TreeOptions).
+  bool aggregates;
+  // Taken for reading to update the aggregates of a folder's ancestors and
+  // for writing to move a folder, so moves don't change the ancestors of
+  // a folder while they're updated.
+  struct BRLock aggregates_lock;
+
+  // Subscriptions to changes of the tree (see TreeWatch.h).
+  struct TreeWatchers *watchers;
+};
+
+/**
+ * A part of a hot directory's children, with its own lock.
+ */
+struct TreeStripe {
+  struct Synchro synchronizer;
+  HashMap *children; // values are of type Tree*
+  pthread_mutex_t children_lock; // see Tree
+  atomic_long descendants; // a share of the folder's descendant count
+};
+
 struct Tree {
-  char *name;
+  const char *name; // interned (see NameTable.h), NULL for the root
   struct Synchro synchronizer;
   HashMap *children; // values are of type Tree*
+  // Children are created and removed by threads that only intend to change
+  // the folder (see synchro_change_from_visiting_to_intent_until), many at
+  // once, so they change the map under this lock, and readers that don't
+  // keep them out look children up under it too.
+  pthread_mutex_t children_lock;
+
+  // Hot directories (like the root) split their children and lock into
+  // stripes chosen by the hash of a child's name, so operations on children
+  // in different stripes don't contend. NULL for regular directories, which
+  // use synchronizer and children above instead.
+  struct TreeStripe *stripes;
+  int stripes_count;
+
+  struct TreeGlobal *global; // only in the root, NULL elsewhere
+
+  Tree *parent; // NULL for the root
+
+  // Number of times the folder was moved or renamed, so handles can tell
+  // when the paths they were opened at may lead somewhere else (see
+  // tree_open). Changed under the rights to the part of the parent that
+  // holds the folder.
+  atomic_ulong moves;
+
+  // One for the link from the parent, one for every open handle and, once
+  // removed, one for every stripe still to be left by the threads that were
+  // inside. The last one dropped destroys the folder (see tree_node_unref).
+  atomic_int references;
+
+  // Aggregates of the subtree, if the tree keeps them. The count of a hot
+  // directory is split into its stripes, each CPU updates its own one.
+  atomic_long descendants;
+  atomic_int height;        // length of the longest path down from here
+  atomic_bool height_dirty; // height may be too big, after a removal
+
+  // Data the user keeps with the folder (see tree_payload_get), of the size
+  // given in TreeOptions. It's guarded by the folder's first stripe (its
+  // only lock if it's a regular one), and moves along with the folder.
+  _Alignas(max_align_t) unsigned char payload[];
+};
+
+/**
+ * Options of a tree, see tree_new_with_options.
+ */
+struct TreeOptions {
+  // Keep the number of descendants and the height of every subtree,
+  // for tree_stat. Creating, removing and moving folders has to update
+  // the aggregates of all of their ancestors then.
+  bool aggregates;
+
+  // Policy of the locks of the root and of folders created without one
+  // (see tree_create_with_policy). SYNCHRO_PHASE_FAIR by default.
+  enum SynchroPolicy policy;
+
+  // Bytes of payload kept in every directory, zeroed when it's created
+  // (see tree_payload_get and TreePayload.h). 0 by default, for none.
+  size_t payload_size;
+};
+
+/**
+ * Aggregates of a subtree, see tree_stat.
+ */
+struct TreeStat {
+  long descendants; // number of directories below, excluding itself
+  int max_depth;    // depth of the deepest one of them, 0 if there are none
 };
 
 /**
@@ -21,29 +133,325 @@ int tree_destroy(Tree *tree);
  */
 Tree* tree_new();
 
+/**
+ * Creates a new directory tree like tree_new, with given options.
+ */
+Tree* tree_new_with_options(const struct TreeOptions* options);
+
 /**
  * Frees all memory taken by this tree and its subtrees.
  */
 void tree_free(Tree*);
 
+/*
+ * Every operation below, other than tree_create_hot and
+ * tree_create_with_policy, has two more variants:
+ * - *_timed, giving up at deadline, an absolute CLOCK_MONOTONIC time, with
+ *   ETIMEDOUT if some lock it needs couldn't be taken by then,
+ * - *_try, giving up with EWOULDBLOCK instead of waiting for any lock.
+ * A variant that gave up has no effect on the tree. The tree_list variants
+ * return NULL then and set errno to the error.
+ */
+
 /**
  * Returns a c-string representing the contents of a given directory.
  * (names of sub-folders separated by commas)
  * Freeing the result's memory is a responsibility of the caller.
  */
 char* tree_list(Tree* tree, const char* path);
+char* tree_list_timed(Tree* tree, const char* path,
+                      const struct timespec* deadline);
+char* tree_list_try(Tree* tree, const char* path);
+
+/**
+ * Returns the names of children of a given directory from from (inclusive,
+ * from the first one if NULL) to to (exclusive, to the last one if NULL),
+ * at most limit of them (all if 0), formatted like tree_list's result.
+ * Takes time proportional to the size of the result, not of the directory.
+ * On failure returns NULL and sets errno.
+ */
+char* tree_list_range(Tree* tree, const char* path, const char* from,
+                      const char* to, size_t limit);
 
 /**
- * Creates a new directory in a given path.
+ * Returns the names of children of a given directory starting with prefix,
+ * at most limit of them (all if 0), like tree_list_range.
+ */
+char* tree_list_prefix(Tree* tree, const char* path, const char* prefix,
+                       size_t limit);
+
+/**
+ * Writes the contents of a given directory, formatted like tree_list's
+ * result, into buf of size cap, allocating nothing.
+ * Sets *needed to the size the contents take (with the null character).
+ * Returns ERANGE if that's more than cap, buf's contents are undefined then.
+ */
+int tree_list_into(Tree* tree, const char* path, char* buf, size_t cap,
+                   size_t* needed);
+
+/**
+ * Position of a listing done with tree_list_iter.
+ */
+struct TreeListCursor {
+  char last[MAX_FOLDER_NAME_LENGTH + 1]; // last name listed, "" at the start
+};
+
+/**
+ * Sets a cursor to the start of a listing.
+ */
+void tree_list_cursor_init(struct TreeListCursor* cursor);
+
+/**
+ * Writes the next names of the contents of a given directory (in sorted
+ * order, formatted like tree_list's result) into buf of size cap, as many as
+ * fit, and advances the cursor past them. Sets *count to the number of names
+ * written, which is 0 at the end of the listing.
+ * The directory is locked only for the duration of each call. Names created
+ * or removed between calls are listed or not, but no name is listed twice.
+ * Returns EINVAL if cap is less than MAX_FOLDER_NAME_LENGTH + 1.
+ */
+int tree_list_iter(Tree* tree, const char* path,
+                   struct TreeListCursor* cursor, char* buf, size_t cap,
+                   size_t* count);
+
+/**
+ * Creates a new directory in a given path. Differently named directories
+ * are created (and removed) in one parent in parallel, only listing,
+ * walking and moving wait for them, and they for those.
  */
 int tree_create(Tree* tree, const char* path);
+int tree_create_timed(Tree* tree, const char* path,
+                      const struct timespec* deadline);
+int tree_create_try(Tree* tree, const char* path);
+
+/**
+ * Creates a new "hot" directory in a given path. Its children and lock are
+ * split into stripes_count stripes, so creating and removing differently
+ * named children in it contend only within a stripe, and moving them waits
+ * only for their stripes.
+ * Returns EINVAL if stripes_count is not between 1 and TREE_MAX_STRIPES.
+ */
+int tree_create_hot(Tree* tree, const char* path, int stripes_count);
 
 /**
- * Removes the directory as long as it's empty.
+ * Creates a new directory in a given path, whose lock follows policy instead
+ * of the tree's one, e.g. SYNCHRO_READER_PREFERRING for a directory that's
+ * mostly listed. Its children still follow the tree's policy.
+ * Returns EINVAL if policy isn't one of SynchroPolicy's values.
+ */
+int tree_create_with_policy(Tree* tree, const char* path,
+                            enum SynchroPolicy policy);
+
+/**
+ * Removes the directory as long as it's empty. Threads still listing it
+ * don't hold up the removal, it's freed when the last of them is done.
  */
 int tree_remove(Tree* tree, const char* path);
+int tree_remove_timed(Tree* tree, const char* path,
+                      const struct timespec* deadline);
+int tree_remove_try(Tree* tree, const char* path);
 
 /**
  * Moves the directory source with its contents to path specified by target.
  */
 int tree_move(Tree* tree, const char* source, const char* target);
+int tree_move_timed(Tree* tree, const char* source, const char* target,
+                    const struct timespec* deadline);
+int tree_move_try(Tree* tree, const char* source, const char* target);
+
+// Values returned by callbacks of tree_walk. Any other value stops the walk.
+#define TREE_WALK_CONTINUE 0
+#define TREE_WALK_PRUNE 1 // the children of the directory are not walked
+
+// Flags of tree_walk.
+#define TREE_WALK_PARALLEL 1 // walk with a thread per core
+
+/**
+ * Called by tree_walk for each directory, with its path and its depth below
+ * the directory the walk started at.
+ */
+typedef int (*TreeWalkCallback)(const char* path, int depth, void* arg);
+
+/**
+ * Walks the subtree of the directory path, calling callback for each
+ * directory in it, before its children (which go in sorted order), down to
+ * max_depth (no limit if negative). The callback must not change the tree.
+ * A directory is read-locked from the callback for it until all of its
+ * children have been walked or handed out, so it can't change in between.
+ * With TREE_WALK_PARALLEL, sibling subtrees are handed out to a pool of
+ * threads stealing work from one another, and callback is called
+ * concurrently. A subtree handed out is found again by its path, so if it's
+ * moved or removed before another thread gets to it, it's skipped.
+ * Returns 0 after walking the whole subtree, the value the callback stopped
+ * the walk with (see TREE_WALK_CONTINUE), or EINVAL / ENOENT for a bad path.
+ */
+int tree_walk(Tree* tree, const char* path, TreeWalkCallback callback,
+              void* arg, int flags, int max_depth);
+
+/**
+ * Calls callback (like tree_walk does) for every directory whose path
+ * matches a pattern. A pattern is a path whose components may have '*' (any
+ * string), '?' (any letter) and classes like "[a-f]" or "[!xy]" in them, and
+ * a "**" component matches any number of directories, none included, so that
+ * "/logs/" "**" "/tmp/" matches every "tmp" under "/logs/". Depth passed to
+ * the callback is the number of components of the path.
+ * The pattern is compiled into an automaton once. Directories that start the
+ * pattern without wildcards are looked up directly, and only the children
+ * that can lead to a match are read-locked and walked. Flags are those of
+ * tree_walk.
+ * Returns 0 after walking every directory that can match, the value the
+ * callback stopped the walk with, or EINVAL for a bad pattern (or one of
+ * more than 63 components).
+ */
+int tree_glob(Tree* tree, const char* pattern, TreeWalkCallback callback,
+              void* arg, int flags);
+
+/**
+ * Creates the directories of paths_count paths, along with their missing
+ * ancestors, using a given number of threads. Paths that exist already (or
+ * come twice) are skipped. Meant for filling an empty tree: no other thread
+ * may use the tree until it returns, and watchers aren't notified.
+ * Each top-level directory is built by one of the threads without locking,
+ * so the paths should have many of them. Sorted paths are built fastest.
+ * Returns 0, or EINVAL if threads < 1 or a path is invalid, in which case
+ * nothing is created.
+ */
+int tree_bulk_load(Tree* tree, const char* const* paths, size_t paths_count,
+                   int threads);
+
+/**
+ * Gets the aggregates of the subtree of a given directory. Takes O(1) time,
+ * other than recomputing max_depth below directories removed or moved out
+ * since it was last asked for.
+ * Returns ENOTSUP if the tree doesn't keep aggregates.
+ */
+int tree_stat(Tree* tree, const char* path, struct TreeStat* stat);
+
+/**
+ * Memory of a subtree, in bytes, see tree_memory_stats.
+ */
+struct TreeMemoryStats {
+  size_t nodes; // the directories, with their payloads and stripes
+  size_t maps;  // their maps of children (tables and entries)
+  // the table of interned names of directories, shared by every tree of
+  // the process
+  size_t names;
+  size_t locks; // Synchro monitors and the mutexes of the maps
+  // bytes of the heap of the whole process that were freed and are kept by
+  // the allocator (0 if it doesn't tell), whose pages tree_compact may
+  // have given back to the system already
+  size_t free_slack;
+};
+
+/**
+ * Counts the memory taken by the subtree of a given directory, by category,
+ * read-locking its directories like tree_walk does.
+ * Returns 0, EINVAL or ENOENT.
+ */
+int tree_memory_stats(Tree* tree, const char* path,
+                      struct TreeMemoryStats* stats);
+
+/**
+ * Rebuilds the maps of children of every directory in the subtree of path,
+ * with tables sized for the children they have and their entries
+ * reallocated together, each under the write lock of its directory, then
+ * gives the freed memory back to the system where the allocator can.
+ * Meant to be called now and then by long-running processes, after many
+ * directories were removed. Directories moved or removed while it runs
+ * may be skipped.
+ * Returns 0, EINVAL or ENOENT.
+ */
+int tree_compact(Tree* tree, const char* path);
+
+/**
+ * Copies the payload of a directory (see TreeOptions) to payload, under the
+ * directory's read lock.
+ * Returns 0, ENOTSUP if the tree keeps no payloads, EINVAL or ENOENT.
+ */
+int tree_payload_get(Tree* tree, const char* path, void* payload);
+
+/**
+ * Copies payload to the payload of a directory, under its write lock.
+ * Returns like tree_payload_get.
+ */
+int tree_payload_set(Tree* tree, const char* path, const void* payload);
+
+typedef void (*TreePayloadUpdate)(void* payload, void* arg);
+
+/**
+ * Calls update with the payload of a directory and arg, under the
+ * directory's write lock, so that it can read and change the payload at
+ * once. It must not call tree functions. Returns like tree_payload_get.
+ */
+int tree_payload_update(Tree* tree, const char* path,
+                        TreePayloadUpdate update, void* arg);
+
+/**
+ * A list of operations applied together by tree_transaction_commit.
+ */
+typedef struct TreeTransaction TreeTransaction;
+
+TreeTransaction* tree_transaction_new(void);
+
+void tree_transaction_free(TreeTransaction* transaction);
+
+/**
+ * Add an operation to a transaction, like tree_create, tree_remove and
+ * tree_move do. Operations see the changes made by the ones before them.
+ */
+void tree_transaction_create(TreeTransaction* transaction, const char* path);
+void tree_transaction_remove(TreeTransaction* transaction, const char* path);
+void tree_transaction_move(TreeTransaction* transaction, const char* source,
+                           const char* target);
+
+/**
+ * Applies the operations of a transaction atomically: no other operation
+ * sees the tree in between them. The rights to all folders they touch are
+ * taken once, in the order of a pre-order walk of the tree, so transactions
+ * can't deadlock with one another or with other operations, and folders
+ * shared by the operations are locked only once.
+ * Returns 0 if all operations succeeded. Otherwise none of them has any
+ * effect, the error of the first one to fail is returned and *failed (if
+ * failed isn't NULL) is set to its index, or to the number of operations if
+ * the transaction gave up waiting for its locks (see tree_move_timed).
+ */
+int tree_transaction_commit(Tree* tree, TreeTransaction* transaction,
+                            size_t* failed);
+int tree_transaction_commit_timed(Tree* tree, TreeTransaction* transaction,
+                                  const struct timespec* deadline,
+                                  size_t* failed);
+int tree_transaction_commit_try(Tree* tree, TreeTransaction* transaction,
+                                size_t* failed);
+
+/**
+ * An open directory, see tree_open.
+ */
+typedef struct TreeHandle TreeHandle;
+
+/**
+ * Opens a directory, so that operations inside it (see tree_create_at) don't
+ * look up its path from the root and lock the way down every time.
+ * The handle stays bound to the directory found at path. Once the directory
+ * is removed, or it's not at path anymore because it or one of its ancestors
+ * was moved, the handle is stale: operations on it fail with ESTALE. Its
+ * memory stays valid until the handle is closed either way.
+ * Moves elsewhere in the tree don't affect it.
+ * A handle can be used by many threads at once. All handles must be closed
+ * before the tree is freed.
+ * On failure returns NULL and sets errno (EINVAL or ENOENT).
+ */
+TreeHandle* tree_open(Tree* tree, const char* path);
+
+void tree_close(TreeHandle* handle);
+
+/**
+ * Like tree_create, tree_list, tree_remove and tree_move, with paths
+ * relative to an open directory. They're written like absolute paths,
+ * "/" being the directory itself. Return ESTALE (tree_list_at sets errno to
+ * it) if the handle is stale, or if the directory's path kept changing while
+ * the operation was retried a few times. Watchers get the absolute paths.
+ */
+int tree_create_at(TreeHandle* dir, const char* path);
+char* tree_list_at(TreeHandle* dir, const char* path);
+int tree_remove_at(TreeHandle* dir, const char* path);
+int tree_move_at(TreeHandle* dir, const char* source, const char* target);
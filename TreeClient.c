@@ -0,0 +1,208 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "TreeClient.h"
+#include "TreeProto.h"
+
+// buffered submissions are sent once they take this many bytes
+#define FLUSH_SIZE (64 * 1024)
+#define RECEIVE_SIZE (64 * 1024)
+
+struct TreeClient {
+  int fd;
+  struct TreeBuffer out; // submissions not sent yet
+  struct TreeBuffer in;  // replies received, from in_start on
+  size_t in_start;       // end of the replies waited for already
+  size_t in_flight;
+};
+
+TreeClient *tree_client_connect(const char *socket_path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  strcpy(address.sun_path, socket_path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return NULL;
+  }
+  if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return NULL;
+  }
+
+  TreeClient *client = malloc(sizeof(TreeClient));
+  CHECK_PTR(client);
+  client->fd = fd;
+  tree_buffer_init(&(client->out));
+  tree_buffer_init(&(client->in));
+  client->in_start = 0;
+  client->in_flight = 0;
+  return client;
+}
+
+void tree_client_close(TreeClient *client) {
+  close(client->fd);
+  tree_buffer_free(&(client->out));
+  tree_buffer_free(&(client->in));
+  free(client);
+}
+
+int tree_client_submit(TreeClient *client, const struct TreeSubmission *sqe) {
+  if (strlen(sqe->path) > MAX_PATH_LENGTH ||
+      (sqe->opcode == TREE_OP_MOVE && strlen(sqe->target) > MAX_PATH_LENGTH)) {
+    return EINVAL;
+  }
+  tree_proto_put_request(&(client->out), sqe);
+  client->in_flight++;
+  if (client->out.length >= FLUSH_SIZE) {
+    return tree_client_flush(client);
+  }
+  return 0;
+}
+
+/**
+ * Receives whatever replies the socket has, or waits for some if flags
+ * don't include MSG_DONTWAIT.
+ * @return 0 on success (EAGAIN if nothing had arrived with MSG_DONTWAIT),
+ * the error of recv or ECONNRESET if the server closed the connection
+ */
+int client_receive(TreeClient *client, int flags) {
+  struct TreeBuffer *in = &(client->in);
+  tree_buffer_consume(in, client->in_start);
+  client->in_start = 0;
+  tree_buffer_reserve(in, RECEIVE_SIZE);
+  ssize_t count;
+  while ((count = recv(client->fd, in->data + in->length,
+                       in->capacity - in->length, flags)) < 0) {
+    if (errno != EINTR) {
+      return errno;
+    }
+  }
+  if (count == 0) {
+    return ECONNRESET;
+  }
+  in->length += count;
+  return 0;
+}
+
+int tree_client_flush(TreeClient *client) {
+  // replies are taken in while sending, or else with a long enough batch
+  // both sides would wait for the other to read
+  struct pollfd poll_fd = {.fd = client->fd, .events = POLLIN | POLLOUT};
+  size_t sent = 0;
+  int err;
+  while (sent < client->out.length) {
+    if (poll(&poll_fd, 1, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    }
+    if ((poll_fd.revents & POLLIN) != 0 &&
+        (err = client_receive(client, MSG_DONTWAIT)) != 0 && err != EAGAIN) {
+      return err;
+    }
+    if ((poll_fd.revents & (POLLOUT | POLLERR | POLLHUP)) == 0) {
+      continue;
+    }
+    ssize_t count = send(client->fd, client->out.data + sent,
+                         client->out.length - sent,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (count < 0) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      return errno;
+    }
+    sent += count;
+  }
+  client->out.length = 0;
+  return 0;
+}
+
+int tree_client_wait(TreeClient *client, struct TreeCompletion *cqe) {
+  if (client->in_flight == 0) {
+    return EAGAIN;
+  }
+  int err;
+  if ((err = tree_client_flush(client)) != 0) {
+    return err;
+  }
+
+  struct TreeBuffer *in = &(client->in);
+  size_t size;
+  while ((size = tree_proto_frame_size(in, client->in_start, SIZE_MAX)) ==
+         0) {
+    if ((err = client_receive(client, 0)) != 0) {
+      return err;
+    }
+  }
+
+  if (tree_proto_get_reply(in->data + client->in_start, size, cqe) != 0) {
+    return EPROTO;
+  }
+  client->in_start += size;
+  client->in_flight--;
+  return 0;
+}
+
+/**
+ * Executes an operation and waits for its completion.
+ */
+int client_call(TreeClient *client, enum TreeOpcode opcode, const char *path,
+                const char *target, char **listing) {
+  if (client->in_flight > 0) {
+    return EBUSY;
+  }
+  struct TreeSubmission sqe = {
+      .opcode = opcode, .path = path, .target = target, .tag = 0};
+  int err;
+  if ((err = tree_client_submit(client, &sqe)) != 0) {
+    return err;
+  }
+  struct TreeCompletion cqe;
+  if ((err = tree_client_wait(client, &cqe)) != 0) {
+    return err;
+  }
+  if (listing != NULL) {
+    *listing = cqe.listing;
+  } else {
+    free(cqe.listing);
+  }
+  return cqe.result;
+}
+
+int tree_client_create(TreeClient *client, const char *path) {
+  return client_call(client, TREE_OP_CREATE, path, NULL, NULL);
+}
+
+char *tree_client_list(TreeClient *client, const char *path) {
+  char *listing = NULL;
+  int err = client_call(client, TREE_OP_LIST, path, NULL, &listing);
+  if (err != 0) {
+    errno = err;
+    return NULL;
+  }
+  return listing;
+}
+
+int tree_client_remove(TreeClient *client, const char *path) {
+  return client_call(client, TREE_OP_REMOVE, path, NULL, NULL);
+}
+
+int tree_client_move(TreeClient *client, const char *source,
+                     const char *target) {
+  return client_call(client, TREE_OP_MOVE, source, target, NULL);
+}
@@ -0,0 +1,59 @@
+#ifndef MIMUW_FORK__TREE_CLIENT_H_
+#define MIMUW_FORK__TREE_CLIENT_H_
+
+#include "TreeQueue.h"
+
+/**
+ * Connection to a tree hosted by tree_server (see TreeProto.h).
+ * Operations can be called one at a time, like the tree_* functions, or
+ * pipelined like on a TreeQueue: any number of them is submitted, and their
+ * completions are waited for in the order of submission. Submissions are
+ * buffered and sent together, so a batch costs a few system calls.
+ * A client must not be used by more than one thread at a time.
+ * If the connection fails, the functions return the error of the failing
+ * system call (ECONNRESET if the server closed it), and the client can only
+ * be closed.
+ */
+typedef struct TreeClient TreeClient;
+
+/**
+ * Connects to a server listening at a given socket path.
+ * On failure returns NULL and sets errno.
+ */
+TreeClient *tree_client_connect(const char *socket_path);
+
+void tree_client_close(TreeClient *client);
+
+/**
+ * Like tree_create, tree_list, tree_remove and tree_move. They return EBUSY
+ * (tree_client_list sets errno to it) if pipelined operations haven't been
+ * waited for.
+ */
+int tree_client_create(TreeClient *client, const char *path);
+char *tree_client_list(TreeClient *client, const char *path);
+int tree_client_remove(TreeClient *client, const char *path);
+int tree_client_move(TreeClient *client, const char *source,
+                     const char *target);
+
+/**
+ * Submits an operation. The paths are copied, so they don't have to stay
+ * valid. Sends the buffered submissions once there are enough of them.
+ * @return 0 on success, EINVAL if a path is too long to be valid (nothing is
+ * submitted then)
+ */
+int tree_client_submit(TreeClient *client, const struct TreeSubmission *sqe);
+
+/**
+ * Sends the buffered submissions. Replies that arrive meanwhile are kept
+ * until they're waited for, so they take memory for as long as they aren't.
+ */
+int tree_client_flush(TreeClient *client);
+
+/**
+ * Waits for the completion of the earliest operation not waited for yet,
+ * sending the buffered submissions first.
+ * @return 0 on success, EAGAIN if there are no operations in flight
+ */
+int tree_client_wait(TreeClient *client, struct TreeCompletion *cqe);
+
+#endif // MIMUW_FORK__TREE_CLIENT_H_
@@ -0,0 +1,61 @@
+#ifndef MIMUW_FORK__TREE_PAYLOAD_H_
+#define MIMUW_FORK__TREE_PAYLOAD_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "Tree.h"
+
+/**
+ * Typed access to the payloads of a tree (see TreeOptions).
+ * TREE_PAYLOAD(prefix, type) defines, for payloads of a given type:
+ *   Tree *prefix_tree_new(bool aggregates)
+ *     creates a tree keeping a zeroed type in every directory
+ *   int prefix_get(Tree *tree, const char *path, type *payload)
+ *   int prefix_set(Tree *tree, const char *path, const type *payload)
+ *   int prefix_update(Tree *tree, const char *path,
+ *                     void (*update)(type *payload, void *arg), void *arg)
+ *     like tree_payload_get, tree_payload_set and tree_payload_update
+ * The type is copied with memcpy, so it can't own anything that has to be
+ * freed along with its directory.
+ */
+#define TREE_PAYLOAD(prefix, type)                                             \
+  _Static_assert(_Alignof(type) <= _Alignof(max_align_t),                      \
+                 "payloads are aligned to max_align_t");                       \
+                                                                               \
+  static inline Tree *prefix##_tree_new(bool aggregates) {                     \
+    struct TreeOptions options = {.aggregates = aggregates,                    \
+                                  .policy = SYNCHRO_PHASE_FAIR,                \
+                                  .payload_size = sizeof(type)};               \
+    return tree_new_with_options(&options);                                    \
+  }                                                                            \
+                                                                               \
+  static inline int prefix##_get(Tree *tree, const char *path,                 \
+                                 type *payload) {                              \
+    return tree_payload_get(tree, path, payload);                              \
+  }                                                                            \
+                                                                               \
+  static inline int prefix##_set(Tree *tree, const char *path,                 \
+                                 const type *payload) {                        \
+    return tree_payload_set(tree, path, payload);                              \
+  }                                                                            \
+                                                                               \
+  struct prefix##_update_call {                                                \
+    void (*update)(type *payload, void *arg);                                  \
+    void *arg;                                                                 \
+  };                                                                           \
+                                                                               \
+  static inline void prefix##_update_trampoline(void *payload, void *arg) {    \
+    struct prefix##_update_call *call = arg;                                   \
+    call->update(payload, call->arg);                                          \
+  }                                                                            \
+                                                                               \
+  static inline int prefix##_update(Tree *tree, const char *path,              \
+                                    void (*update)(type * payload, void *arg), \
+                                    void *arg) {                               \
+    struct prefix##_update_call call = {update, arg};                          \
+    return tree_payload_update(tree, path, prefix##_update_trampoline, &call); \
+  }                                                                            \
+  _Static_assert(true, "") // to be followed by a semicolon
+
+#endif // MIMUW_FORK__TREE_PAYLOAD_H_
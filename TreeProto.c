@@ -0,0 +1,172 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "TreeProto.h"
+
+void tree_buffer_init(struct TreeBuffer *buffer) {
+  buffer->data = NULL;
+  buffer->length = 0;
+  buffer->capacity = 0;
+}
+
+void tree_buffer_free(struct TreeBuffer *buffer) { free(buffer->data); }
+
+void tree_buffer_reserve(struct TreeBuffer *buffer, size_t size) {
+  if (buffer->length + size <= buffer->capacity) {
+    return;
+  }
+  size_t capacity = buffer->capacity == 0 ? 4096 : buffer->capacity;
+  while (capacity < buffer->length + size) {
+    capacity *= 2;
+  }
+  buffer->data = realloc(buffer->data, capacity);
+  CHECK_PTR(buffer->data);
+  buffer->capacity = capacity;
+}
+
+void tree_buffer_consume(struct TreeBuffer *buffer, size_t size) {
+  if (size == 0) {
+    return;
+  }
+  memmove(buffer->data, buffer->data + size, buffer->length - size);
+  buffer->length -= size;
+}
+
+void buffer_put(struct TreeBuffer *buffer, const void *bytes, size_t size) {
+  if (size == 0) {
+    return;
+  }
+  memcpy(buffer->data + buffer->length, bytes, size);
+  buffer->length += size;
+}
+
+void buffer_put_string(struct TreeBuffer *buffer, const char *string) {
+  uint16_t length = strlen(string);
+  buffer_put(buffer, &length, sizeof(length));
+  buffer_put(buffer, string, length);
+}
+
+void tree_proto_put_request(struct TreeBuffer *buffer,
+                            const struct TreeSubmission *sqe) {
+  tree_buffer_reserve(buffer, TREE_PROTO_HEADER_SIZE + TREE_PROTO_MAX_REQUEST);
+  size_t start = buffer->length;
+  buffer->length += TREE_PROTO_HEADER_SIZE;
+
+  uint8_t opcode = sqe->opcode;
+  buffer_put(buffer, &opcode, sizeof(opcode));
+  buffer_put(buffer, &(sqe->tag), sizeof(sqe->tag));
+  buffer_put_string(buffer, sqe->path);
+  if (sqe->opcode == TREE_OP_MOVE) {
+    buffer_put_string(buffer, sqe->target);
+  }
+
+  uint32_t length = buffer->length - start - TREE_PROTO_HEADER_SIZE;
+  memcpy(buffer->data + start, &length, sizeof(length));
+}
+
+void tree_proto_put_reply(struct TreeBuffer *buffer,
+                          const struct TreeCompletion *cqe) {
+  // with the null, so that an empty listing can be told from none
+  size_t listing_length =
+      cqe->listing == NULL ? 0 : strlen(cqe->listing) + 1;
+  uint32_t length = sizeof(cqe->tag) + sizeof(int32_t) + listing_length;
+  tree_buffer_reserve(buffer, TREE_PROTO_HEADER_SIZE + length);
+
+  int32_t result = cqe->result;
+  buffer_put(buffer, &length, sizeof(length));
+  buffer_put(buffer, &(cqe->tag), sizeof(cqe->tag));
+  buffer_put(buffer, &result, sizeof(result));
+  buffer_put(buffer, cqe->listing, listing_length);
+}
+
+size_t tree_proto_frame_size(const struct TreeBuffer *buffer, size_t offset,
+                             size_t max_size) {
+  if (buffer->length - offset < TREE_PROTO_HEADER_SIZE) {
+    return 0;
+  }
+  uint32_t length;
+  memcpy(&length, buffer->data + offset, sizeof(length));
+  if (length > max_size) {
+    return SIZE_MAX;
+  }
+  if (buffer->length - offset - TREE_PROTO_HEADER_SIZE < length) {
+    return 0;
+  }
+  return TREE_PROTO_HEADER_SIZE + length;
+}
+
+/**
+ * Copies a string of a frame at a given position to a buffer of
+ * MAX_PATH_LENGTH + 1 bytes and moves the position past it.
+ * @return false if it doesn't fit the frame or the buffer
+ */
+bool get_string(const char *frame, size_t size, size_t *position,
+                char *string) {
+  uint16_t length;
+  if (size - *position < sizeof(length)) {
+    return false;
+  }
+  memcpy(&length, frame + *position, sizeof(length));
+  *position += sizeof(length);
+  if (length > MAX_PATH_LENGTH || size - *position < length) {
+    return false;
+  }
+  memcpy(string, frame + *position, length);
+  string[length] = '\0';
+  *position += length;
+  return true;
+}
+
+int tree_proto_get_request(const char *frame, size_t size,
+                           struct TreeSubmission *sqe, char *path,
+                           char *target) {
+  size_t position = TREE_PROTO_HEADER_SIZE;
+  uint8_t opcode;
+  if (size - position < sizeof(opcode) + sizeof(sqe->tag)) {
+    return EINVAL;
+  }
+  memcpy(&opcode, frame + position, sizeof(opcode));
+  position += sizeof(opcode);
+  memcpy(&(sqe->tag), frame + position, sizeof(sqe->tag));
+  position += sizeof(sqe->tag);
+
+  sqe->opcode = opcode;
+  sqe->path = path;
+  sqe->target = NULL;
+  if (!get_string(frame, size, &position, path)) {
+    return EINVAL;
+  }
+  if (opcode == TREE_OP_MOVE) {
+    sqe->target = target;
+    if (!get_string(frame, size, &position, target)) {
+      return EINVAL;
+    }
+  }
+  return position == size ? 0 : EINVAL;
+}
+
+int tree_proto_get_reply(const char *frame, size_t size,
+                         struct TreeCompletion *cqe) {
+  size_t position = TREE_PROTO_HEADER_SIZE;
+  int32_t result;
+  if (size - position < sizeof(cqe->tag) + sizeof(result)) {
+    return EINVAL;
+  }
+  memcpy(&(cqe->tag), frame + position, sizeof(cqe->tag));
+  position += sizeof(cqe->tag);
+  memcpy(&result, frame + position, sizeof(result));
+  position += sizeof(result);
+
+  cqe->result = result;
+  cqe->listing = NULL;
+  if (position < size) {
+    if (frame[size - 1] != '\0') {
+      return EINVAL;
+    }
+    cqe->listing = malloc(size - position);
+    CHECK_PTR(cqe->listing);
+    memcpy(cqe->listing, frame + position, size - position);
+  }
+  return 0;
+}
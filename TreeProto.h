@@ -0,0 +1,84 @@
+#ifndef MIMUW_FORK__TREE_PROTO_H_
+#define MIMUW_FORK__TREE_PROTO_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "TreeQueue.h"
+#include "path_utils.h"
+
+/**
+ * Wire format spoken by tree_server and TreeClient over a Unix-domain socket,
+ * so integers go in the host's byte order.
+ * Every message is a frame: a uint32_t length of the rest of it, then
+ * - in a request: uint8_t opcode (an enum TreeOpcode), uint64_t tag, the path
+ *   and, for TREE_OP_MOVE, the target, each as a uint16_t length followed by
+ *   that many bytes (no terminating null);
+ * - in a reply: uint64_t tag, int32_t result and, for a TREE_OP_LIST that
+ *   succeeded, the listing with its terminating null.
+ * A client may send any number of requests without waiting for the replies.
+ * Requests sent over one connection are executed, and replied to, in order.
+ */
+
+#define TREE_PROTO_HEADER_SIZE 4
+#define TREE_PROTO_MAX_REQUEST (1 + 8 + 2 * (2 + MAX_PATH_LENGTH))
+
+/**
+ * Growable array of bytes, for frames on the way in or out.
+ */
+struct TreeBuffer {
+  char *data;
+  size_t length;
+  size_t capacity;
+};
+
+void tree_buffer_init(struct TreeBuffer *buffer);
+
+void tree_buffer_free(struct TreeBuffer *buffer);
+
+/**
+ * Makes room for at least a given number of bytes past the length.
+ */
+void tree_buffer_reserve(struct TreeBuffer *buffer, size_t size);
+
+/**
+ * Drops a given number of bytes from the front.
+ */
+void tree_buffer_consume(struct TreeBuffer *buffer, size_t size);
+
+/**
+ * Appends a request. Its paths must be at most MAX_PATH_LENGTH long.
+ */
+void tree_proto_put_request(struct TreeBuffer *buffer,
+                            const struct TreeSubmission *sqe);
+
+void tree_proto_put_reply(struct TreeBuffer *buffer,
+                          const struct TreeCompletion *cqe);
+
+/**
+ * Finds the size of the frame starting at a given offset of a buffer,
+ * header included.
+ * @return the size, 0 if the frame hasn't arrived whole yet, or SIZE_MAX if
+ * it would be longer than max_size
+ */
+size_t tree_proto_frame_size(const struct TreeBuffer *buffer, size_t offset,
+                             size_t max_size);
+
+/**
+ * Reads a request from a whole frame. The paths are copied to path and
+ * target, which must have room for MAX_PATH_LENGTH + 1 bytes.
+ * @return 0 on success, EINVAL if the frame is malformed
+ */
+int tree_proto_get_request(const char *frame, size_t size,
+                           struct TreeSubmission *sqe, char *path,
+                           char *target);
+
+/**
+ * Reads a reply from a whole frame. The listing is allocated, freeing it is
+ * a responsibility of the caller.
+ * @return 0 on success, EINVAL if the frame is malformed
+ */
+int tree_proto_get_reply(const char *frame, size_t size,
+                         struct TreeCompletion *cqe);
+
+#endif // MIMUW_FORK__TREE_PROTO_H_
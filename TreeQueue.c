@@ -0,0 +1,345 @@
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "TreeQueue.h"
+#include "err.h"
+
+#define CACHE_LINE_SIZE 64
+
+/**
+ * One slot of a ring. Its sequence number tells whether it's ready to be
+ * written or read at a given position (see Dmitry Vyukov's bounded MPMC
+ * queue).
+ */
+struct RingCell {
+  atomic_size_t sequence;
+  union {
+    struct TreeSubmission sqe;
+    struct TreeCompletion cqe;
+  } entry;
+};
+
+/**
+ * Bounded lock-free ring with many producers and many consumers.
+ */
+struct Ring {
+  _Alignas(CACHE_LINE_SIZE) atomic_size_t enqueue_position;
+  _Alignas(CACHE_LINE_SIZE) atomic_size_t dequeue_position;
+  _Alignas(CACHE_LINE_SIZE) struct RingCell *cells;
+  size_t mask;
+};
+
+struct TreeQueue {
+  struct Ring submissions;
+  struct Ring completions;
+
+  // operations submitted but not reaped, at most capacity; it's what keeps
+  // both rings from overflowing
+  _Alignas(CACHE_LINE_SIZE) atomic_size_t in_flight;
+  size_t capacity;
+
+  Tree *tree;
+  int event_fd;
+
+  // one post per submission (and one per worker when stopping)
+  sem_t work_available;
+  atomic_bool is_stopping;
+  pthread_t *workers;
+  int workers_count;
+};
+
+void ring_init(struct Ring *ring, size_t capacity) {
+  ring->cells = malloc(capacity * sizeof(struct RingCell));
+  CHECK_PTR(ring->cells);
+  for (size_t i = 0; i < capacity; i++) {
+    atomic_init(&(ring->cells[i].sequence), i);
+  }
+  ring->mask = capacity - 1;
+  atomic_init(&(ring->enqueue_position), 0);
+  atomic_init(&(ring->dequeue_position), 0);
+}
+
+/**
+ * Reserves a cell to write to.
+ * @return the cell, or NULL if the ring is full
+ */
+struct RingCell *ring_reserve_push(struct Ring *ring, size_t *position) {
+  size_t pos =
+      atomic_load_explicit(&(ring->enqueue_position), memory_order_relaxed);
+  while (true) {
+    struct RingCell *cell = &(ring->cells[pos & ring->mask]);
+    size_t sequence =
+        atomic_load_explicit(&(cell->sequence), memory_order_acquire);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(
+              &(ring->enqueue_position), &pos, pos + 1, memory_order_relaxed,
+              memory_order_relaxed)) {
+        *position = pos;
+        return cell;
+      }
+    } else if (diff < 0) {
+      return NULL;
+    } else {
+      pos = atomic_load_explicit(&(ring->enqueue_position),
+                                 memory_order_relaxed);
+    }
+  }
+}
+
+/**
+ * Reserves a cell to read from.
+ * @return the cell, or NULL if the ring is empty
+ */
+struct RingCell *ring_reserve_pop(struct Ring *ring, size_t *position) {
+  size_t pos =
+      atomic_load_explicit(&(ring->dequeue_position), memory_order_relaxed);
+  while (true) {
+    struct RingCell *cell = &(ring->cells[pos & ring->mask]);
+    size_t sequence =
+        atomic_load_explicit(&(cell->sequence), memory_order_acquire);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(
+              &(ring->dequeue_position), &pos, pos + 1, memory_order_relaxed,
+              memory_order_relaxed)) {
+        *position = pos;
+        return cell;
+      }
+    } else if (diff < 0) {
+      return NULL;
+    } else {
+      pos = atomic_load_explicit(&(ring->dequeue_position),
+                                 memory_order_relaxed);
+    }
+  }
+}
+
+/**
+ * Reserves a cell to write to in a ring with fewer entries in flight than
+ * cells. It can still look full, when the cell at the head is held by a
+ * consumer that has taken it but not yet handed it back, so this waits
+ * for that consumer to do so.
+ */
+struct RingCell *ring_reserve_push_waiting(struct Ring *ring,
+                                           size_t *position) {
+  struct RingCell *cell;
+  while ((cell = ring_reserve_push(ring, position)) == NULL) {
+    sched_yield();
+  }
+  return cell;
+}
+
+/**
+ * Publishes a cell written after ring_reserve_push.
+ */
+void ring_commit_push(struct RingCell *cell, size_t position) {
+  atomic_store_explicit(&(cell->sequence), position + 1,
+                        memory_order_release);
+}
+
+/**
+ * Hands a cell read after ring_reserve_pop back to the producers.
+ */
+void ring_commit_pop(struct Ring *ring, struct RingCell *cell,
+                     size_t position) {
+  atomic_store_explicit(&(cell->sequence), position + ring->mask + 1,
+                        memory_order_release);
+}
+
+void tree_queue_execute(Tree *tree, const struct TreeSubmission *sqe,
+                        struct TreeCompletion *cqe) {
+  cqe->tag = sqe->tag;
+  cqe->listing = NULL;
+
+  switch (sqe->opcode) {
+  case TREE_OP_LIST:
+    cqe->listing = tree_list(tree, sqe->path);
+    cqe->result = cqe->listing != NULL ? 0 : errno;
+    break;
+  case TREE_OP_CREATE:
+    cqe->result = tree_create(tree, sqe->path);
+    break;
+  case TREE_OP_REMOVE:
+    cqe->result = tree_remove(tree, sqe->path);
+    break;
+  case TREE_OP_MOVE:
+    cqe->result = tree_move(tree, sqe->path, sqe->target);
+    break;
+  default:
+    cqe->result = EINVAL;
+  }
+}
+
+void *tree_queue_worker(void *data) {
+  TreeQueue *queue = data;
+  size_t position;
+
+  while (true) {
+    while (sem_wait(&(queue->work_available)) != 0) {
+      if (errno != EINTR) {
+        syserr(errno, "sem_wait failed");
+      }
+    }
+
+    struct RingCell *cell;
+    while ((cell = ring_reserve_pop(&(queue->submissions), &position)) ==
+           NULL) {
+      // only stopping posts come without a submission; any other one is for
+      // a submission that's there, but may be behind one that's still being
+      // written, so it's waited for rather than dropped along with its post
+      if (atomic_load(&(queue->is_stopping))) {
+        return NULL;
+      }
+      sched_yield();
+    }
+    struct TreeSubmission sqe = cell->entry.sqe;
+    ring_commit_pop(&(queue->submissions), cell, position);
+
+    struct TreeCompletion cqe;
+    tree_queue_execute(queue->tree, &sqe, &cqe);
+
+    // there are at most capacity operations in flight
+    cell = ring_reserve_push_waiting(&(queue->completions), &position);
+    cell->entry.cqe = cqe;
+    ring_commit_push(cell, position);
+
+    uint64_t one = 1;
+    if (write(queue->event_fd, &one, sizeof(one)) != sizeof(one)) {
+      syserr(errno, "eventfd write failed");
+    }
+  }
+}
+
+TreeQueue *tree_queue_new(Tree *tree, int workers, uint32_t entries) {
+  if (workers < 1 || entries < 1) {
+    return NULL;
+  }
+
+  TreeQueue *queue = malloc(sizeof(TreeQueue));
+  CHECK_PTR(queue);
+
+  size_t capacity = 1;
+  while (capacity < entries) {
+    capacity <<= 1;
+  }
+  ring_init(&(queue->submissions), capacity);
+  ring_init(&(queue->completions), capacity);
+  atomic_init(&(queue->in_flight), 0);
+  queue->capacity = capacity;
+  queue->tree = tree;
+
+  if ((queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+    syserr(errno, "eventfd failed");
+  }
+  if (sem_init(&(queue->work_available), 0, 0) != 0) {
+    syserr(errno, "sem_init failed");
+  }
+  atomic_init(&(queue->is_stopping), false);
+
+  queue->workers_count = workers;
+  queue->workers = malloc(workers * sizeof(pthread_t));
+  CHECK_PTR(queue->workers);
+  int err;
+  for (int i = 0; i < workers; i++) {
+    if ((err = pthread_create(&(queue->workers[i]), NULL, tree_queue_worker,
+                              queue)) != 0) {
+      syserr(err, "pthread_create failed");
+    }
+  }
+
+  return queue;
+}
+
+void tree_queue_free(TreeQueue *queue) {
+  atomic_store(&(queue->is_stopping), true);
+  for (int i = 0; i < queue->workers_count; i++) {
+    if (sem_post(&(queue->work_available)) != 0) {
+      syserr(errno, "sem_post failed");
+    }
+  }
+  int err;
+  for (int i = 0; i < queue->workers_count; i++) {
+    if ((err = pthread_join(queue->workers[i], NULL)) != 0) {
+      syserr(err, "pthread_join failed");
+    }
+  }
+
+  struct TreeCompletion cqe;
+  while (tree_queue_poll(queue, &cqe) == 0) {
+    free(cqe.listing);
+  }
+
+  if (sem_destroy(&(queue->work_available)) != 0) {
+    syserr(errno, "sem_destroy failed");
+  }
+  close(queue->event_fd);
+  free(queue->workers);
+  free(queue->submissions.cells);
+  free(queue->completions.cells);
+  free(queue);
+}
+
+int tree_queue_submit(TreeQueue *queue, const struct TreeSubmission *sqe) {
+  size_t in_flight = atomic_load(&(queue->in_flight));
+  do {
+    if (in_flight >= queue->capacity) {
+      return EAGAIN;
+    }
+  } while (!atomic_compare_exchange_weak(&(queue->in_flight), &in_flight,
+                                         in_flight + 1));
+
+  // there are at most capacity operations in flight
+  size_t position;
+  struct RingCell *cell =
+      ring_reserve_push_waiting(&(queue->submissions), &position);
+  cell->entry.sqe = *sqe;
+  ring_commit_push(cell, position);
+
+  if (sem_post(&(queue->work_available)) != 0) {
+    syserr(errno, "sem_post failed");
+  }
+  return 0;
+}
+
+int tree_queue_poll(TreeQueue *queue, struct TreeCompletion *cqe) {
+  size_t position;
+  struct RingCell *cell = ring_reserve_pop(&(queue->completions), &position);
+  if (cell == NULL) {
+    return EAGAIN;
+  }
+  *cqe = cell->entry.cqe;
+  ring_commit_pop(&(queue->completions), cell, position);
+
+  atomic_fetch_sub(&(queue->in_flight), 1);
+  return 0;
+}
+
+int tree_queue_wait(TreeQueue *queue, struct TreeCompletion *cqe) {
+  while (tree_queue_poll(queue, cqe) != 0) {
+    if (atomic_load(&(queue->in_flight)) == 0) {
+      return EAGAIN;
+    }
+
+    struct pollfd fd = {.fd = queue->event_fd, .events = POLLIN};
+    if (poll(&fd, 1, -1) == -1 && errno != EINTR) {
+      syserr(errno, "poll failed");
+    }
+    uint64_t value;
+    if (read(queue->event_fd, &value, sizeof(value)) == -1 &&
+        errno != EAGAIN) {
+      syserr(errno, "eventfd read failed");
+    }
+  }
+  return 0;
+}
+
+int tree_queue_eventfd(TreeQueue *queue) { return queue->event_fd; }
@@ -0,0 +1,90 @@
+#ifndef MIMUW_FORK__TREE_QUEUE_H_
+#define MIMUW_FORK__TREE_QUEUE_H_
+
+#include <stdint.h>
+
+#include "Tree.h"
+
+/**
+ * Asynchronous interface to a tree, similar to io_uring.
+ * Clients push operations into a lock-free submission ring, a pool of worker
+ * threads executes them and pushes the results into a lock-free completion
+ * ring, tagged with whatever the client put in the submission. Completions
+ * can be polled for, waited for, or waited for on an eventfd (e.g. in an
+ * event loop).
+ */
+typedef struct TreeQueue TreeQueue;
+
+enum TreeOpcode {
+  TREE_OP_LIST,
+  TREE_OP_CREATE,
+  TREE_OP_REMOVE,
+  TREE_OP_MOVE,
+};
+
+struct TreeSubmission {
+  enum TreeOpcode opcode;
+  // paths aren't copied, they have to stay valid until the completion
+  // of the operation is reaped
+  const char *path;
+  const char *target; // only for TREE_OP_MOVE
+  uint64_t tag;
+};
+
+struct TreeCompletion {
+  uint64_t tag;
+  // what the matching tree_* function returned; for TREE_OP_LIST 0 or
+  // the reason the listing is NULL (EINVAL or ENOENT)
+  int result;
+  // result of TREE_OP_LIST, freeing it is a responsibility of the caller
+  char *listing;
+};
+
+/**
+ * Creates a queue executing operations on a tree.
+ * @param tree tree to operate on, it must outlive the queue
+ * @param workers number of worker threads
+ * @param entries max number of operations in flight (submitted, but not
+ * reaped yet), rounded up to a power of two
+ */
+TreeQueue *tree_queue_new(Tree *tree, int workers, uint32_t entries);
+
+/**
+ * Waits for the submitted operations to be executed, stops the workers and
+ * frees the queue. Completions that weren't reaped are dropped.
+ */
+void tree_queue_free(TreeQueue *queue);
+
+/**
+ * Submits an operation. Never blocks.
+ * @return 0 on success, EAGAIN if there are too many operations in flight
+ */
+int tree_queue_submit(TreeQueue *queue, const struct TreeSubmission *sqe);
+
+/**
+ * Reaps a completion, if there is one. Never blocks.
+ * @return 0 on success, EAGAIN if no operation has completed yet
+ */
+int tree_queue_poll(TreeQueue *queue, struct TreeCompletion *cqe);
+
+/**
+ * Reaps a completion, waiting for one if needed.
+ * @return 0 on success, EAGAIN if there are no operations in flight
+ */
+int tree_queue_wait(TreeQueue *queue, struct TreeCompletion *cqe);
+
+/**
+ * Executes an operation on a tree right away, in the calling thread, the way
+ * the workers of a queue do, and fills its completion in.
+ */
+void tree_queue_execute(Tree *tree, const struct TreeSubmission *sqe,
+                        struct TreeCompletion *cqe);
+
+/**
+ * Returns a non-blocking eventfd that becomes readable when operations
+ * complete. After it's signalled, it should be read (to clear it) and then
+ * completions should be polled for until there are none.
+ */
+int tree_queue_eventfd(TreeQueue *queue);
+
+#endif // MIMUW_FORK__TREE_QUEUE_H_
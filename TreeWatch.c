@@ -0,0 +1,300 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "TreeWatch.h"
+#include "err.h"
+#include "path_utils.h"
+
+#define CACHE_LINE_SIZE 64
+
+/**
+ * One slot of a subscription's queue. Its sequence number tells whether it's
+ * ready to be written or read at a given position (see Dmitry Vyukov's
+ * bounded MPMC queue, here with a single consumer).
+ */
+struct EventCell {
+  atomic_size_t sequence;
+  struct TreeEvent event;
+};
+
+struct TreeWatch {
+  _Alignas(CACHE_LINE_SIZE) atomic_size_t enqueue_position;
+  _Alignas(CACHE_LINE_SIZE) size_t dequeue_position; // only the consumer's
+  _Alignas(CACHE_LINE_SIZE) struct EventCell *cells;
+  size_t mask;
+
+  // set when an event is dropped, until the consumer gets the marker;
+  // events are dropped while it's set, and the marker is only given once
+  // the events queued before are taken, so it's where the gap is
+  atomic_bool is_overflowed;
+
+  char *path;
+  size_t path_length;
+  bool is_recursive;
+  int event_fd;
+
+  // neighbours on the list of subscriptions of the tree
+  TreeWatch *prev;
+  TreeWatch *next;
+  struct TreeWatchers *watchers;
+};
+
+struct TreeWatchers {
+  // taken for reading to publish events and for writing to subscribe
+  pthread_rwlock_t lock;
+  TreeWatch *first;
+  // publishing is skipped while there are no subscriptions
+  atomic_int count;
+};
+
+struct TreeWatchers *tree_watchers_new(void) {
+  struct TreeWatchers *watchers = malloc(sizeof(struct TreeWatchers));
+  CHECK_PTR(watchers);
+
+  int err;
+  if ((err = pthread_rwlock_init(&(watchers->lock), 0)) != 0) {
+    syserr(err, "rwlock_init failed");
+  }
+  watchers->first = NULL;
+  atomic_init(&(watchers->count), 0);
+  return watchers;
+}
+
+void tree_watchers_free(struct TreeWatchers *watchers) {
+  int err;
+  if ((err = pthread_rwlock_destroy(&(watchers->lock))) != 0) {
+    syserr(err, "rwlock_destroy failed");
+  }
+  free(watchers);
+}
+
+/**
+ * Checks whether a subscription watches the directory of a given path.
+ */
+bool is_watched(TreeWatch *watch, const char *path) {
+  if (strncmp(path, watch->path, watch->path_length) != 0) {
+    return false;
+  }
+  const char *rest = path + watch->path_length;
+  if (*rest == '\0') {
+    return false; // the watched directory itself isn't its own child
+  }
+  // the rest of a child's path is a single "name/"
+  return watch->is_recursive || strchr(rest, '/')[1] == '\0';
+}
+
+/**
+ * Puts an event into the queue of a subscription, or drops it if the queue
+ * is full, which is marked.
+ */
+void watch_push(TreeWatch *watch, enum TreeEventType type, const char *path,
+                const char *target) {
+  if (atomic_load(&(watch->is_overflowed))) {
+    return;
+  }
+
+  size_t position = atomic_load_explicit(&(watch->enqueue_position),
+                                         memory_order_relaxed);
+  struct EventCell *cell;
+  while (true) {
+    cell = &(watch->cells[position & watch->mask]);
+    size_t sequence =
+        atomic_load_explicit(&(cell->sequence), memory_order_acquire);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)position;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(
+              &(watch->enqueue_position), &position, position + 1,
+              memory_order_relaxed, memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      cell = NULL; // full
+      break;
+    } else {
+      position = atomic_load_explicit(&(watch->enqueue_position),
+                                      memory_order_relaxed);
+    }
+  }
+
+  if (cell == NULL) {
+    atomic_store(&(watch->is_overflowed), true);
+  } else {
+    cell->event.type = type;
+    cell->event.path = strdup(path);
+    CHECK_PTR(cell->event.path);
+    cell->event.target = NULL;
+    if (target != NULL) {
+      cell->event.target = strdup(target);
+      CHECK_PTR(cell->event.target);
+    }
+    atomic_store_explicit(&(cell->sequence), position + 1,
+                          memory_order_release);
+  }
+
+  uint64_t one = 1;
+  if (write(watch->event_fd, &one, sizeof(one)) != sizeof(one) &&
+      errno != EAGAIN) {
+    syserr(errno, "eventfd write failed");
+  }
+}
+
+void tree_watchers_publish(struct TreeWatchers *watchers,
+                           enum TreeEventType type, const char *path,
+                           const char *target) {
+  if (atomic_load(&(watchers->count)) == 0) {
+    return;
+  }
+
+  int err;
+  if ((err = pthread_rwlock_rdlock(&(watchers->lock))) != 0) {
+    syserr(err, "rwlock_rdlock failed");
+  }
+  for (TreeWatch *watch = watchers->first; watch != NULL;
+       watch = watch->next) {
+    if (is_watched(watch, path) ||
+        (target != NULL && is_watched(watch, target))) {
+      watch_push(watch, type, path, target);
+    }
+  }
+  if ((err = pthread_rwlock_unlock(&(watchers->lock))) != 0) {
+    syserr(err, "rwlock_unlock failed");
+  }
+}
+
+TreeWatch *tree_watch(Tree *tree, const char *path, bool recursive,
+                      uint32_t capacity) {
+  if (!is_path_valid(path) || capacity < 1) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  TreeWatch *watch = malloc(sizeof(TreeWatch));
+  CHECK_PTR(watch);
+
+  size_t cells_count = 1;
+  while (cells_count < capacity) {
+    cells_count <<= 1;
+  }
+  watch->cells = malloc(cells_count * sizeof(struct EventCell));
+  CHECK_PTR(watch->cells);
+  for (size_t i = 0; i < cells_count; i++) {
+    atomic_init(&(watch->cells[i].sequence), i);
+  }
+  watch->mask = cells_count - 1;
+  atomic_init(&(watch->enqueue_position), 0);
+  watch->dequeue_position = 0;
+  atomic_init(&(watch->is_overflowed), false);
+
+  watch->path = strdup(path);
+  CHECK_PTR(watch->path);
+  watch->path_length = strlen(path);
+  watch->is_recursive = recursive;
+  if ((watch->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+    syserr(errno, "eventfd failed");
+  }
+
+  struct TreeWatchers *watchers = tree->global->watchers;
+  watch->watchers = watchers;
+  int err;
+  if ((err = pthread_rwlock_wrlock(&(watchers->lock))) != 0) {
+    syserr(err, "rwlock_wrlock failed");
+  }
+  watch->prev = NULL;
+  watch->next = watchers->first;
+  if (watchers->first != NULL) {
+    watchers->first->prev = watch;
+  }
+  watchers->first = watch;
+  atomic_fetch_add(&(watchers->count), 1);
+  if ((err = pthread_rwlock_unlock(&(watchers->lock))) != 0) {
+    syserr(err, "rwlock_unlock failed");
+  }
+
+  return watch;
+}
+
+void tree_unwatch(TreeWatch *watch) {
+  struct TreeWatchers *watchers = watch->watchers;
+  int err;
+  // no one publishes to the subscription after that
+  if ((err = pthread_rwlock_wrlock(&(watchers->lock))) != 0) {
+    syserr(err, "rwlock_wrlock failed");
+  }
+  if (watch->prev != NULL) {
+    watch->prev->next = watch->next;
+  } else {
+    watchers->first = watch->next;
+  }
+  if (watch->next != NULL) {
+    watch->next->prev = watch->prev;
+  }
+  atomic_fetch_sub(&(watchers->count), 1);
+  if ((err = pthread_rwlock_unlock(&(watchers->lock))) != 0) {
+    syserr(err, "rwlock_unlock failed");
+  }
+
+  struct TreeEvent event;
+  while (tree_watch_poll(watch, &event) == 0) {
+    tree_event_free(&event);
+  }
+  close(watch->event_fd);
+  free(watch->path);
+  free(watch->cells);
+  free(watch);
+}
+
+int tree_watch_poll(TreeWatch *watch, struct TreeEvent *event) {
+  size_t position = watch->dequeue_position;
+  struct EventCell *cell = &(watch->cells[position & watch->mask]);
+  size_t sequence =
+      atomic_load_explicit(&(cell->sequence), memory_order_acquire);
+  if (sequence == position + 1) {
+    *event = cell->event;
+    atomic_store_explicit(&(cell->sequence), position + watch->mask + 1,
+                          memory_order_release);
+    watch->dequeue_position = position + 1;
+    return 0;
+  }
+
+  // a cell may be taken by a writer that hasn't filled it yet, with an event
+  // from before the gap, which the marker has to wait for (the writer
+  // signals the eventfd once it's done)
+  if (atomic_load(&(watch->enqueue_position)) != position) {
+    return EAGAIN;
+  }
+  // the queue is empty, so the marker goes right after the events before
+  // the gap
+  if (atomic_exchange(&(watch->is_overflowed), false)) {
+    event->type = TREE_EVENT_OVERFLOW;
+    event->path = NULL;
+    event->target = NULL;
+    return 0;
+  }
+  return EAGAIN;
+}
+
+void tree_watch_wait(TreeWatch *watch, struct TreeEvent *event) {
+  while (tree_watch_poll(watch, event) != 0) {
+    struct pollfd fd = {.fd = watch->event_fd, .events = POLLIN};
+    if (poll(&fd, 1, -1) == -1 && errno != EINTR) {
+      syserr(errno, "poll failed");
+    }
+    uint64_t value;
+    if (read(watch->event_fd, &value, sizeof(value)) == -1 &&
+        errno != EAGAIN) {
+      syserr(errno, "eventfd read failed");
+    }
+  }
+}
+
+int tree_watch_eventfd(TreeWatch *watch) { return watch->event_fd; }
+
+void tree_event_free(struct TreeEvent *event) {
+  free(event->path);
+  free(event->target);
+}
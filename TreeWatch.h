@@ -0,0 +1,98 @@
+#ifndef MIMUW_FORK__TREE_WATCH_H_
+#define MIMUW_FORK__TREE_WATCH_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "Tree.h"
+
+/**
+ * Subscription to changes of a directory. Every subscription has a bounded
+ * lock-free queue of events, filled by the threads changing the tree after
+ * they release their locks, and emptied by a single consumer.
+ * When the queue is full, events are dropped until the consumer gets to
+ * a TREE_EVENT_OVERFLOW marker in their place, writers never wait for it.
+ * The marker comes after every event queued before the first one dropped.
+ * Events are published after the operations release their locks, so those
+ * of operations running at the same time in different threads (even on the
+ * same path, like a create and a remove) may come in another order than
+ * the one the operations took effect in. A consumer mirroring the tree
+ * should read a directory again (see tree_list) when an event doesn't fit
+ * what it has.
+ */
+typedef struct TreeWatch TreeWatch;
+
+enum TreeEventType {
+  TREE_EVENT_CREATE,
+  TREE_EVENT_REMOVE,
+  TREE_EVENT_MOVE,
+  TREE_EVENT_OVERFLOW, // some events after the previous ones were dropped
+};
+
+struct TreeEvent {
+  enum TreeEventType type;
+  char *path;   // directory created, removed or moved, NULL for an overflow
+  char *target; // where it was moved to, only for TREE_EVENT_MOVE
+};
+
+/**
+ * Subscribes to changes of the children of the directory path, or of all of
+ * its descendants if recursive is set. A move is reported if its source or
+ * target is watched. Subscriptions follow paths, not directories, so a path
+ * may be watched before it's created, and moving a watched directory doesn't
+ * move its subscription.
+ * @param capacity max number of events waiting in the queue, rounded up to
+ * a power of two
+ * @return the subscription, or NULL (with errno set to EINVAL) if path is
+ * invalid or capacity is 0
+ */
+TreeWatch *tree_watch(Tree *tree, const char *path, bool recursive,
+                      uint32_t capacity);
+
+/**
+ * Cancels a subscription and frees it, with the events waiting in its queue.
+ */
+void tree_unwatch(TreeWatch *watch);
+
+/**
+ * Takes the next event of a subscription, if there is one. Never blocks.
+ * @return 0 on success, EAGAIN if there are no events
+ */
+int tree_watch_poll(TreeWatch *watch, struct TreeEvent *event);
+
+/**
+ * Takes the next event of a subscription, waiting for one if needed.
+ */
+void tree_watch_wait(TreeWatch *watch, struct TreeEvent *event);
+
+/**
+ * Returns a non-blocking eventfd that becomes readable when events arrive.
+ * After it's signalled, it should be read (to clear it) and then events
+ * should be polled for until there are none.
+ */
+int tree_watch_eventfd(TreeWatch *watch);
+
+/**
+ * Frees the paths of an event taken from a subscription.
+ */
+void tree_event_free(struct TreeEvent *event);
+
+/**
+ * All subscriptions to changes of a tree, kept in its root.
+ */
+struct TreeWatchers;
+
+struct TreeWatchers *tree_watchers_new(void);
+
+void tree_watchers_free(struct TreeWatchers *watchers);
+
+/**
+ * Hands an event to the subscriptions watching it. Called by the tree
+ * operations after they release their locks.
+ * @param target only for TREE_EVENT_MOVE, NULL otherwise
+ */
+void tree_watchers_publish(struct TreeWatchers *watchers,
+                           enum TreeEventType type, const char *path,
+                           const char *target);
+
+#endif // MIMUW_FORK__TREE_WATCH_H_
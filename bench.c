@@ -0,0 +1,202 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "Tree.h"
+#include "err.h"
+
+// Compares the lock policies of Synchro on a read-heavy and a write-heavy
+// workload, hitting one directory from many threads.
+// Usage: bench [threads] [seconds per run]
+
+#define CHILDREN 64
+#define MAX_SAMPLES (1 << 20)
+
+struct Workload {
+  const char *name;
+  int read_percent; // the rest are creates and removes
+};
+
+struct Run {
+  Tree *tree;
+  int read_percent;
+  struct timespec end;
+};
+
+struct Worker {
+  struct Run *run;
+  pthread_t thread;
+  unsigned seed;
+  long ops;
+  long *read_samples; // latencies in ns
+  long read_count;
+  long *write_samples;
+  long write_count;
+};
+
+long ns_between(const struct timespec *start, const struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) * 1000000000L +
+         (end->tv_nsec - start->tv_nsec);
+}
+
+void record(long *samples, long *count, long ns) {
+  if (*count < MAX_SAMPLES) {
+    samples[*count] = ns;
+  }
+  (*count)++;
+}
+
+void make_child_path(char *path, int index) {
+  sprintf(path, "/d/%c%c/", 'a' + index / 26, 'a' + index % 26);
+}
+
+void *bench_worker(void *data) {
+  struct Worker *worker = data;
+  struct Run *run = worker->run;
+  char path[16];
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  while (ns_between(&now, &(run->end)) > 0) {
+    struct timespec start = now;
+    bool is_read = (int)(rand_r(&(worker->seed)) % 100) < run->read_percent;
+    if (is_read) {
+      free(tree_list(run->tree, "/d/"));
+    } else {
+      make_child_path(path, rand_r(&(worker->seed)) % CHILDREN);
+      if (rand_r(&(worker->seed)) % 2 == 0) {
+        tree_create(run->tree, path);
+      } else {
+        tree_remove(run->tree, path);
+      }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    long ns = ns_between(&start, &now);
+    if (is_read) {
+      record(worker->read_samples, &(worker->read_count), ns);
+    } else {
+      record(worker->write_samples, &(worker->write_count), ns);
+    }
+    worker->ops++;
+  }
+  return NULL;
+}
+
+int compare_longs(const void *first, const void *second) {
+  long a = *(const long *)first;
+  long b = *(const long *)second;
+  return (a > b) - (a < b);
+}
+
+/**
+ * Returns the 99th percentile of the samples of all workers, in ns.
+ */
+long p99(struct Worker *workers, int threads, bool reads) {
+  long total = 0;
+  for (int i = 0; i < threads; i++) {
+    long count = reads ? workers[i].read_count : workers[i].write_count;
+    total += count < MAX_SAMPLES ? count : MAX_SAMPLES;
+  }
+  if (total == 0) {
+    return 0;
+  }
+
+  long *all = malloc(total * sizeof(long));
+  CHECK_PTR(all);
+  long filled = 0;
+  for (int i = 0; i < threads; i++) {
+    long count = reads ? workers[i].read_count : workers[i].write_count;
+    count = count < MAX_SAMPLES ? count : MAX_SAMPLES;
+    memcpy(all + filled,
+           reads ? workers[i].read_samples : workers[i].write_samples,
+           count * sizeof(long));
+    filled += count;
+  }
+  qsort(all, total, sizeof(long), compare_longs);
+  long result = all[total * 99 / 100];
+  free(all);
+  return result;
+}
+
+void bench(enum SynchroPolicy policy, const char *policy_name,
+           struct Workload *workload, int threads, int seconds) {
+  struct TreeOptions options = {.aggregates = false, .policy = policy};
+  struct Run run;
+  run.tree = tree_new_with_options(&options);
+  run.read_percent = workload->read_percent;
+  tree_create(run.tree, "/d/");
+  char path[16];
+  for (int i = 0; i < CHILDREN; i += 2) {
+    make_child_path(path, i);
+    tree_create(run.tree, path);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &(run.end));
+  run.end.tv_sec += seconds;
+
+  struct Worker *workers = calloc(threads, sizeof(struct Worker));
+  CHECK_PTR(workers);
+  int err;
+  for (int i = 0; i < threads; i++) {
+    workers[i].run = &run;
+    workers[i].seed = i + 1;
+    workers[i].read_samples = malloc(MAX_SAMPLES * sizeof(long));
+    CHECK_PTR(workers[i].read_samples);
+    workers[i].write_samples = malloc(MAX_SAMPLES * sizeof(long));
+    CHECK_PTR(workers[i].write_samples);
+    if ((err = pthread_create(&(workers[i].thread), NULL, bench_worker,
+                              &workers[i])) != 0) {
+      syserr(err, "pthread_create failed");
+    }
+  }
+
+  long ops = 0;
+  for (int i = 0; i < threads; i++) {
+    if ((err = pthread_join(workers[i].thread, NULL)) != 0) {
+      syserr(err, "pthread_join failed");
+    }
+    ops += workers[i].ops;
+  }
+  printf("%-18s %-12s %12.0f %14.1f %14.1f\n", policy_name, workload->name,
+         (double)ops / seconds, p99(workers, threads, true) / 1000.0,
+         p99(workers, threads, false) / 1000.0);
+
+  for (int i = 0; i < threads; i++) {
+    free(workers[i].read_samples);
+    free(workers[i].write_samples);
+  }
+  free(workers);
+  tree_free(run.tree);
+}
+
+int main(int argc, char **argv) {
+  int threads = argc > 1 ? atoi(argv[1]) : 8;
+  int seconds = argc > 2 ? atoi(argv[2]) : 2;
+  if (threads < 1 || seconds < 1) {
+    fprintf(stderr, "usage: %s [threads] [seconds per run]\n", argv[0]);
+    return 1;
+  }
+
+  struct Workload workloads[] = {{"read-heavy", 95}, {"write-heavy", 50}};
+  struct {
+    enum SynchroPolicy policy;
+    const char *name;
+  } policies[] = {
+      {SYNCHRO_PHASE_FAIR, "phase-fair"},
+      {SYNCHRO_WRITER_PREFERRING, "writer-preferring"},
+      {SYNCHRO_READER_PREFERRING, "reader-preferring"},
+      {SYNCHRO_FIFO, "fifo"},
+  };
+
+  printf("%-18s %-12s %12s %14s %14s\n", "policy", "workload", "ops/s",
+         "read p99 us", "write p99 us");
+  for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+    for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+      bench(policies[p].policy, policies[p].name, &workloads[w], threads,
+            seconds);
+    }
+  }
+  return 0;
+}
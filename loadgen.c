@@ -0,0 +1,199 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "Tree.h"
+#include "TreeClient.h"
+#include "err.h"
+
+// Measures the op rate of a tree_server, on the workloads of bench, next to
+// the rate of the same workload run on a tree in this process.
+// Usage: loadgen socket_path [connections] [seconds per run] [pipeline depth]
+
+#define CHILDREN 64
+
+struct Workload {
+  const char *name;
+  int read_percent; // the rest are creates and removes
+};
+
+struct Run {
+  const char *socket_path; // NULL to run in this process
+  Tree *tree;
+  int read_percent;
+  int depth; // operations each connection keeps in flight
+  struct timespec end;
+};
+
+struct Worker {
+  struct Run *run;
+  pthread_t thread;
+  unsigned seed;
+  long ops;
+  char path[16]; // of the last operation drawn
+};
+
+bool is_before(const struct timespec *now, const struct timespec *end) {
+  return now->tv_sec < end->tv_sec ||
+         (now->tv_sec == end->tv_sec && now->tv_nsec < end->tv_nsec);
+}
+
+void make_child_path(char *path, int index) {
+  sprintf(path, "/lg/%c%c/", 'a' + index / 26, 'a' + index % 26);
+}
+
+/**
+ * Draws the next operation of a worker's workload. Its path stays valid
+ * until the next one is drawn (the client copies it when it's submitted).
+ */
+struct TreeSubmission next_operation(struct Worker *worker) {
+  struct TreeSubmission sqe = {.path = "/lg/", .target = NULL, .tag = 0};
+  if ((int)(rand_r(&(worker->seed)) % 100) < worker->run->read_percent) {
+    sqe.opcode = TREE_OP_LIST;
+    return sqe;
+  }
+  make_child_path(worker->path, rand_r(&(worker->seed)) % CHILDREN);
+  sqe.path = worker->path;
+  sqe.opcode = rand_r(&(worker->seed)) % 2 == 0 ? TREE_OP_CREATE
+                                                 : TREE_OP_REMOVE;
+  return sqe;
+}
+
+void *local_worker(void *data) {
+  struct Worker *worker = data;
+  struct Run *run = worker->run;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  while (is_before(&now, &(run->end))) {
+    struct TreeSubmission sqe = next_operation(worker);
+    if (sqe.opcode == TREE_OP_LIST) {
+      free(tree_list(run->tree, sqe.path));
+    } else if (sqe.opcode == TREE_OP_CREATE) {
+      tree_create(run->tree, sqe.path);
+    } else {
+      tree_remove(run->tree, sqe.path);
+    }
+    worker->ops++;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  }
+  return NULL;
+}
+
+void check_client(int err, const char *what) {
+  if (err != 0) {
+    syserr(err, "%s failed", what);
+  }
+}
+
+void *remote_worker(void *data) {
+  struct Worker *worker = data;
+  struct Run *run = worker->run;
+  TreeClient *client = tree_client_connect(run->socket_path);
+  if (client == NULL) {
+    syserr(errno, "connecting to %s failed", run->socket_path);
+  }
+
+  for (int i = 0; i < run->depth; i++) {
+    struct TreeSubmission sqe = next_operation(worker);
+    check_client(tree_client_submit(client, &sqe), "submit");
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  while (is_before(&now, &(run->end))) {
+    struct TreeCompletion cqe;
+    check_client(tree_client_wait(client, &cqe), "wait");
+    free(cqe.listing);
+    worker->ops++;
+    struct TreeSubmission sqe = next_operation(worker);
+    check_client(tree_client_submit(client, &sqe), "submit");
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  }
+
+  struct TreeCompletion cqe;
+  int err;
+  while ((err = tree_client_wait(client, &cqe)) == 0) {
+    free(cqe.listing);
+  }
+  if (err != EAGAIN) {
+    syserr(err, "wait failed");
+  }
+  tree_client_close(client);
+  return NULL;
+}
+
+/**
+ * Runs a workload and returns the op rate.
+ */
+double measure(struct Run *run, int threads, int seconds) {
+  clock_gettime(CLOCK_MONOTONIC, &(run->end));
+  run->end.tv_sec += seconds;
+
+  struct Worker *workers = calloc(threads, sizeof(struct Worker));
+  CHECK_PTR(workers);
+  int err;
+  for (int i = 0; i < threads; i++) {
+    workers[i].run = run;
+    workers[i].seed = i + 1;
+    if ((err = pthread_create(
+             &(workers[i].thread), NULL,
+             run->socket_path == NULL ? local_worker : remote_worker,
+             &workers[i])) != 0) {
+      syserr(err, "pthread_create failed");
+    }
+  }
+  long ops = 0;
+  for (int i = 0; i < threads; i++) {
+    if ((err = pthread_join(workers[i].thread, NULL)) != 0) {
+      syserr(err, "pthread_join failed");
+    }
+    ops += workers[i].ops;
+  }
+  free(workers);
+  return (double)ops / seconds;
+}
+
+int main(int argc, char **argv) {
+  int threads = argc > 2 ? atoi(argv[2]) : 8;
+  int seconds = argc > 3 ? atoi(argv[3]) : 2;
+  int depth = argc > 4 ? atoi(argv[4]) : 32;
+  if (argc < 2 || threads < 1 || seconds < 1 || depth < 1) {
+    fprintf(stderr,
+            "usage: %s socket_path [connections] [seconds per run] "
+            "[pipeline depth]\n",
+            argv[0]);
+    return 1;
+  }
+
+  TreeClient *client = tree_client_connect(argv[1]);
+  if (client == NULL) {
+    syserr(errno, "connecting to %s failed", argv[1]);
+  }
+  int err = tree_client_create(client, "/lg/");
+  if (err != 0 && err != EEXIST) {
+    syserr(err, "creating /lg/ failed");
+  }
+  tree_client_close(client);
+
+  Tree *tree = tree_new();
+  tree_create(tree, "/lg/");
+
+  struct Workload workloads[] = {{"read-heavy", 95}, {"write-heavy", 50}};
+  printf("%-12s %14s %14s %8s\n", "workload", "local ops/s", "remote ops/s",
+         "ratio");
+  for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+    struct Run run = {.socket_path = NULL,
+                      .tree = tree,
+                      .read_percent = workloads[w].read_percent,
+                      .depth = depth};
+    double local = measure(&run, threads, seconds);
+    run.socket_path = argv[1];
+    double remote = measure(&run, threads, seconds);
+    printf("%-12s %14.0f %14.0f %8.2f\n", workloads[w].name, local, remote,
+           local / remote);
+  }
+  tree_free(tree);
+  return 0;
+}
@@ -70,25 +70,18 @@ char* make_path_to_parent(const char* path, char* component)
     return result;
 }
 
-// A wrapper for using strcmp in qsort.
-// The arguments here are actually pointers to (const char*).
-static int compare_string_pointers(const void* p1, const void* p2)
-{
-    return strcmp(*(const char**)p1, *(const char**)p2);
-}
-
 const char** make_map_contents_array(HashMap* map)
 {
     size_t n_keys = hmap_size(map);
     const char** result = calloc(n_keys + 1, sizeof(char*));
-    HashMapIterator it = hmap_iterator(map);
+    // The map keeps its keys sorted, so there's no need to sort them here.
+    HashMapIterator it = hmap_sorted_iterator(map);
     const char** key = result;
     void* value = NULL;
-    while (hmap_next(map, &it, key, &value)) {
+    while (hmap_sorted_next(map, &it, key, &value)) {
         key++;
     }
     *key = NULL; // Set last array element to NULL.
-    qsort(result, n_keys, sizeof(char*), compare_string_pointers);
     return result;
 }
 
@@ -0,0 +1,366 @@
+#define _GNU_SOURCE // for accept4
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Tree.h"
+#include "TreeProto.h"
+#include "TreeQueue.h"
+#include "err.h"
+
+// Hosts a tree behind a Unix-domain socket, speaking the protocol described
+// in TreeProto.h, until it gets SIGINT or SIGTERM.
+// Usage: tree_server socket_path [workers]
+//
+// Every worker waits on the same epoll instance. Connections are registered
+// with EPOLLONESHOT, so a connection is served by one worker at a time: it
+// reads whatever requests have arrived, executes them in order and sends all
+// the replies with one write.
+
+#define RECEIVE_SIZE (64 * 1024)
+// a connection is served in turns of at most this many bytes of requests,
+// so that one client can't hold a worker forever
+#define MAX_TURN_SIZE (1024 * 1024)
+#define MAX_EVENTS 16
+
+struct Connection {
+  int fd;
+  struct TreeBuffer in;
+  struct TreeBuffer out;
+  size_t out_sent;
+  // turns it was served in; the workers serving it one after another
+  // synchronize on it, as epoll hands it over in a way sanitizers don't see
+  atomic_ulong turns;
+  struct Connection *previous; // in the list of all connections
+  struct Connection *next;
+};
+
+struct Server {
+  Tree *tree;
+  int listen_fd;
+  int epoll_fd;
+  int stop_fd; // eventfd, readable once the server is stopping
+
+  pthread_mutex_t connections_lock;
+  struct Connection connections; // sentinel of the list
+};
+
+void server_watch(struct Server *server, int op, int fd, uint32_t events,
+                  void *data) {
+  struct epoll_event event = {.events = events, .data.ptr = data};
+  if (epoll_ctl(server->epoll_fd, op, fd, &event) != 0) {
+    syserr(errno, "epoll_ctl failed");
+  }
+}
+
+void connection_open(struct Server *server, int fd) {
+  struct Connection *connection = malloc(sizeof(struct Connection));
+  CHECK_PTR(connection);
+  connection->fd = fd;
+  tree_buffer_init(&(connection->in));
+  tree_buffer_init(&(connection->out));
+  connection->out_sent = 0;
+
+  int err;
+  if ((err = pthread_mutex_lock(&(server->connections_lock))) != 0) {
+    syserr(err, "lock failed");
+  }
+  connection->previous = &(server->connections);
+  connection->next = server->connections.next;
+  connection->next->previous = connection;
+  server->connections.next = connection;
+  if ((err = pthread_mutex_unlock(&(server->connections_lock))) != 0) {
+    syserr(err, "unlock failed");
+  }
+
+  atomic_store_explicit(&(connection->turns), 0, memory_order_release);
+  server_watch(server, EPOLL_CTL_ADD, fd, EPOLLIN | EPOLLONESHOT, connection);
+}
+
+/**
+ * Closes a connection. The caller must be serving it, or be the only thread
+ * left.
+ */
+void connection_close(struct Server *server, struct Connection *connection) {
+  int err;
+  if ((err = pthread_mutex_lock(&(server->connections_lock))) != 0) {
+    syserr(err, "lock failed");
+  }
+  connection->previous->next = connection->next;
+  connection->next->previous = connection->previous;
+  if ((err = pthread_mutex_unlock(&(server->connections_lock))) != 0) {
+    syserr(err, "unlock failed");
+  }
+
+  // closing the descriptor removes it from the epoll instance
+  close(connection->fd);
+  tree_buffer_free(&(connection->in));
+  tree_buffer_free(&(connection->out));
+  free(connection);
+}
+
+/**
+ * Sends as much of the pending replies as the socket takes.
+ * @return false if the connection failed
+ */
+bool connection_send(struct Connection *connection) {
+  struct TreeBuffer *out = &(connection->out);
+  while (connection->out_sent < out->length) {
+    ssize_t count =
+        send(connection->fd, out->data + connection->out_sent,
+             out->length - connection->out_sent, MSG_NOSIGNAL);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    connection->out_sent += count;
+  }
+  out->length = 0;
+  connection->out_sent = 0;
+  return true;
+}
+
+/**
+ * Reads what has arrived on a connection, up to MAX_TURN_SIZE bytes.
+ * @return false if the connection was closed by the client or failed
+ */
+bool connection_receive(struct Connection *connection) {
+  struct TreeBuffer *in = &(connection->in);
+  size_t received = 0;
+  while (received < MAX_TURN_SIZE) {
+    tree_buffer_reserve(in, RECEIVE_SIZE);
+    ssize_t count = recv(connection->fd, in->data + in->length,
+                         in->capacity - in->length, 0);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    if (count == 0) {
+      return false;
+    }
+    in->length += count;
+    received += count;
+  }
+  return true;
+}
+
+/**
+ * Executes the whole requests received on a connection and puts their
+ * replies into its output.
+ * @return false if a request is malformed
+ */
+bool connection_execute(struct Server *server, struct Connection *connection) {
+  struct TreeBuffer *in = &(connection->in);
+  char path[MAX_PATH_LENGTH + 1];
+  char target[MAX_PATH_LENGTH + 1];
+  size_t offset = 0;
+  size_t size;
+  bool is_valid = true;
+  while (is_valid &&
+         (size = tree_proto_frame_size(in, offset, TREE_PROTO_MAX_REQUEST)) !=
+             0) {
+    struct TreeSubmission sqe;
+    if (size == SIZE_MAX ||
+        tree_proto_get_request(in->data + offset, size, &sqe, path, target) !=
+            0) {
+      is_valid = false;
+    } else {
+      struct TreeCompletion cqe;
+      tree_queue_execute(server->tree, &sqe, &cqe);
+      tree_proto_put_reply(&(connection->out), &cqe);
+      free(cqe.listing);
+      offset += size;
+    }
+  }
+  tree_buffer_consume(in, offset);
+  return is_valid;
+}
+
+/**
+ * Serves a connection that became ready, then arms it again: for reading,
+ * or for writing if the client doesn't take the replies fast enough (no more
+ * requests are read until it does).
+ */
+void connection_serve(struct Server *server, struct Connection *connection) {
+  atomic_load_explicit(&(connection->turns), memory_order_acquire);
+  bool is_open = connection_send(connection);
+  if (is_open && connection->out.length == 0) {
+    is_open = connection_receive(connection);
+    // requests that arrived whole are answered even if the client is gone
+    if (!connection_execute(server, connection)) {
+      is_open = false;
+    }
+    if (!connection_send(connection)) {
+      is_open = false;
+    }
+  }
+
+  if (!is_open) {
+    connection_close(server, connection);
+  } else {
+    uint32_t events = connection->out.length > 0 ? EPOLLOUT : EPOLLIN;
+    int fd = connection->fd;
+    // another worker can get it as soon as it's armed
+    atomic_fetch_add_explicit(&(connection->turns), 1, memory_order_release);
+    server_watch(server, EPOLL_CTL_MOD, fd, events | EPOLLONESHOT, connection);
+  }
+}
+
+void server_accept(struct Server *server) {
+  while (true) {
+    int fd = accept4(server->listen_fd, NULL, NULL,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd >= 0) {
+      connection_open(server, fd);
+    } else if (errno != EINTR && errno != ECONNABORTED) {
+      // EAGAIN once there are no more, or out of descriptors, in which case
+      // the client waits in the backlog
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("accept failed");
+      }
+      break;
+    }
+  }
+  server_watch(server, EPOLL_CTL_MOD, server->listen_fd,
+               EPOLLIN | EPOLLONESHOT, &(server->listen_fd));
+}
+
+void *server_worker(void *data) {
+  struct Server *server = data;
+  struct epoll_event events[MAX_EVENTS];
+  while (true) {
+    int count = epoll_wait(server->epoll_fd, events, MAX_EVENTS, -1);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      syserr(errno, "epoll_wait failed");
+    }
+    for (int i = 0; i < count; i++) {
+      void *source = events[i].data.ptr;
+      if (source == &(server->stop_fd)) {
+        // it stays readable, so every worker sees it
+        return NULL;
+      } else if (source == &(server->listen_fd)) {
+        server_accept(server);
+      } else {
+        connection_serve(server, source);
+      }
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  long workers_count = argc > 2 ? atol(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+  if (argc < 2 || workers_count < 1) {
+    fprintf(stderr, "usage: %s socket_path [workers]\n", argv[0]);
+    return 1;
+  }
+  const char *socket_path = argv[1];
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    fatal("socket path too long: %s", socket_path);
+  }
+  strcpy(address.sun_path, socket_path);
+
+  // the workers inherit the mask, so the signals only come to sigwait
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  int err;
+  if ((err = pthread_sigmask(SIG_BLOCK, &signals, NULL)) != 0) {
+    syserr(err, "pthread_sigmask failed");
+  }
+
+  struct Server server;
+  server.tree = tree_new();
+  server.connections.previous = &(server.connections);
+  server.connections.next = &(server.connections);
+  if ((err = pthread_mutex_init(&(server.connections_lock), 0)) != 0) {
+    syserr(err, "mutex_init failed");
+  }
+
+  server.listen_fd =
+      socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (server.listen_fd < 0) {
+    syserr(errno, "socket failed");
+  }
+  // a socket left by a server that didn't exit cleanly
+  unlink(socket_path);
+  if (bind(server.listen_fd, (struct sockaddr *)&address, sizeof(address)) !=
+      0) {
+    syserr(errno, "bind to %s failed", socket_path);
+  }
+  if (listen(server.listen_fd, SOMAXCONN) != 0) {
+    syserr(errno, "listen failed");
+  }
+
+  server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (server.epoll_fd < 0) {
+    syserr(errno, "epoll_create1 failed");
+  }
+  server.stop_fd = eventfd(0, EFD_CLOEXEC);
+  if (server.stop_fd < 0) {
+    syserr(errno, "eventfd failed");
+  }
+  server_watch(&server, EPOLL_CTL_ADD, server.stop_fd, EPOLLIN,
+               &(server.stop_fd));
+  server_watch(&server, EPOLL_CTL_ADD, server.listen_fd,
+               EPOLLIN | EPOLLONESHOT, &(server.listen_fd));
+
+  pthread_t *workers = malloc(workers_count * sizeof(pthread_t));
+  CHECK_PTR(workers);
+  for (long i = 0; i < workers_count; i++) {
+    if ((err = pthread_create(&workers[i], NULL, server_worker, &server)) !=
+        0) {
+      syserr(err, "pthread_create failed");
+    }
+  }
+  fprintf(stderr, "listening on %s with %ld workers\n", socket_path,
+          workers_count);
+
+  int signal;
+  if ((err = sigwait(&signals, &signal)) != 0) {
+    syserr(err, "sigwait failed");
+  }
+  uint64_t one = 1;
+  if (write(server.stop_fd, &one, sizeof(one)) != sizeof(one)) {
+    syserr(errno, "write to eventfd failed");
+  }
+  for (long i = 0; i < workers_count; i++) {
+    if ((err = pthread_join(workers[i], NULL)) != 0) {
+      syserr(err, "pthread_join failed");
+    }
+  }
+  free(workers);
+
+  while (server.connections.next != &(server.connections)) {
+    connection_close(&server, server.connections.next);
+  }
+  if ((err = pthread_mutex_destroy(&(server.connections_lock))) != 0) {
+    syserr(err, "mutex_destroy failed");
+  }
+  close(server.stop_fd);
+  close(server.epoll_fd);
+  close(server.listen_fd);
+  unlink(socket_path);
+  tree_free(server.tree);
+  return 0;
+}